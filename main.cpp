@@ -5,6 +5,7 @@
 #include "src/code_visitor.hpp"
 #include "src/code_generator.hpp"
 #include "src/syntax_check.hpp"
+#include "src/optimizer.hpp"
 
 void print_help() {
     std::cout << "This is a compiler for a `Foc` language.\n";
@@ -14,6 +15,11 @@ void print_help() {
     std::cout << "\t -i `path` \t -> Compiles file on `path`\n";
     std::cout << "\t -o `path` \t -> Executable file's `path`\n";
     std::cout << "\t -d \t\t -> Enables debug mode for the compiler\n";
+    std::cout << "\t -O \t\t -> Enables optimizations\n";
+    std::cout << "\t --legacy-calls \t -> Uses the old stack only calling convention\n";
+    std::cout << "\t --peephole-stats \t -> Prints how often each peephole rule was applied (with -O)\n";
+    std::cout << "\t --frame-sizes \t -> Prints the stack frame size of every function\n";
+    std::cout << "\t --packed \t -> Stores chars and bools of arrays in one byte each\n";
     std::cout << "\t -e `num` \t -> Compilation stops after `num` errors (default 10)" << std::endl;
 }
 
@@ -28,6 +34,11 @@ int main(int argc, char* argv[]) {
     std::string out_file_name = "example";
     unsigned limit = 10;
     bool debug_mode = false;
+    bool optimize = false;
+    foc::CallingConvention calling_convention = foc::CallingConvention::NATIVE;
+    bool peephole_stats = false;
+    bool frame_sizes = false;
+    bool packed = false;
 
     for (unsigned i = 1; i < argc; ++i) {
         std::string curr = argv[i];
@@ -36,6 +47,16 @@ int main(int argc, char* argv[]) {
             return 1;
         } else if (curr == "-d") {
             debug_mode = true;
+        } else if (curr == "-O") {
+            optimize = true;
+        } else if (curr == "--legacy-calls") {
+            calling_convention = foc::CallingConvention::LEGACY;
+        } else if (curr == "--peephole-stats") {
+            peephole_stats = true;
+        } else if (curr == "--frame-sizes") {
+            frame_sizes = true;
+        } else if (curr == "--packed") {
+            packed = true;
         } else if (curr == "-e") {
             if (i + 1 >= argc) {
                 std::cout << "Invalid use, argument `-e` without number" << std::endl;
@@ -112,7 +133,20 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    foc::CodeGenerator code_gen(out_file_name + ".asm");
+    if (optimize) {
+        foc::optimize(program);
+        if (debug_mode) {
+            std::cout << program.to_string() << "\n----------------------\n" << std::endl;
+        }
+    }
+
+    foc::CodeGenerator code_gen(out_file_name + ".asm", {
+        .optimize = optimize,
+        .calling_convention = calling_convention,
+        .peephole_stats = peephole_stats,
+        .frame_sizes = frame_sizes,
+        .packed = packed,
+    });
     code_gen.generate_asm(program);
     std::string assembler_command{"nasm -f elf64 -o " + out_file_name + ".o " +
                 out_file_name + ".asm && ld -o " +
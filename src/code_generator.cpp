@@ -1,11 +1,15 @@
 #include "code_generator.hpp"
+#include "optimizer.hpp"
+#include "syntax_check.hpp"
 
 namespace foc {
 
 //*********************************************
 // Common:
-//     Allocation on stack is from biggest to smallest address, but
-//     memory blocks have their data in big endian (different direction).
+//     Allocation on stack is from biggest to smallest address, but memory
+//     blocks have their elements in ascending order, as in C. A block is
+//     addressed by its lowest byte, element i of an array at `base` is at
+//     `base + i * el_size` and elements of tuples follow each other upwards.
 //     Register rsp points to last allocated block of memory, not behind it.
 //
 // Functions:
@@ -21,12 +25,13 @@ namespace foc {
 //     We need to beware of registers overwriting in recursive generate_asm
 //     calls. Always use r_x for local computation and rN for specific use cases.
 //
-//     Return address is on [rbp], previous rbp is on [rbp + 8] and
-//     return value is on [rbp + 8 + ret_val_size].
+//     Previous rbp is on [rbp + 8], return address is on [rbp + 16] and
+//     return value starts at [rbp + 24].
 //
 // Expressions:
 //     After generating asm for expression, the result of it will always be
-//     first block of memory on the stack with its address in rax.
+//     first block of memory on the stack with its address in rax, i.e.
+//     rax is rsp + 8.
 //
 //     For ID we need to be able to use it as value and to assign values to it.
 //     So we always push the ID value on stack. But the address will point to
@@ -39,20 +44,728 @@ namespace foc {
 //     When in function scope, expression are always located on top of the stack,
 //     nothing else is inbetween them.
 //
+// Element access:
+//     Elements of locals, arguments and dereferenced pointers (and of their
+//     elements) are read through their address, which is computed directly,
+//     so only the element itself is copied to the stack. Other aggregates,
+//     e.g. function results, are evaluated as a whole first. Elements of 1, 2,
+//     4 or 8 bytes are addressed with a scaled index, e.g. [rax + rcx * 8].
+//
+//     Array and tuple literals reserve their block first and store every
+//     element to its place as soon as it's evaluated.
+//
+//     Assignments to variables, elements and dereferenced pointers compute
+//     only the address of the target and store the value there, any other
+//     target is evaluated to get its address in rbx.
+//
+// Constant literals:
+//     String, array and tuple literals made of constants only are stored once
+//     in .rodata, equal ones share their copy. Literals too big for unrolled
+//     stores are copied from there as a block, elements of constant arrays
+//     are read from there directly, without materializing the array.
+//
 // Moving:
 //     Because we allocate space for each variable or return value on stack,
 //     we need to be able to move memory blocks to the address of variables /
 //     return values.
 //
-//     For this purpose we have function move_memory_block, which simply moves
-//     the memory from address in rbx ending in address rsp to address in rax.
+//     For this purpose we have generate_move, which moves the memory block
+//     on top of the stack, at address in rbx, to address in rax and frees it,
+//     and generate_copy, which copies a block from rax to rcx. The size is
+//     always known, so small blocks are copied with unrolled movs and big ones
+//     with `rep movsq`, forwards unless the block moves up over itself.
+//
+// Induction variables (with optimizations):
+//     For a loop stepping `i` by a constant at the end of its body, every
+//     `arr[i + c]` goes through a pointer `rbp + i * el_size` kept in a
+//     register or hidden frame slot and stepped together with `i`. With `arr`
+//     starting at `rbp - local_address`, its element `i + c` is at
+//     `pointer - (local_address - c * el_size)`, a single subtraction of a
+//     constant instead of a multiplication. If `i` is read nowhere else, the
+//     exit test compares the pointer and `i` isn't updated at all.
+//
+//     Hidden slots are reserved at the start of the frame, before any local.
+//
+// Strength reduction:
+//     Multiplications by constants, also of indices by element sizes, are done
+//     with shifts and lea where possible. Divisions by constants use shifts
+//     for powers of two and a multiplication by a magic number otherwise, both
+//     rounding to zero as idiv does.
+//
+// Native calls:
+//     By default functions are entered with `call` and left with `ret`, so
+//     the return stack buffer predicts every return. The frame looks the same
+//     as above, only the return value isn't part of it.
+//
+//     Arguments are still evaluated on stack, then the first six 8 byte ones
+//     are loaded to rdi, rsi, rdx, rcx, r8 and r9. The callee moves them to
+//     their register or a hidden slot, the others stay on the stack where the
+//     caller pushed them. The caller drops all of them after the call.
+//
+//     Results up to 16 bytes are returned in rax and rdx. For bigger ones the
+//     caller reserves space before the arguments and passes its address as a
+//     hidden first argument.
+//
+//     Arrays and tuples bigger than max_value_argument_size are passed by
+//     reference, as an 8 byte address. A callee assigning to such argument or
+//     taking its address copies it to a hidden slot first. The caller passes
+//     the address of the argument itself, if it's a local (or its element)
+//     whose address isn't taken, otherwise the address of a temporary.
+//
+//     A call assigned to a local, which the callee can't see, gets the
+//     address of the local as the hidden pointer, so the result is written
+//     there directly.
 //
+//     A function with no frame slot at all, i.e. whose arguments come in
+//     registers and whose locals all live in registers, doesn't set up rbp.
+//     It pushes the callee saved registers it uses and reserves the free slot
+//     rsp points to. As the stack holds only the return value at a return,
+//     every return loads it to rax:rdx, pops the registers and leaves with
+//     `ret` on its own, without going through .fun_end.
 //
+//     A call through a value the optimizer narrowed down to a few functions
+//     compares the value against each of them and calls the matching one
+//     directly, the last one without a comparison.
+//
+//     The convention above stays available as CallingConvention::LEGACY.
+//
+// Conditions:
+//     Conditions of `if`, `elif` and `while` are compiled as a branch, i.e.
+//     comparisons become `cmp` and a conditional jump on their operands and
+//     `-` on a bool swaps the jump. A boolean is only pushed on the stack when
+//     the condition isn't a comparison.
+//
+//     `&&` and `||` short circuit in both contexts. As a condition they
+//     become a chain of branches, as a value the right operand is skipped
+//     when the left one already is the result.
+//
+//     An `if` / `elif` chain comparing the same side effect free int or char
+//     to distinct constants evaluates it once and jumps straight to the
+//     matching body. Dense values index a jump table placed right behind the
+//     indirect jump, sparse ones are found by a binary decision tree.
+//
+//     Loops are rotated: the condition is tested once before the loop and at
+//     the end of every iteration, jumping back while it holds, so an
+//     iteration takes a single branch. `continue` jumps to that test. Bodies
+//     ending with a jump, the last body of an `if` without `else` and the
+//     final return of a function fall through instead of jumping.
+//
+// Packed layout (CodeGenOptions::packed):
+//     Elements of char and bool arrays take a byte instead of 8, the array is
+//     padded to a multiple of 8 bytes. Byte element k lives at `base + k`.
+//
+//     Pointers to chars and bools read and write a single byte, so they can
+//     point at packed elements. Scalar chars and bools keep 8 byte slots,
+//     their value is in the lowest byte.
+//
+//     As all primitives are equivalent, `[#, N]` and `[@, N]` have the same
+//     type but not the same layout. Values are converted where they are
+//     stored: declarations, assignments, arguments and returns. Memory behind
+//     a pointer can't be converted, so a program converting pointers between
+//     the layouts, e.g. `*[#, N]` to `*[@, N]` or `*@` to `*#`, keeps the
+//     unpacked layout everywhere.
+//
+//
+
+
+// Copies `size` bytes from the block at rax to the block at rcx, overwrites
+// rcx, rdx, rsi and rdi. Overlapping blocks have to be copied to the higher
+// address.
+void CodeGenerator::generate_copy(int64_t size, bool may_overlap) {
+    if (size <= max_unrolled_copy_size) {
+        for (int64_t i = 0; i < size; i += 8) {
+            // Top down, if the block may move up over itself
+            int64_t offset = may_overlap ? size - 8 - i : i;
+            out_file << "    mov rdx, [rax + " << offset << "]\n"
+                     << "    mov [rcx + " << offset << "], rdx" << std::endl;
+        }
+    } else if (may_overlap) {
+        out_file << "    lea rsi, [rax + " << size - 8 << "]\n"
+                 << "    lea rdi, [rcx + " << size - 8 << "]\n"
+                 << "    mov rcx, " << size / 8 << "\n"
+                 << "    std\n"
+                 << "    rep movsq\n"
+                 << "    cld" << std::endl;
+    } else {
+        out_file << "    mov rsi, rax\n"
+                 << "    mov rdi, rcx\n"
+                 << "    mov rcx, " << size / 8 << "\n"
+                 << "    rep movsq" << std::endl;
+    }
+}
+
+// Moves `size` bytes from the block at rbx on top of the stack to the block
+// at rax and frees them from the stack, i.e. rsp ends up right above them
+void CodeGenerator::generate_move(int64_t size) {
+    if (size <= max_unrolled_copy_size) {
+        for (int64_t offset = 0; offset < size; offset += 8) {
+            out_file << "    mov rdx, [rbx + " << offset << "]\n"
+                     << "    mov [rax + " << offset << "], rdx" << std::endl;
+        }
+    } else {
+        out_file << "    mov rsi, rbx\n"
+                 << "    mov rdi, rax\n"
+                 << "    mov rcx, " << size / 8 << "\n"
+                 << "    rep movsq" << std::endl;
+    }
+    out_file << "    lea rsp, [rbx + " << size - 8 << "]" << std::endl;
+}
+
+// Offset of element `idx` from the start of a tuple
+int64_t tuple_offset(const Type::Tuple& tuple_type, int idx, bool packed) {
+    int64_t offset = 0;
+    for (int i = 0; i < idx; ++i) {
+        offset += tuple_type[i].byte_size(packed);
+    }
+    return offset;
+}
+
+// Converts the value of type `from` on top of the stack to the equivalent
+// type `to`, when they are stored differently, e.g. a string to `[#, n]`
+void CodeGenerator::generate_convert(const Type& from, const Type& to) {
+    if (same_layout(from, to)) {
+        return;
+    }
+    int64_t from_size = size_of(from);
+    int64_t to_size = size_of(to);
+    out_file << "    ; convert\n"
+             << "    sub rsp, " << to_size << std::endl;
+    convert_elements(from, to, 8 + to_size, 8);
+    out_file << "    lea rax, [rsp + 8]\n"
+             << "    lea rcx, [rsp + " << 8 + from_size << "]" << std::endl;
+    generate_copy(to_size, true);
+    out_file << "    add rsp, " << from_size << "\n"
+             << "    mov rax, rsp\n"
+             << "    add rax, 8\n" << std::endl;
+}
+
+// Converts the value at [rsp + from_address] to the one at [rsp + to_address]
+void CodeGenerator::convert_elements(const Type& from, const Type& to, int64_t from_address, int64_t to_address) {
+    if (same_layout(from, to)) {
+        out_file << "    lea rax, [rsp + " << from_address << "]\n"
+                 << "    lea rcx, [rsp + " << to_address << "]" << std::endl;
+        generate_copy(size_of(from));
+        return;
+    }
+
+    if (std::holds_alternative<Type::Tuple>(from.var)) {
+        const Type::Tuple& from_tuple = std::get<Type::Tuple>(from.var);
+        const Type::Tuple& to_tuple = std::get<Type::Tuple>(to.var);
+        for (size_t i = 0; i < from_tuple.size(); ++i) {
+            convert_elements(from_tuple[i], to_tuple[i], from_address + tuple_offset(from_tuple, i, options.packed),
+                             to_address + tuple_offset(to_tuple, i, options.packed));
+        }
+        return;
+    }
+
+    const Type::Array& from_array = std::get<Type::Array>(from.var);
+    const Type& to_el = std::get<Type::Array>(to.var).first;
+    int64_t from_el_size = el_size(from);
+    int64_t to_el_size = el_size(to);
+    if (!std::holds_alternative<Type::Primitive>(to_el.var)) {
+        for (int i = 0; i < from_array.second; ++i) {
+            convert_elements(from_array.first, to_el, from_address + i * from_el_size, to_address + i * to_el_size);
+        }
+        return;
+    }
+
+    // Packed to words or back, element by element
+    int64_t id = id_gen++;
+    out_file << "    lea rax, [rsp + " << from_address << "]\n"
+             << "    lea rbx, [rsp + " << to_address << "]\n"
+             << "    mov rcx, " << from_array.second << "\n"
+             << "  .convert" << id << ":\n"
+             << (from_el_size == 1 ? "    movzx rdx, byte [rax]\n" : "    mov rdx, [rax]\n")
+             << (to_el_size == 1 ? "    mov [rbx], dl\n" : "    mov [rbx], rdx\n")
+             << "    add rax, " << from_el_size << "\n"
+             << "    add rbx, " << to_el_size << "\n"
+             << "    dec rcx\n"
+             << "    jnz .convert" << id << std::endl;
+}
+
+std::string frame_ref(int64_t local_address) {
+    if (local_address < 0) {
+        return "[rbp + " + std::to_string(-local_address) + "]";
+    }
+    return "[rbp - " + std::to_string(local_address) + "]";
+}
+
+// Register or memory operand of an 8 byte symbol
+std::string operand(const Symbol& symbol) {
+    if (symbol.reg) {
+        return *symbol.reg;
+    }
+    return "qword " + frame_ref(symbol.local_address);
+}
+
+// Argument registers of the native convention, none for arguments passed on stack
+std::vector<std::optional<std::string>> native_arg_registers(const std::vector<int64_t>& arg_sizes, bool hidden_pointer) {
+    std::vector<std::optional<std::string>> res;
+    size_t next = hidden_pointer ? 1 : 0;
+    for (int64_t arg_size : arg_sizes) {
+        if (arg_size == 8 && next < argument_registers.size()) {
+            res.push_back(argument_registers[next++]);
+        } else {
+            res.emplace_back();
+        }
+    }
+    return res;
+}
+
+bool CodeGenerator::passed_by_reference(const Type& type) const {
+    bool aggregate = std::holds_alternative<Type::Array>(type.var) || std::holds_alternative<Type::Tuple>(type.var);
+    return options.calling_convention == CallingConvention::NATIVE && aggregate
+        && size_of(type) > max_value_argument_size;
+}
+
+// Size of an argument on the stack
+int64_t CodeGenerator::passed_size(const Type& type) const {
+    return passed_by_reference(type) ? 8 : size_of(type);
+}
+
+const Symbol& CodeGenerator::find_symbol(const ID& id) const {
+    for (auto it = fun_scope.scopes_sym_tables.rbegin(); it != fun_scope.scopes_sym_tables.rend(); ++it) {
+        auto sym_it = it->find(id);
+        if (sym_it != it->end()) {
+            return sym_it->second;
+        }
+    }
+    throw std::logic_error("Bug in syntax check, unknown id " + id.name + " -- find_symbol");
+}
+
+int64_t CodeGenerator::size_of(const Type& type) const {
+    return type.byte_size(options.packed);
+}
+
+int64_t CodeGenerator::el_size(const Type& array_type) const {
+    return array_type.element_size(options.packed);
+}
+
+// Whether values of two equivalent types are stored the same way, i.e. no
+// conversion is needed between them
+bool CodeGenerator::same_layout(const Type& a, const Type& b) const {
+    if (std::holds_alternative<Type::Array>(a.var) && std::holds_alternative<Type::Array>(b.var)) {
+        return el_size(a) == el_size(b)
+            && same_layout(std::get<Type::Array>(a.var).first, std::get<Type::Array>(b.var).first);
+    }
+    if (std::holds_alternative<Type::Tuple>(a.var) && std::holds_alternative<Type::Tuple>(b.var)) {
+        const Type::Tuple& a_tuple = std::get<Type::Tuple>(a.var);
+        const Type::Tuple& b_tuple = std::get<Type::Tuple>(b.var);
+        for (size_t i = 0; i < a_tuple.size() && i < b_tuple.size(); ++i) {
+            if (!same_layout(a_tuple[i], b_tuple[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Size of what a pointer points to, a char or bool is a byte in the packed layout
+int64_t CodeGenerator::pointee_size(const Type& ptr_type) const {
+    const Type& pointee = *std::get<Type::Ptr>(ptr_type.var);
+    if (options.packed && std::holds_alternative<Type::Primitive>(pointee.var)
+            && std::get<Type::Primitive>(pointee.var) != Type::Primitive::INT) {
+        return 1;
+    }
+    return size_of(pointee);
+}
+
+// Whether an lvalue is a single byte, i.e. a packed element or a char or bool behind a pointer
+bool CodeGenerator::is_byte(const Expr& expr) const {
+    if (std::holds_alternative<DerefArray>(expr.var)) {
+        return el_size(*std::get<DerefArray>(expr.var).array_expr->type) == 1;
+    }
+    if (std::holds_alternative<TypeExpr>(expr.var) && std::holds_alternative<PtrExpr>(std::get<TypeExpr>(expr.var).expr)) {
+        const PtrExpr& ptr_expr = std::get<PtrExpr>(std::get<TypeExpr>(expr.var).expr);
+        return ptr_expr.deref_expr && pointee_size(*ptr_expr.deref_expr->type) == 1;
+    }
+    return false;
+}
+
+// Whether the parts of two equivalent types reached through pointers are laid
+// out the same way when packed, `pointed` once behind a pointer
+bool same_pointed_layout(const Type& a, const Type& b, bool pointed) {
+    if (std::holds_alternative<Type::Primitive>(a.var) && std::holds_alternative<Type::Primitive>(b.var)) {
+        bool a_byte = std::get<Type::Primitive>(a.var) != Type::Primitive::INT;
+        bool b_byte = std::get<Type::Primitive>(b.var) != Type::Primitive::INT;
+        return !pointed || a_byte == b_byte;
+    }
+    if (std::holds_alternative<Type::Array>(a.var) && std::holds_alternative<Type::Array>(b.var)) {
+        if (pointed && a.element_size(true) != b.element_size(true)) {
+            return false;
+        }
+        return same_pointed_layout(std::get<Type::Array>(a.var).first, std::get<Type::Array>(b.var).first, pointed);
+    }
+    if (std::holds_alternative<Type::Tuple>(a.var) && std::holds_alternative<Type::Tuple>(b.var)) {
+        const Type::Tuple& a_tuple = std::get<Type::Tuple>(a.var);
+        const Type::Tuple& b_tuple = std::get<Type::Tuple>(b.var);
+        for (size_t i = 0; i < a_tuple.size() && i < b_tuple.size(); ++i) {
+            if (!same_pointed_layout(a_tuple[i], b_tuple[i], pointed)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (std::holds_alternative<Type::Ptr>(a.var) && std::holds_alternative<Type::Ptr>(b.var)) {
+        return same_pointed_layout(*std::get<Type::Ptr>(a.var), *std::get<Type::Ptr>(b.var), true);
+    }
+    if (std::holds_alternative<Type::Fun>(a.var) && std::holds_alternative<Type::Fun>(b.var)) {
+        // Arguments and results are converted to the type of the called value, not of the function
+        const Type::Fun& a_fun = std::get<Type::Fun>(a.var);
+        const Type::Fun& b_fun = std::get<Type::Fun>(b.var);
+        for (size_t i = 0; i < a_fun.first.size() && i < b_fun.first.size(); ++i) {
+            if (!same_pointed_layout(a_fun.first[i], b_fun.first[i], true)) {
+                return false;
+            }
+        }
+        return same_pointed_layout(a_fun.second, b_fun.second, true);
+    }
+    return true;
+}
+
+// Whether a declaration, assignment or return of the body converts pointers between the layouts
+bool mixes_packed_layouts(const FunBody& fun_body, const Type& ret_type) {
+    for (const FunBodyPart& part : fun_body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.type && var_decl.expr && !same_pointed_layout(*var_decl.type, *var_decl.expr->type, false)) {
+                return true;
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            const Assign& assign = std::get<Assign>(part.var);
+            if (!same_pointed_layout(*assign.assign_expr.type, *assign.expr.type, false)) {
+                return true;
+            }
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    if (mixes_packed_layouts(if_cond.body, ret_type)) {
+                        return true;
+                    }
+                }
+                if (cond.else_body && mixes_packed_layouts(*cond.else_body, ret_type)) {
+                    return true;
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                if (mixes_packed_layouts(std::get<Loop>(flow.var).body, ret_type)) {
+                    return true;
+                }
+            } else {
+                const Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second && !same_pointed_layout(ret_type, *control.second->type, false)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Whether the program converts pointers between the layouts anywhere, arguments
+// and array literals included
+bool mixes_packed_layouts(const Program& program) {
+    for (const FunDecl& fun_decl : program.decls) {
+        if (mixes_packed_layouts(fun_decl.body, fun_decl.ret_type)) {
+            return true;
+        }
+        bool mixes = false;
+        walk(fun_decl.body, [&](const Expr& expr) {
+            if (std::holds_alternative<FunCall>(expr.var)) {
+                const FunCall& fun_call = std::get<FunCall>(expr.var);
+                const Type::Tuple& params = std::get<Type::Fun>(fun_call.fun->type->var).first;
+                for (size_t i = 0; fun_call.fun_args && i < fun_call.fun_args->size() && i < params.size(); ++i) {
+                    mixes |= !same_pointed_layout(params[i], *(*fun_call.fun_args)[i].type, false);
+                }
+            } else if (std::holds_alternative<TypeExpr>(expr.var)
+                       && std::holds_alternative<ArrayExpr>(std::get<TypeExpr>(expr.var).expr)) {
+                const auto& exprs = std::get<ArrayExpr>(std::get<TypeExpr>(expr.var).expr).exprs;
+                for (const Expr& el_expr : exprs) {
+                    mixes |= !same_pointed_layout(*exprs.front().type, *el_expr.type, false);
+                }
+            }
+        });
+        if (mixes) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// c for index `var`, `var + c`, `c + var` or `var - c`, possibly nested
+std::optional<int64_t> index_displacement(const Expr& index, const ID& var) {
+    if (index.minus) {
+        return {};
+    }
+    if (std::holds_alternative<ID>(index.var)) {
+        return std::get<ID>(index.var) == var ? std::optional<int64_t>(0) : std::nullopt;
+    }
+    if (!std::holds_alternative<BinOperation>(index.var)) {
+        return {};
+    }
+    const auto& bin_op = std::get<BinOperation>(index.var);
+    if (bin_op.op != BinOperation::PLUS && bin_op.op != BinOperation::MINUS) {
+        return {};
+    }
+    auto left = index_displacement(*bin_op.left_expr, var);
+    auto right = get_valid_index(*bin_op.right_expr);
+    if (left && right) {
+        return bin_op.op == BinOperation::PLUS ? *left + *right : *left - *right;
+    }
+    if (bin_op.op == BinOperation::PLUS) {
+        auto constant = get_valid_index(*bin_op.left_expr);
+        auto displacement = index_displacement(*bin_op.right_expr, var);
+        if (constant && displacement) {
+            return *constant + *displacement;
+        }
+    }
+    return {};
+}
+
+int64_t count_reads(const Expr& expr, const ID& id) {
+    int64_t reads = 0;
+    walk(expr, [&](const Expr& sub_expr) {
+        reads += std::holds_alternative<ID>(sub_expr.var) && std::get<ID>(sub_expr.var) == id;
+    });
+    return reads;
+}
+
+int64_t count_reads(const FunBody& fun_body, const ID& id) {
+    int64_t reads = 0;
+    for (const FunBodyPart& part : fun_body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                reads += count_reads(*var_decl.expr, id);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            // Plain assignment to the id only writes it
+            const Assign& assign = std::get<Assign>(part.var);
+            reads += count_reads(assign.expr, id);
+            if (!std::holds_alternative<ID>(assign.assign_expr.var)) {
+                reads += count_reads(assign.assign_expr, id);
+            }
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            reads += count_reads(std::get<Expr>(part.var), id);
+        } else if (std::holds_alternative<Print>(part.var)) {
+            reads += count_reads(std::get<Print>(part.var).expr, id);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    reads += count_reads(if_cond.expr, id) + count_reads(if_cond.body, id);
+                }
+                if (cond.else_body) {
+                    reads += count_reads(*cond.else_body, id);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                const Loop& loop = std::get<Loop>(flow.var);
+                reads += count_reads(loop.expr, id) + count_reads(loop.body, id);
+            } else {
+                const Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    reads += count_reads(*control.second, id);
+                }
+            }
+        }
+    }
+    return reads;
+}
+
+// Whether every entry to the loop at `idx` passes a fresh definition of `id`,
+// i.e. the closest earlier statement of the body that touches `id` sets it
+bool defined_before(const FunBody& body, size_t idx, const ID& id) {
+    while (idx-- > 0) {
+        const FunBodyPart& part = body.parts[idx];
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const auto& ids = std::get<VarDecl>(part.var).ids;
+            if (ids && std::find(ids->begin(), ids->end(), id) != ids->end()) {
+                return true;
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            const Assign& assign = std::get<Assign>(part.var);
+            if (std::holds_alternative<ID>(assign.assign_expr.var) && std::get<ID>(assign.assign_expr.var) == id) {
+                return count_reads(assign.expr, id) == 0;
+            }
+        }
+
+        FunBody single;
+        single.parts.push_back(part);
+        std::unordered_set<ID> assigned;
+        bool writes_memory = false;
+        collect_assigned(single, assigned, writes_memory);
+        if (assigned.count(id) || count_reads(single, id)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+std::optional<InductionLoop> find_induction_loop(const FunBody& loops_body, size_t idx, const FunBody& fun_body,
+                                                const std::unordered_set<ID>& address_taken,
+                                                const std::unordered_set<ID>& reference_args, bool packed) {
+    const Loop& loop = std::get<Loop>(std::get<Flow>(loops_body.parts[idx].var).var);
+    if (loop.body.parts.empty() || !std::holds_alternative<Assign>(loop.body.parts.back().var)) {
+        return {};
+    }
+    const Expr& target = std::get<Assign>(loop.body.parts.back().var).assign_expr;
+    bool is_int = std::holds_alternative<Type::Primitive>(target.type->var)
+        && std::get<Type::Primitive>(target.type->var) == Type::Primitive::INT;
+    if (!std::holds_alternative<ID>(target.var) || !is_int) {
+        return {};
+    }
+    const ID& var = std::get<ID>(target.var);
+    auto step = constant_step(loop.body.parts.back(), var);
+    if (!step || address_taken.count(var)) {
+        return {};
+    }
 
+    FunBody rest;
+    rest.parts.assign(loop.body.parts.begin(), loop.body.parts.end() - 1);
+    std::unordered_set<ID> assigned;
+    bool writes_memory = false;
+    collect_assigned(rest, assigned, writes_memory);
+    if (assigned.count(var)) {
+        return {};
+    }
+
+    InductionLoop res{ .var = var, .step = *step };
+    int64_t index_reads = 0;
+    auto find_pointers = [&](const Expr& expr) {
+        if (!std::holds_alternative<DerefArray>(expr.var)) {
+            return;
+        }
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        if (!std::holds_alternative<ID>(deref_array.array_expr->var) || deref_array.array_expr->minus
+                || reference_args.count(std::get<ID>(deref_array.array_expr->var))
+                || !index_displacement(*deref_array.deref_expr, var)) {
+            return;
+        }
+        ++index_reads;
+        int64_t el_size = deref_array.array_expr->type->element_size(packed);
+        auto same_size = [&](const InductionPointer& pointer) { return pointer.el_size == el_size; };
+        if (std::find_if(res.pointers.begin(), res.pointers.end(), same_size) == res.pointers.end()) {
+            res.pointers.push_back(InductionPointer{ .el_size = el_size });
+        }
+    };
+    walk(loop.expr, find_pointers);
+    walk(rest, find_pointers);
+    if (res.pointers.empty()) {
+        return res;
+    }
+
+    // The exit test can move to the pointer, if `var` isn't needed for anything else.
+    // `var` then keeps its entry value, so it must be dead after the loop and set
+    // again before each entry
+    if (loop.expr.minus || !std::holds_alternative<BinOperation>(loop.expr.var)) {
+        return res;
+    }
+    const auto& cond = std::get<BinOperation>(loop.expr.var);
+    auto is_var = [&](const Expr& expr) {
+        return !expr.minus && std::holds_alternative<ID>(expr.var) && std::get<ID>(expr.var) == var;
+    };
+    BinOperation::Operator op = cond.op;
+    std::shared_ptr<Expr> bound = cond.right_expr;
+    if (!is_var(*cond.left_expr)) {
+        bound = cond.left_expr;
+        op = op == BinOperation::LESS    ? BinOperation::GREATER
+           : op == BinOperation::GREATER ? BinOperation::LESS
+           : op == BinOperation::LEQ     ? BinOperation::GEQ
+           : op == BinOperation::GEQ     ? BinOperation::LEQ
+           : op;
+        if (!is_var(*cond.right_expr)) {
+            return res;
+        }
+    }
+    bool invariant_bound = get_valid_index(*bound).has_value();
+    if (!bound->minus && std::holds_alternative<ID>(bound->var)) {
+        const ID& bound_id = std::get<ID>(bound->var);
+        invariant_bound = bound_id != var && !assigned.count(bound_id) && !(writes_memory && address_taken.count(bound_id));
+    }
+    bool is_comparison = op != BinOperation::PLUS && op != BinOperation::MINUS && op != BinOperation::STAR
+        && op != BinOperation::SLASH && op != BinOperation::AND && op != BinOperation::OR;
+    int64_t loop_reads = count_reads(loop.expr, var) + count_reads(loop.body, var);
+    if (invariant_bound && is_comparison && loop_reads == 2 + index_reads && count_reads(fun_body, var) == loop_reads
+            && defined_before(loops_body, idx, var)) {
+        res.exit_op = op;
+        res.bound = bound;
+    }
+    return res;
+}
+
+void CodeGenerator::plan_induction_loops(const FunBody& fun_body, const FunBody& loops_body) {
+    for (size_t idx = 0; idx < loops_body.parts.size(); ++idx) {
+        if (!std::holds_alternative<Flow>(loops_body.parts[idx].var)) {
+            continue;
+        }
+        const Flow& flow = std::get<Flow>(loops_body.parts[idx].var);
+        if (std::holds_alternative<Cond>(flow.var)) {
+            const Cond& cond = std::get<Cond>(flow.var);
+            for (const IfCond& if_cond : cond.if_conds) {
+                plan_induction_loops(fun_body, if_cond.body);
+            }
+            if (cond.else_body) {
+                plan_induction_loops(fun_body, *cond.else_body);
+            }
+        } else if (std::holds_alternative<Loop>(flow.var)) {
+            const Loop& loop = std::get<Loop>(flow.var);
+            auto induction_loop = find_induction_loop(loops_body, idx, fun_body, address_taken, reference_args, options.packed);
+            if (induction_loop && !induction_loop->pointers.empty()) {
+                induction_loops[&loop] = *induction_loop;
+                induction_loops_order.push_back(&loop);
+            }
+            plan_induction_loops(fun_body, loop.body);
+        }
+    }
+}
+
+std::optional<std::pair<InductionPointer, int64_t>> CodeGenerator::induction_pointer(const DerefArray& deref_array) const {
+    if (!std::holds_alternative<ID>(deref_array.array_expr->var) || deref_array.array_expr->minus
+            || find_symbol(std::get<ID>(deref_array.array_expr->var)).by_reference) {
+        return {};
+    }
+    int64_t size = el_size(*deref_array.array_expr->type);
+    for (auto it = active_induction_loops.rbegin(); it != active_induction_loops.rend(); ++it) {
+        auto displacement = index_displacement(*deref_array.deref_expr, (*it)->var);
+        if (!displacement) {
+            continue;
+        }
+        for (const InductionPointer& pointer : (*it)->pointers) {
+            if (pointer.el_size == size) {
+                // arr + (i + c) * size = (rbp + i * size) - (local_address - c * size)
+                const Symbol& array = find_symbol(std::get<ID>(deref_array.array_expr->var));
+                return std::make_pair(pointer, array.local_address - *displacement * size);
+            }
+        }
+    }
+    return {};
+}
 
 void CodeGenerator::generate_asm(const Expr& expr) {
-    expr.var.visit([&](auto arg) { generate_asm(arg); });
-    if (expr.minus) {
+    if (options.optimize && std::holds_alternative<BinOperation>(expr.var) && generate_selected(expr)) {
+        return;
+    }
+    // Big constant literals are copied from .rodata as a block
+    auto bytes = constant_bytes(expr);
+    if (bytes && int64_t(bytes->size()) > max_unrolled_copy_size) {
+        out_file << "    sub rsp, " << bytes->size() << " ; constant literal\n"
+                 << "    mov rax, " << literal_label(*bytes) << "\n"
+                 << "    lea rcx, [rsp + 8]" << std::endl;
+        generate_copy(bytes->size());
+        out_file << "    mov rax, rsp\n"
+                 << "    add rax, 8" << std::endl;
+        return;
+    }
+    expr.var.visit([&](const auto& arg) { generate_asm(arg); });
+    bool is_bool = expr.type && std::holds_alternative<Type::Primitive>(expr.type->var)
+        && std::get<Type::Primitive>(expr.type->var) == Type::Primitive::BOOL;
+    if (expr.minus && is_bool) {
+        out_file << "    pop_ rbx\n"
+                 << "    xor rbx, 1\n"
+                 << "    push_ rbx" << std::endl;
+    } else if (expr.minus) {
         out_file << "    pop_ rbx\n"
                  << "    neg rbx\n"
                  << "    push_ rbx" << std::endl;
@@ -60,10 +773,169 @@ void CodeGenerator::generate_asm(const Expr& expr) {
 }
 
 void CodeGenerator::generate_asm(const TypeExpr& type_expr) {
-    std::visit([&](auto arg) { generate_asm(arg); }, type_expr.expr);
+    std::visit([&](const auto& arg) { generate_asm(arg); }, type_expr.expr);
+}
+
+// Multiplier and shift for signed division by `divisor` through a multiplication
+// (Hacker's Delight, 10-1), `divisor` mustn't be 0, 1 or -1
+std::pair<int64_t, int> signed_magic(int64_t divisor) {
+    const uint64_t two63 = uint64_t(1) << 63;
+    uint64_t abs_divisor = divisor < 0 ? -uint64_t(divisor) : uint64_t(divisor);
+    uint64_t t = two63 + (uint64_t(divisor) >> 63);
+    uint64_t abs_nc = t - 1 - t % abs_divisor;
+    int p = 63;
+    uint64_t q1 = two63 / abs_nc;
+    uint64_t r1 = two63 - q1 * abs_nc;
+    uint64_t q2 = two63 / abs_divisor;
+    uint64_t r2 = two63 - q2 * abs_divisor;
+    uint64_t delta;
+    do {
+        ++p;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= abs_nc) {
+            ++q1;
+            r1 -= abs_nc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= abs_divisor) {
+            ++q2;
+            r2 -= abs_divisor;
+        }
+        delta = abs_divisor - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint64_t multiplier = q2 + 1;
+    return { divisor < 0 ? int64_t(-multiplier) : int64_t(multiplier), p - 64 };
+}
+
+int64_t multiply_cost(int64_t factor) {
+    if (factor == 0) {
+        return 1;
+    }
+    uint64_t abs_factor = factor < 0 ? -uint64_t(factor) : uint64_t(factor);
+    int shift = __builtin_ctzll(abs_factor);
+    uint64_t odd = abs_factor >> shift;
+    int64_t res = (shift > 0 ? 1 : 0) + (factor < 0 ? 1 : 0);
+    if (odd == 3 || odd == 5 || odd == 9) {
+        return res + 1;
+    } else if (odd != 1 && (((odd - 1) & (odd - 2)) == 0 || ((odd + 1) & odd) == 0)) {
+        return res + 3;
+    } else if (odd != 1) {
+        return 3;
+    }
+    return res;
+}
+
+bool is_scale(int64_t factor) {
+    return factor == 1 || factor == 2 || factor == 4 || factor == 8;
+}
+
+// Multiplies `reg` by a constant, with shifts and lea where they do, `scratch` may be overwritten
+void CodeGenerator::generate_multiply(const std::string& reg, int64_t factor, const std::string& scratch) {
+    if (factor == 0) {
+        out_file << "    xor " << reg << ", " << reg << std::endl;
+        return;
+    }
+    uint64_t abs_factor = factor < 0 ? -uint64_t(factor) : uint64_t(factor);
+    int shift = __builtin_ctzll(abs_factor);
+    uint64_t odd = abs_factor >> shift;
+    if (odd == 3 || odd == 5 || odd == 9) {
+        out_file << "    lea " << reg << ", [" << reg << " + " << reg << " * " << odd - 1 << "]" << std::endl;
+    } else if (odd != 1 && ((odd - 1) & (odd - 2)) == 0) {
+        out_file << "    mov " << scratch << ", " << reg << "\n"
+                 << "    shl " << reg << ", " << __builtin_ctzll(odd - 1) << "\n"
+                 << "    add " << reg << ", " << scratch << std::endl;
+    } else if (odd != 1 && ((odd + 1) & odd) == 0) {
+        out_file << "    mov " << scratch << ", " << reg << "\n"
+                 << "    shl " << reg << ", " << __builtin_ctzll(odd + 1) << "\n"
+                 << "    sub " << reg << ", " << scratch << std::endl;
+    } else if (odd != 1) {
+        out_file << "    imul " << reg << ", " << reg << ", " << factor << std::endl;
+        return;
+    }
+    if (shift > 0) {
+        out_file << "    shl " << reg << ", " << shift << std::endl;
+    }
+    if (factor < 0) {
+        out_file << "    neg " << reg << std::endl;
+    }
+}
+
+// Signed division of rax by a constant other than 0, rounding to zero like idiv, overwrites rcx and rdx
+void CodeGenerator::generate_divide(int64_t divisor) {
+    uint64_t abs_divisor = divisor < 0 ? -uint64_t(divisor) : uint64_t(divisor);
+    if ((abs_divisor & (abs_divisor - 1)) == 0) {
+        // Negative dividends are biased by divisor - 1 to round to zero
+        int shift = __builtin_ctzll(abs_divisor);
+        if (shift > 0) {
+            out_file << "    mov rcx, rax\n"
+                     << "    sar rcx, 63\n"
+                     << "    shr rcx, " << 64 - shift << "\n"
+                     << "    add rax, rcx\n"
+                     << "    sar rax, " << shift << std::endl;
+        }
+        if (divisor < 0) {
+            out_file << "    neg rax" << std::endl;
+        }
+        return;
+    }
+
+    auto [multiplier, shift] = signed_magic(divisor);
+    out_file << "    mov rcx, rax\n"
+             << "    mov rax, " << multiplier << "\n"
+             << "    imul rcx" << std::endl;
+    if (divisor > 0 && multiplier < 0) {
+        out_file << "    add rdx, rcx" << std::endl;
+    } else if (divisor < 0 && multiplier > 0) {
+        out_file << "    sub rdx, rcx" << std::endl;
+    }
+    if (shift > 0) {
+        out_file << "    sar rdx, " << shift << std::endl;
+    }
+    // Negative quotients are one too small
+    out_file << "    mov rax, rdx\n"
+             << "    shr rax, 63\n"
+             << "    add rax, rdx" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const BinOperation& bin_op) {
+    if (bin_op.op == BinOperation::AND || bin_op.op == BinOperation::OR) {
+        // The left value is the result when it decides the operation
+        int64_t id = id_gen++;
+        generate_asm(*bin_op.left_expr);
+        out_file << "    ; short circuit\n"
+                 << "    cmp qword [rsp + 8], 0\n"
+                 << "    " << (bin_op.op == BinOperation::AND ? "je" : "jne") << " .short_circuit" << id << "\n"
+                 << "    add rsp, 8" << std::endl;
+        generate_asm(*bin_op.right_expr);
+        out_file << "  .short_circuit" << id << ":\n"
+                 << "    mov rax, rsp\n"
+                 << "    add rax, 8" << std::endl;
+        return;
+    }
+
+    if (bin_op.op == BinOperation::STAR || bin_op.op == BinOperation::SLASH) {
+        auto right = get_valid_index(*bin_op.right_expr);
+        auto left = bin_op.op == BinOperation::STAR ? get_valid_index(*bin_op.left_expr) : std::nullopt;
+        if (right && (bin_op.op == BinOperation::STAR || *right != 0)) {
+            left.reset();
+        } else {
+            right.reset();
+        }
+        if (left || right) {
+            generate_asm(left ? *bin_op.right_expr : *bin_op.left_expr);
+            out_file << "    mov rax, [rsp + 8]" << std::endl;
+            if (bin_op.op == BinOperation::STAR) {
+                generate_multiply("rax", left ? *left : *right, "rcx");
+            } else {
+                generate_divide(*right);
+            }
+            out_file << "    mov [rsp + 8], rax" << std::endl;
+            return;
+        }
+    }
+
     generate_asm(*bin_op.left_expr);
     generate_asm(*bin_op.right_expr);
     generate_asm(bin_op.op);
@@ -97,51 +969,365 @@ void CodeGenerator::generate_asm(BinOperation::Operator op) {
     }
 }
 
+// Whether the address of `expr` can be computed without evaluating it as a whole
+bool CodeGenerator::is_addressable(const Expr& expr) const {
+    if (expr.minus) {
+        return false;
+    }
+    if (std::holds_alternative<ID>(expr.var)) {
+        const ID& id = std::get<ID>(expr.var);
+        return !fun_ids.count(id) && !find_symbol(id).reg;
+    }
+    if (std::holds_alternative<DerefArray>(expr.var)) {
+        return is_addressable(*std::get<DerefArray>(expr.var).array_expr);
+    }
+    if (std::holds_alternative<DerefTuple>(expr.var)) {
+        return is_addressable(*std::get<DerefTuple>(expr.var).tuple_expr);
+    }
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        return std::holds_alternative<PtrExpr>(type_expr.expr) && std::get<PtrExpr>(type_expr.expr).deref_expr;
+    }
+    return false;
+}
+
+// Frame address of a variable or its element at a constant position
+std::optional<int64_t> CodeGenerator::constant_address(const Expr& expr) const {
+    if (expr.minus) {
+        return {};
+    }
+    if (std::holds_alternative<ID>(expr.var)) {
+        const ID& id = std::get<ID>(expr.var);
+        if (fun_ids.count(id)) {
+            return {};
+        }
+        const Symbol& symbol = find_symbol(id);
+        if (symbol.reg || symbol.by_reference) {
+            return {};
+        }
+        return symbol.local_address;
+    }
+    if (std::holds_alternative<DerefArray>(expr.var)) {
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        auto base = constant_address(*deref_array.array_expr);
+        auto index = get_valid_index(*deref_array.deref_expr);
+        int64_t size = el_size(*deref_array.array_expr->type);
+        if (!base || !index || size < 8) {
+            return {};
+        }
+        return *base - *index * size;
+    }
+    if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        auto base = constant_address(*deref_tuple.tuple_expr);
+        if (!base) {
+            return {};
+        }
+        int tuple_idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+        return *base - tuple_offset(std::get<Type::Tuple>(deref_tuple.tuple_expr->type->var), tuple_idx, options.packed);
+    }
+    return {};
+}
+
+// Computes the address of an addressable expression to rax, the stack stays as it was
+void CodeGenerator::generate_address(const Expr& expr) {
+    if (std::holds_alternative<ID>(expr.var)) {
+        generate_address(std::get<ID>(expr.var));
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        generate_address(std::get<DerefArray>(expr.var));
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        int tuple_idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+        int64_t offset = tuple_offset(std::get<Type::Tuple>(deref_tuple.tuple_expr->type->var), tuple_idx, options.packed);
+        generate_address(*deref_tuple.tuple_expr);
+        if (offset != 0) {
+            out_file << "    add rax, " << offset << std::endl;
+        }
+    } else if (is_addressable(expr)) {
+        generate_asm(*std::get<PtrExpr>(std::get<TypeExpr>(expr.var).expr).deref_expr);
+        out_file << "    pop_ rax" << std::endl;
+    } else {
+        throw std::logic_error("Bug in code generator, expression has no address -- generate_address");
+    }
+}
+
+void CodeGenerator::generate_address(const ID& id) {
+    const Symbol& symbol = find_symbol(id);
+    if (symbol.by_reference) {
+        out_file << "    mov rax, " << operand(symbol) << std::endl;
+    } else {
+        out_file << "    lea rax, " << frame_ref(symbol.local_address) << std::endl;
+    }
+}
+
+void CodeGenerator::generate_address(const DerefArray& deref_array) {
+    int64_t array_el_size = el_size(*deref_array.array_expr->type);
+
+    if (auto pointer = induction_pointer(deref_array)) {
+        out_file << "    ; induction deref\n"
+                 << "    mov rax, " << operand(pointer->first.location) << "\n"
+                 << "    sub rax, " << pointer->second << std::endl;
+        return;
+    }
+
+    generate_address(*deref_array.array_expr);
+    if (auto index = get_valid_index(*deref_array.deref_expr)) {
+        int64_t displacement = *index * array_el_size;
+        if (displacement > 0) {
+            out_file << "    add rax, " << displacement << std::endl;
+        } else if (displacement < 0) {
+            out_file << "    sub rax, " << -displacement << std::endl;
+        }
+        return;
+    }
+    auto index = direct_operand(*deref_array.deref_expr);
+    if (!index) {
+        out_file << "    push_ rax" << std::endl;
+        generate_asm(*deref_array.deref_expr);
+        out_file << "    pop_ rcx\n"
+                 << "    pop_ rax" << std::endl;
+        index = "rcx";
+    }
+    if (is_scale(array_el_size)) {
+        out_file << "    lea rax, [rax + " << *index << " * " << array_el_size << "]" << std::endl;
+        return;
+    }
+    if (*index != "rcx") {
+        out_file << "    mov rcx, " << *index << std::endl;
+    }
+    generate_multiply("rcx", array_el_size, "rdx");
+    out_file << "    add rax, rcx" << std::endl;
+}
+
+// Pushes the `size` bytes at rax, rbx keeps their address. A single byte, i.e.
+// a packed element, is pushed as an 8 byte value
+void CodeGenerator::generate_load(int64_t size) {
+    out_file << "    mov rbx, rax" << std::endl;
+    if (size <= 8) {
+        out_file << (size == 1 ? "    movzx rcx, byte [rax]\n" : "    mov rcx, [rax]\n")
+                 << "    push_ rcx" << std::endl;
+    } else {
+        out_file << "    lea rcx, [rsp - " << size - 8 << "]" << std::endl;
+        generate_copy(size);
+        out_file << "    sub rsp, " << size << std::endl;
+    }
+    out_file << "    mov rax, rsp\n"
+             << "    add rax, 8\n" << std::endl;
+}
+
 void CodeGenerator::generate_asm(const DerefArray& deref_array) {
-    int64_t array_el_size = std::get<Type::Array>(deref_array.array_expr->type->var).first.byte_size();
+    int64_t array_el_size = el_size(*deref_array.array_expr->type);
+
+    if (is_addressable(*deref_array.array_expr)) {
+        out_file << "    ; array element" << std::endl;
+        generate_address(deref_array);
+        generate_load(array_el_size);
+        return;
+    }
+
+    // Elements of constant literals are read from .rodata
+    if (auto bytes = constant_bytes(*deref_array.array_expr)) {
+        std::string label = literal_label(*bytes);
+        out_file << "    ; constant array element" << std::endl;
+        generate_asm(*deref_array.deref_expr);
+        out_file << "    pop_ rax\n"
+                 << "    mov rcx, " << label << std::endl;
+        if (is_scale(array_el_size)) {
+            out_file << "    lea rax, [rcx + rax * " << array_el_size << "]" << std::endl;
+        } else {
+            generate_multiply("rax", array_el_size, "rdx");
+            out_file << "    add rax, rcx" << std::endl;
+        }
+        generate_load(array_el_size);
+        return;
+    }
 
     generate_asm(*deref_array.array_expr);
     out_file << "    push_ rax" << std::endl;
 
     generate_asm(*deref_array.deref_expr);
     out_file << "    pop_ rax\n"
-             << "    pop_ rbx\n"
-             << "    mov rcx, " << array_el_size << "\n"
-             << "    deref_array " << id_gen++ << "\n"
-             << "    mov rax, rsp\n"
-             << "    add rax, " << array_el_size << "\n" << std::endl;
+             << "    pop_ rcx" << std::endl;
+    if (is_scale(array_el_size)) {
+        out_file << "    lea rax, [rcx + rax * " << array_el_size << "]" << std::endl;
+    } else {
+        generate_multiply("rax", array_el_size, "rdx");
+        out_file << "    add rax, rcx" << std::endl;
+    }
+
+    // The element replaces the array, it ends where the array ended
+    int64_t array_size = size_of(*deref_array.array_expr->type);
+    if (array_el_size == 1) {
+        // The packed element becomes an 8 byte value
+        out_file << "    movzx rdx, byte [rax]\n"
+                 << "    mov [rcx + " << array_size - 8 << "], rdx\n"
+                 << "    lea rsp, [rcx + " << array_size - 16 << "]\n"
+                 << "    lea rax, [rcx + " << array_size - 8 << "]\n" << std::endl;
+        return;
+    }
+    out_file << "    lea rbx, [rcx + " << array_size - array_el_size << "]\n"
+             << "    mov rcx, rbx" << std::endl;
+    generate_copy(array_el_size, true);
+    out_file << "    lea rsp, [rbx - 8]\n"
+             << "    mov rax, rbx\n" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const DerefTuple& deref_tuple) {
-    int64_t tuple_size = deref_tuple.tuple_expr->type->byte_size();
     int tuple_idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
-
     Type::Tuple tuple_type = std::get<Type::Tuple>(deref_tuple.tuple_expr->type->var);
-    int64_t offset = 0;
-    for (int i = 0; i < tuple_idx; ++i) {
-        offset += tuple_type[i].byte_size();
+    int64_t offset = tuple_offset(tuple_type, tuple_idx, options.packed);
+    int64_t tuple_el_size = size_of(tuple_type[tuple_idx]);
+
+    if (is_addressable(*deref_tuple.tuple_expr)) {
+        out_file << "    ; tuple element" << std::endl;
+        generate_address(*deref_tuple.tuple_expr);
+        if (offset != 0) {
+            out_file << "    add rax, " << offset << std::endl;
+        }
+        generate_load(tuple_el_size);
+        return;
     }
 
-    int64_t tuple_el_size = tuple_type[tuple_idx].byte_size();
-
+    // The element replaces the tuple, it ends where the tuple ended
     generate_asm(*deref_tuple.tuple_expr);
-    out_file << "    mov rcx, rax\n"
-             << "    sub rax, " << offset << "\n"
-             << "    mov rbx, rax\n"
-             << "    sub rbx, " << tuple_el_size << "\n"
-             << "    copy " << id_gen++ << "\n"
-             << "    mov rsp, rcx\n"
-             << "    mov rax, rsp\n"
-             << "    add rax, " << tuple_el_size << "\n" << std::endl;
+    out_file << "    lea rbx, [rax + " << size_of(*deref_tuple.tuple_expr->type) - tuple_el_size << "]\n"
+             << "    add rax, " << offset << "\n"
+             << "    mov rcx, rbx" << std::endl;
+    generate_copy(tuple_el_size, true);
+    out_file << "    lea rsp, [rbx - 8]\n"
+             << "    mov rax, rbx\n" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const std::monostate&) {}
 
+// Whether an argument may be passed by reference to its own storage, i.e. no
+// one but this function can change it while the callee runs
+bool CodeGenerator::is_shareable(const Expr& expr) const {
+    auto root = lvalue_root(expr);
+    return root && is_addressable(expr) && !address_taken.count(*root);
+}
+
+// Calls with the native convention, a result returned through the hidden
+// pointer is written to `destination` if given, otherwise pushed as usual
+void CodeGenerator::generate_native_call(const FunCall& fun_call, const Symbol* destination) {
+    if (!fun_call.fun->type || !std::holds_alternative<Type::Fun>(fun_call.fun->type->var)) {
+        throw std::logic_error("Bug in syntax check, called expression has no function type -- generate_native_call");
+    }
+    const Type::Fun& fun_type = std::get<Type::Fun>(fun_call.fun->type->var);
+    int64_t ret_size = size_of(fun_type.second);
+    bool hidden_pointer = ret_size > max_register_return_size;
+    std::vector<int64_t> arg_sizes;
+    for (const Type& arg_type : fun_type.first) {
+        arg_sizes.push_back(passed_size(arg_type));
+    }
+    auto registers = native_arg_registers(arg_sizes, hidden_pointer);
+
+    if (hidden_pointer && !destination) {
+        out_file << "    sub rsp, " << ret_size << " ; space for return value" << std::endl;
+    }
+
+    // Arguments passed by reference, which can't share their storage, are
+    // evaluated to temporaries below the return value first
+    size_t args_count = fun_call.fun_args ? fun_call.fun_args->size() : 0;
+    std::vector<std::optional<int64_t>> temporaries(args_count);
+    int64_t temporaries_size = 0;
+    for (int i = args_count - 1; i >= 0; --i) {
+        const Expr& arg = (*fun_call.fun_args)[i];
+        const Type& arg_type = fun_type.first[i];
+        if (passed_by_reference(arg_type) && (!is_shareable(arg) || !same_layout(*arg.type, arg_type))) {
+            out_file << "    ; fun arg number " << i << " temporary" << std::endl;
+            generate_asm(arg);
+            generate_convert(*arg.type, arg_type);
+            temporaries_size += size_of(arg_type);
+            temporaries[i] = temporaries_size;
+        }
+    }
+
+    int64_t args_size = 0;
+    for (int i = args_count - 1; i >= 0; --i) {
+        const Expr& arg = (*fun_call.fun_args)[i];
+        out_file << "    ; fun arg number " << i << std::endl;
+        if (temporaries[i]) {
+            out_file << "    lea rax, [rsp + " << temporaries_size + args_size - *temporaries[i] + 8 << "]\n"
+                     << "    push_ rax" << std::endl;
+        } else if (passed_by_reference(fun_type.first[i])) {
+            generate_address(arg);
+            out_file << "    push_ rax" << std::endl;
+        } else {
+            generate_asm(arg);
+            generate_convert(*arg.type, fun_type.first[i]);
+        }
+        args_size += arg_sizes[i];
+    }
+
+    bool direct = std::holds_alternative<ID>(fun_call.fun->var) && fun_ids.count(std::get<ID>(fun_call.fun->var));
+    if (!direct) {
+        generate_asm(*fun_call.fun);
+        out_file << "    pop_ rax" << std::endl;
+    }
+
+    if (destination) {
+        out_file << "    lea rdi, " << frame_ref(destination->local_address) << std::endl;
+    } else if (hidden_pointer) {
+        out_file << "    lea rdi, [rsp + " << args_size + temporaries_size + 8 << "]" << std::endl;
+    }
+    int64_t arg_offset = 0;
+    for (size_t i = 0; i < registers.size(); ++i) {
+        arg_offset += arg_sizes[i];
+        if (registers[i]) {
+            out_file << "    mov " << *registers[i] << ", [rsp + " << arg_offset << "]" << std::endl;
+        }
+    }
+
+    if (direct) {
+        out_file << "    call " << std::get<ID>(fun_call.fun->var).name << std::endl;
+    } else if (!fun_call.targets.empty()) {
+        // Devirtualized, compare against every possible function and call it directly
+        std::string called = ".called" + std::to_string(id_gen++);
+        for (size_t i = 0; i + 1 < fun_call.targets.size(); ++i) {
+            std::string next_target = ".next_target" + std::to_string(id_gen++);
+            out_file << "    mov r11, " << fun_call.targets[i].name << std::endl;
+            out_file << "    cmp rax, r11" << std::endl;
+            out_file << "    jne " << next_target << std::endl;
+            out_file << "    call " << fun_call.targets[i].name << std::endl;
+            out_file << "    jmp " << called << std::endl;
+            out_file << next_target << ":" << std::endl;
+        }
+        out_file << "    call " << fun_call.targets.back().name << std::endl;
+        out_file << called << ":" << std::endl;
+    } else {
+        out_file << "    call rax" << std::endl;
+    }
+    if (args_size + temporaries_size > 0) {
+        out_file << "    add rsp, " << args_size + temporaries_size << std::endl;
+    }
+
+    if (destination) {
+        return;
+    }
+    if (ret_size == 8) {
+        out_file << "    push_ rax" << std::endl;
+    } else if (ret_size == 16) {
+        out_file << "    mov [rsp - 8], rax\n"
+                 << "    mov [rsp], rdx\n"
+                 << "    sub rsp, 16" << std::endl;
+    }
+    out_file << "    mov rax, rsp\n"
+             << "    add rax, 8\n" << std::endl;
+}
+
 void CodeGenerator::generate_asm(const FunCall& fun_call) {
+    if (options.calling_convention == CallingConvention::NATIVE) {
+        generate_native_call(fun_call);
+        return;
+    }
+
     if (fun_call.fun_args) {
+        const Type::Fun& fun_type = std::get<Type::Fun>(fun_call.fun->type->var);
         for (int i = fun_call.fun_args->size() - 1; i >= 0; --i) {
             out_file << "    ; fun arg number " << i << std::endl;
             generate_asm((*fun_call.fun_args)[i]);
+            generate_convert(*(*fun_call.fun_args)[i].type, fun_type.first[i]);
         }
     }
 
@@ -158,26 +1344,17 @@ void CodeGenerator::generate_asm(const ID& id) {
         return;
     }
 
-    for (const auto& sym_table : fun_scope.scopes_sym_tables) {
-        auto it = sym_table.find(id);
-        if (it != sym_table.end()) {
-            int64_t local_address = it->second.local_address;
-            int64_t end_address = it->second.end_address;
-            out_file << "    ; id expr\n"
-                     << "    mov rax, rbp\n"
-                     << "    sub rax, " << local_address << "\n"
-                     << "    mov rbx, rbp\n"
-                     << "    sub rbx, " << end_address << "\n"
-                     << "    mov rcx, rsp\n"
-                     << "    sub rsp, " << end_address - local_address << "\n"
-                     << "    copy " << id_gen++ << "\n"
-                     << "    mov rax, rsp\n"
-                     << "    add rax, " << end_address - local_address << "\n"
-                     << "    mov rbx, rbp\n"
-                     << "    sub rbx, " << local_address << "\n" << std::endl;
-            break;
-        }
+    const Symbol& symbol = find_symbol(id);
+    if (symbol.reg) {
+        out_file << "    ; id expr\n"
+                 << "    push_ " << *symbol.reg << "\n"
+                 << "    mov rax, rsp\n"
+                 << "    add rax, 8\n" << std::endl;
+        return;
     }
+    out_file << "    ; id expr" << std::endl;
+    generate_address(id);
+    generate_load(symbol.end_address - symbol.local_address);
 }
 
 void CodeGenerator::generate_asm(int i) {
@@ -189,11 +1366,29 @@ void CodeGenerator::generate_asm(bool b) {
 }
 
 void CodeGenerator::generate_asm(const std::string& str) {
-    for (int i = 0; i < str.size(); ++i) {
-        out_file << "    mov dword [rsp - " << i * 8 << "], " << int(str[i]) << std::endl;
+    if (options.packed) {
+        // Eight characters per word, from its lowest byte up
+        int64_t size = (str.size() + 7) / 8 * 8;
+        for (size_t word = 0; word * 8 < str.size(); ++word) {
+            uint64_t value = 0;
+            for (size_t i = word * 8; i < str.size() && i < word * 8 + 8; ++i) {
+                value |= uint64_t(uint8_t(str[i])) << (8 * (i % 8));
+            }
+            out_file << "    mov rax, " << value << "\n"
+                     << "    mov [rsp - " << size - 8 - word * 8 << "], rax" << std::endl;
+        }
+        out_file << "    sub rsp, " << size << "\n"
+                 << "    mov rax, rsp\n"
+                 << "    add rax, 8" << std::endl;
+        return;
     }
-    out_file << "    mov rax, rsp\n"
-             << "    sub rsp, " << str.size() * 8 << std::endl;
+    int64_t size = str.size() * 8;
+    for (size_t i = 0; i < str.size(); ++i) {
+        out_file << "    mov qword [rsp - " << size - 8 - i * 8 << "], " << int(str[i]) << std::endl;
+    }
+    out_file << "    sub rsp, " << size << "\n"
+             << "    mov rax, rsp\n"
+             << "    add rax, 8" << std::endl;
 
 }
 
@@ -204,18 +1399,12 @@ void CodeGenerator::generate_asm(char c) {
 void CodeGenerator::generate_asm(const PtrExpr& ptr_expr) {
     if (ptr_expr.ref_expr) {
         generate_asm(*ptr_expr.ref_expr);
-        out_file << "    mov rsp, rax\n"
+        out_file << "    lea rsp, [rax + " << size_of(*ptr_expr.ref_expr->type) - 8 << "]\n"
                  << "    push_ rbx" << std::endl;
     } else if (ptr_expr.deref_expr) {
         generate_asm(*ptr_expr.deref_expr);
-        int64_t expr_size = std::get<Type::Ptr>(ptr_expr.deref_expr->type->var)->byte_size();
-        out_file << "    pop_ rax\n"
-                 << "    mov rbx, rax\n"
-                 << "    sub rbx, " << expr_size << "\n"
-                 << "    mov rcx, rsp\n"
-                 << "    copy " << id_gen++ << "\n"
-                 << "    mov rax, rsp\n"
-                 << "    add rsp, " << expr_size << std::endl;
+        out_file << "    pop_ rax" << std::endl;
+        generate_load(pointee_size(*ptr_expr.deref_expr->type));
     } else {
         out_file << "    push_ 0 ; ptr expr null\n"
                  << "    mov rax, rsp\n"
@@ -223,182 +1412,802 @@ void CodeGenerator::generate_asm(const PtrExpr& ptr_expr) {
     }
 }
 
-void CodeGenerator::generate_asm(const ArrayExpr& array_expr) {
-    int64_t array_el_size = array_expr.exprs[0].type->byte_size();
+// Evaluates `expr` as `type` to the block reserved right above the stack
+// top, `offset` bytes from its start. `size` is the size of the element in
+// the block, a packed element is stored as a byte
+void CodeGenerator::generate_element(const Expr& expr, const Type& type, int64_t size, int64_t offset) {
+    auto value = direct_operand(expr);
+    if (value && size == 8) {
+        out_file << "    mov qword [rsp + " << 8 + offset << "], " << *value << std::endl;
+        return;
+    }
+    if (value && size == 1 && get_valid_index(expr)) {
+        out_file << "    mov byte [rsp + " << 8 + offset << "], " << (*get_valid_index(expr) & 0xff) << std::endl;
+        return;
+    }
+    generate_asm(expr);
+    generate_convert(*expr.type, type);
+    if (size == 1) {
+        out_file << "    pop_ rcx\n"
+                 << "    mov [rsp + " << 8 + offset << "], cl" << std::endl;
+    } else if (size == 8) {
+        out_file << "    pop_ rcx\n"
+                 << "    mov [rsp + " << 8 + offset << "], rcx" << std::endl;
+    } else {
+        out_file << "    lea rbx, [rsp + 8]\n"
+                 << "    lea rax, [rsp + " << 8 + size + offset << "]" << std::endl;
+        generate_move(size);
+    }
+}
+
+// Appends the value of `expr`, stored as `size` bytes, to `bytes`, if it's
+// known at compile time
+bool CodeGenerator::append_constant(const Expr& expr, int64_t size, std::string& bytes) const {
+    auto append_value = [&](int64_t value, int64_t value_size) {
+        for (int64_t i = 0; i < value_size; ++i) {
+            bytes += char(uint64_t(value) >> (8 * i));
+        }
+    };
+    if (auto constant = get_valid_index(expr)) {
+        append_value(*constant, size);
+        return true;
+    }
+    if (expr.minus || !std::holds_alternative<TypeExpr>(expr.var)) {
+        return false;
+    }
+    const auto& literal = std::get<TypeExpr>(expr.var).expr;
+    size_t start = bytes.size();
+    if (std::holds_alternative<char>(literal)) {
+        append_value(std::get<char>(literal), size);
+    } else if (std::holds_alternative<bool>(literal)) {
+        append_value(std::get<bool>(literal), size);
+    } else if (std::holds_alternative<std::string>(literal)) {
+        for (char c : std::get<std::string>(literal)) {
+            append_value(c, options.packed ? 1 : 8);
+        }
+    } else if (std::holds_alternative<ArrayExpr>(literal)) {
+        const auto& exprs = std::get<ArrayExpr>(literal).exprs;
+        const Type& el_type = *exprs[0].type;
+        Type array_type;
+        array_type.var = Type::Array(el_type, exprs.size());
+        for (const Expr& el_expr : exprs) {
+            if (!same_layout(*el_expr.type, el_type) || !append_constant(el_expr, el_size(array_type), bytes)) {
+                return false;
+            }
+        }
+    } else if (std::holds_alternative<TupleExpr>(literal)) {
+        for (const Expr& el_expr : std::get<TupleExpr>(literal).exprs) {
+            if (!append_constant(el_expr, size_of(*el_expr.type), bytes)) {
+                return false;
+            }
+        }
+    } else {
+        return false;
+    }
+    if (bytes.size() > start + size) {
+        throw std::logic_error("Bug in code generator, constant bigger than its type -- append_constant");
+    }
+    // Packed arrays are padded
+    bytes.resize(start + size, 0);
+    return true;
+}
+
+// Contents of a string, array or tuple literal, if all its elements are constants
+std::optional<std::string> CodeGenerator::constant_bytes(const Expr& expr) const {
+    if (!expr.type || !std::holds_alternative<TypeExpr>(expr.var)) {
+        return {};
+    }
+    const auto& literal = std::get<TypeExpr>(expr.var).expr;
+    if (!std::holds_alternative<std::string>(literal) && !std::holds_alternative<ArrayExpr>(literal)
+        && !std::holds_alternative<TupleExpr>(literal)) {
+        return {};
+    }
+    std::string bytes;
+    if (!append_constant(expr, size_of(*expr.type), bytes) || bytes.empty()) {
+        return {};
+    }
+    return bytes;
+}
+
+// Label of the read-only copy of a constant literal, equal literals share it
+std::string CodeGenerator::literal_label(const std::string& bytes) {
+    auto [it, inserted] = literal_labels.emplace(bytes, "_literal" + std::to_string(literals.size()));
+    if (inserted) {
+        literals.push_back(bytes);
+    }
+    return it->second;
+}
 
-    for (const Expr& expr : array_expr.exprs) {
-        generate_asm(expr);
+void CodeGenerator::generate_asm(const ArrayExpr& array_expr) {
+    const Type& el_type = *array_expr.exprs[0].type;
+    Type array_type;
+    array_type.var = Type::Array(el_type, array_expr.exprs.size());
+    int64_t array_el_size = el_size(array_type);
+
+    out_file << "    sub rsp, " << size_of(array_type) << " ; array expr" << std::endl;
+    for (size_t i = 0; i < array_expr.exprs.size(); ++i) {
+        generate_element(array_expr.exprs[i], el_type, array_el_size, i * array_el_size);
     }
     out_file << "    mov rax, rsp\n"
-             << "    add rax, " << array_expr.exprs.size() * array_el_size << std::endl;
+             << "    add rax, 8" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const TupleExpr& tuple_expr) {
     int64_t tuple_size = 0;
     for (const Expr& expr : tuple_expr.exprs) {
-        generate_asm(expr);
-        tuple_size += expr.type->byte_size();
+        tuple_size += size_of(*expr.type);
+    }
+
+    out_file << "    sub rsp, " << tuple_size << " ; tuple expr" << std::endl;
+    int64_t offset = 0;
+    for (const Expr& expr : tuple_expr.exprs) {
+        generate_element(expr, *expr.type, size_of(*expr.type), offset);
+        offset += size_of(*expr.type);
     }
     out_file << "    mov rax, rsp\n"
-             << "    add rax, " << tuple_size << std::endl;
+             << "    add rax, 8" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const Print& print) {
     generate_asm(print.expr);
-    out_file << "    print" << std::endl;
+    // A packed char or bool is written as a single byte
+    bool is_byte = false;
+    if (options.packed && std::holds_alternative<Type::Primitive>(print.expr.type->var)) {
+        Type::Primitive primitive = std::get<Type::Primitive>(print.expr.type->var);
+        is_byte = primitive == Type::Primitive::CHAR || primitive == Type::Primitive::BOOL;
+    }
+    out_file << "    print " << (is_byte ? 1 : 8) << std::endl;
 }
 
 void CodeGenerator::generate_asm(const VarDecl& var_decl) {
     out_file << "    ; var decl" << std::endl;
 
-    if (var_decl.expr) {
+    auto reg_it = allocation.decls.find(&var_decl);
+    if (reg_it != allocation.decls.end()) {
+        if (var_decl.expr) {
+            generate_asm(*var_decl.expr);
+        }
+        fun_scope.scopes_sym_tables.back()[(*var_decl.ids)[0]] = Symbol{ .reg = reg_it->second };
+        if (var_decl.expr) {
+            out_file << "    pop_ " << reg_it->second << std::endl;
+        }
+        out_file << std::endl;
+        return;
+    }
+
+    if (!var_decl.ids) {
         generate_asm(*var_decl.expr);
+        out_file << "    add rsp, " << size_of(*var_decl.expr->type) << "\n" << std::endl;
+        return;
     }
+    Type type = stored_type(var_decl, options.packed);
+    int64_t size = size_of(type);
 
-    if (var_decl.ids) {
-        const auto& var = var_decl.type->var;
-        FunScope::SymbolTable& sym_table = fun_scope.scopes_sym_tables.back();
+    auto slot_it = frame.slots.find(&var_decl);
+    if (slot_it == frame.slots.end()) {
+        throw std::logic_error("Bug in frame layout, declaration without a slot -- generate_asm(VarDecl)");
+    }
+    // Addressed by its lowest word, the deepest one of the slot
+    int64_t address = fun_scope.locals_address + slot_it->second + size - 8;
+    const Symbol slot{ .local_address = address, .end_address = address + size };
+
+    // The value is stored to the slot before the ids are declared, it may use shadowed ones
+    auto bytes = var_decl.expr ? constant_bytes(*var_decl.expr) : std::nullopt;
+    if (is_return_destination(var_decl)) {
+        generate_native_call(std::get<FunCall>(var_decl.expr->var), &slot);
+    } else if (bytes && int64_t(bytes->size()) > max_unrolled_copy_size && same_layout(*var_decl.expr->type, type)) {
+        // Copied from .rodata straight to the slot
+        out_file << "    mov rax, " << literal_label(*bytes) << "\n"
+                 << "    lea rcx, " << frame_ref(address) << std::endl;
+        generate_copy(size);
+    } else if (var_decl.expr) {
+        generate_asm(*var_decl.expr);
+        generate_convert(*var_decl.expr->type, type);
+        if (size == 8) {
+            out_file << "    pop_ rax\n"
+                     << "    mov " << operand(slot) << ", rax" << std::endl;
+        } else {
+            out_file << "    lea rbx, [rsp + 8]\n"
+                     << "    lea rax, " << frame_ref(address) << std::endl;
+            generate_move(size);
+        }
+    }
 
-        if (std::holds_alternative<Type::Array>(var)) {
-            const Type::Array& array = std::get<Type::Array>(var);
-            int64_t array_el_size = array.first.byte_size();
-            int64_t array_size = array.second * array_el_size;
+    const auto& var = type.var;
+    FunScope::SymbolTable& sym_table = fun_scope.scopes_sym_tables.back();
+    if (var_decl.ids->size() == 1) {
+        sym_table[(*var_decl.ids)[0]] = slot;
+    } else if (std::holds_alternative<Type::Array>(var)) {
+        int64_t array_el_size = el_size(type);
+        for (size_t i = 0; i < var_decl.ids->size(); ++i) {
+            int64_t el_address = address - static_cast<int64_t>(i) * array_el_size;
+            sym_table[(*var_decl.ids)[i]] = Symbol{
+                .local_address = el_address,
+                .end_address   = el_address + array_el_size,
+            };
+        }
+    } else if (std::holds_alternative<Type::Tuple>(var)) {
+        const Type::Tuple& tuple = std::get<Type::Tuple>(var);
+        int64_t el_address = address;
+        for (size_t i = 0; i < tuple.size(); ++i) {
+            sym_table[(*var_decl.ids)[i]] = Symbol{
+                .local_address = el_address,
+                .end_address   = el_address + static_cast<int64_t>(size_of(tuple[i])),
+            };
+            el_address -= size_of(tuple[i]);
+        }
+    }
 
-            if (var_decl.ids->size() == 1) {
-                sym_table[(*var_decl.ids)[0]] = Symbol{
-                    .local_address = fun_scope.local_rsp,
-                    .end_address   = fun_scope.local_rsp + array_size,
-                };
-            } else {
-                for (int i = 0; i < array.second; ++i) {
-                    sym_table[(*var_decl.ids)[i]] = Symbol{
-                        .local_address = fun_scope.local_rsp + i * array_el_size,
-                        .end_address   = fun_scope.local_rsp + (i + 1) * array_el_size,
-                    };
-                }
-            }
+    out_file << std::endl;
+}
 
-            fun_scope.local_rsp += array_size;
+// Type a declaration is stored as, ids unpacking a packed array get a word each
+Type stored_type(const VarDecl& var_decl, bool packed) {
+    Type res = *var_decl.type;
+    if (var_decl.ids && var_decl.ids->size() > 1 && std::holds_alternative<Type::Array>(res.var)
+            && res.element_size(packed) < 8) {
+        Type word;
+        word.var = Type::Primitive::INT;
+        res.var = Type::Array(word, std::get<Type::Array>(res.var).second);
+    }
+    return res;
+}
 
-            if (!var_decl.expr) {
-                out_file << "    sub rsp, " << array_size << std::endl;
-            }
-        } else if (std::holds_alternative<Type::Tuple>(var)) {
-            const Type::Tuple& tuple = std::get<Type::Tuple>(var);
-            int64_t tuple_size = var_decl.type->byte_size();
-
-            if (var_decl.ids->size() == 1) {
-                sym_table[(*var_decl.ids)[0]] = Symbol{
-                    .local_address = fun_scope.local_rsp,
-                    .end_address   = fun_scope.local_rsp + tuple_size,
-                };
-                fun_scope.local_rsp += tuple_size;
-            } else {
-                for (int i = 0; i < tuple.size(); ++i) {
-                    sym_table[(*var_decl.ids)[i]] = Symbol{
-                        .local_address = fun_scope.local_rsp,
-                        .end_address   = fun_scope.local_rsp + static_cast<int64_t>(tuple[i].byte_size()),
-                    };
-                    fun_scope.local_rsp += tuple[i].byte_size();
-                }
-            }
+// Whether a call initializing a declaration can write its result straight into its slot
+bool CodeGenerator::is_return_destination(const VarDecl& var_decl) const {
+    return options.calling_convention == CallingConvention::NATIVE && var_decl.expr && !var_decl.expr->minus
+        && std::holds_alternative<FunCall>(var_decl.expr->var)
+        && size_of(*var_decl.type) > max_register_return_size
+        && same_layout(*var_decl.expr->type, stored_type(var_decl, options.packed));
+}
 
-            if (!var_decl.expr) {
-                out_file << "    sub rsp, " << tuple_size << std::endl;
-            }
-        } else {
-            sym_table[(*var_decl.ids)[0]] = Symbol{
-                .local_address = fun_scope.local_rsp,
-                .end_address   = fun_scope.local_rsp + 8
-            };
-            fun_scope.local_rsp += 8;
+// Whether a call assigned to a variable can write its result straight into
+// it, the callee must not be able to see the variable
+bool CodeGenerator::is_return_destination(const Assign& assign) const {
+    if (options.calling_convention != CallingConvention::NATIVE || assign.expr.minus || assign.assign_expr.minus
+            || !std::holds_alternative<FunCall>(assign.expr.var) || !std::holds_alternative<ID>(assign.assign_expr.var)
+            || size_of(*assign.expr.type) <= max_register_return_size
+            || !same_layout(*assign.expr.type, *assign.assign_expr.type)) {
+        return false;
+    }
+    const ID& id = std::get<ID>(assign.assign_expr.var);
+    if (fun_ids.count(id) || address_taken.count(id) || find_symbol(id).by_reference) {
+        return false;
+    }
+    bool used = false;
+    walk(assign.expr, [&](const Expr& expr) {
+        used |= std::holds_alternative<ID>(expr.var) && std::get<ID>(expr.var) == id;
+    });
+    return !used;
+}
 
-            if (!var_decl.expr) {
-                out_file << "    sub rsp, 8" << std::endl;
-            }
+void CodeGenerator::generate_asm(const Assign& assign) {
+    if (is_return_destination(assign)) {
+        out_file << "    ; assign returned value" << std::endl;
+        generate_native_call(std::get<FunCall>(assign.expr.var), &find_symbol(std::get<ID>(assign.assign_expr.var)));
+        out_file << "    ; end of assign\n" << std::endl;
+        return;
+    }
+
+    if (std::holds_alternative<ID>(assign.assign_expr.var) && !fun_ids.count(std::get<ID>(assign.assign_expr.var))) {
+        const Symbol& symbol = find_symbol(std::get<ID>(assign.assign_expr.var));
+        if (symbol.reg) {
+            out_file << "    ; assign" << std::endl;
+            generate_asm(assign.expr);
+            out_file << "    pop_ " << *symbol.reg << "\n"
+                     << "    ; end of assign\n" << std::endl;
+            return;
         }
-    } else {
-        out_file << "    add rsp, " << var_decl.type->byte_size() << std::endl;
     }
 
-    out_file << std::endl;
-}
+    // Packed elements and chars behind pointers only take the low byte of the value
+    bool packed_element = is_byte(assign.assign_expr);
+
+    if (is_addressable(assign.assign_expr)) {
+        int64_t size = size_of(*assign.assign_expr.type);
+        out_file << "    ; assign" << std::endl;
+        if (size == 8) {
+            auto value = direct_operand(assign.expr);
+            if (value && packed_element && get_valid_index(assign.expr)) {
+                generate_address(assign.assign_expr);
+                out_file << "    mov byte [rax], " << (*get_valid_index(assign.expr) & 0xff) << "\n"
+                         << "    ; end of assign\n" << std::endl;
+                return;
+            } else if (value && !packed_element) {
+                generate_address(assign.assign_expr);
+                out_file << "    mov qword [rax], " << *value << "\n"
+                         << "    ; end of assign\n" << std::endl;
+                return;
+            }
+        }
+        auto bytes = constant_bytes(assign.expr);
+        if (bytes && int64_t(bytes->size()) > max_unrolled_copy_size && same_layout(*assign.expr.type, *assign.assign_expr.type)) {
+            generate_address(assign.assign_expr);
+            out_file << "    mov rcx, rax\n"
+                     << "    mov rax, " << literal_label(*bytes) << std::endl;
+            generate_copy(size);
+            out_file << "    ; end of assign\n" << std::endl;
+            return;
+        }
+        generate_asm(assign.expr);
+        generate_convert(*assign.expr.type, *assign.assign_expr.type);
+        generate_address(assign.assign_expr);
+        if (packed_element) {
+            out_file << "    pop_ rcx\n"
+                     << "    mov [rax], cl" << std::endl;
+        } else if (size == 8) {
+            out_file << "    pop_ rcx\n"
+                     << "    mov [rax], rcx" << std::endl;
+        } else {
+            out_file << "    lea rbx, [rsp + 8]" << std::endl;
+            generate_move(size);
+        }
+        out_file << "    ; end of assign\n" << std::endl;
+        return;
+    }
 
-void CodeGenerator::generate_asm(const Assign& assign) {
     out_file << "    ; assign\n"
              << "    mov r8, rsp" << std::endl;
 
     generate_asm(assign.expr);
+    generate_convert(*assign.expr.type, *assign.assign_expr.type);
 
     out_file << "    mov r9, rsp" << std::endl;
 
     generate_asm(assign.assign_expr);
 
+    int64_t size = size_of(*assign.assign_expr.type);
     out_file << "    mov rsp, r9\n"
              << "    mov rax, rbx\n"
-             << "    mov rbx, r8\n"
-             << "    move " << id_gen++ << "\n"
-             << "    ; end of assign\n" << std::endl;
+             << "    lea rbx, [r8 - " << size - 8 << "]" << std::endl;
+    if (packed_element) {
+        out_file << "    mov rcx, [rbx]\n"
+                 << "    mov [rax], cl\n"
+                 << "    mov rsp, rbx" << std::endl;
+    } else {
+        generate_move(size);
+    }
+    out_file << "    ; end of assign\n" << std::endl;
 }
 
-void CodeGenerator::generate_asm(const Cond& cond) {
-    int64_t if_id = id_gen++;
+// Register or immediate holding the value of `expr`, if there is one
+std::optional<std::string> CodeGenerator::direct_operand(const Expr& expr) const {
+    if (auto constant = get_valid_index(expr)) {
+        return std::to_string(*constant);
+    }
+    if (expr.minus) {
+        return {};
+    }
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<char>(type_expr.expr)) {
+            return std::to_string(int(std::get<char>(type_expr.expr)));
+        }
+        if (std::holds_alternative<bool>(type_expr.expr)) {
+            return std::to_string(int(std::get<bool>(type_expr.expr)));
+        }
+    } else if (std::holds_alternative<ID>(expr.var) && !fun_ids.count(std::get<ID>(expr.var))) {
+        return find_symbol(std::get<ID>(expr.var)).reg;
+    }
+    return {};
+}
+
+// Jumps to `label` when `cond` evaluates to `jump_if`, falls through otherwise
+void CodeGenerator::generate_branch(const Expr& cond, bool jump_if, const std::string& label) {
+    static const std::unordered_map<BinOperation::Operator, std::pair<std::string, std::string>> jumps = {
+        { BinOperation::LESS,      { "jl",  "jge" } },
+        { BinOperation::GREATER,   { "jg",  "jle" } },
+        { BinOperation::LEQ,       { "jle", "jg"  } },
+        { BinOperation::GEQ,       { "jge", "jl"  } },
+        { BinOperation::IS_EQUAL,  { "je",  "jne" } },
+        { BinOperation::NOT_EQUAL, { "jne", "je"  } },
+    };
+
+    // Minus on a bool is a negation
+    if (cond.minus) {
+        jump_if = !jump_if;
+    }
+
+    if (std::holds_alternative<BinOperation>(cond.var)) {
+        const auto& bin_op = std::get<BinOperation>(cond.var);
+        // Jump on the left operand only when it decides the operation
+        bool decides = bin_op.op == BinOperation::OR;
+        if (bin_op.op == BinOperation::AND || bin_op.op == BinOperation::OR) {
+            if (jump_if == decides) {
+                generate_branch(*bin_op.left_expr, jump_if, label);
+                generate_branch(*bin_op.right_expr, jump_if, label);
+            } else {
+                std::string skip = ".short_circuit" + std::to_string(id_gen++);
+                generate_branch(*bin_op.left_expr, decides, skip);
+                generate_branch(*bin_op.right_expr, jump_if, label);
+                out_file << "  " << skip << ":" << std::endl;
+            }
+            return;
+        }
+    }
+
+    auto jump_it = std::holds_alternative<BinOperation>(cond.var)
+        ? jumps.find(std::get<BinOperation>(cond.var).op)
+        : jumps.end();
+    if (jump_it == jumps.end() && std::holds_alternative<TypeExpr>(cond.var)
+        && std::holds_alternative<bool>(std::get<TypeExpr>(cond.var).expr)) {
+        if (std::get<bool>(std::get<TypeExpr>(cond.var).expr) == jump_if) {
+            out_file << "    jmp " << label << std::endl;
+        }
+        return;
+    }
+    if (jump_it == jumps.end()) {
+        cond.var.visit([&](const auto& arg) { generate_asm(arg); });
+        out_file << "    pop_ rbx\n"
+                 << "    cmp rbx, 0\n"
+                 << "    " << (jump_if ? "jne " : "je ") << label << std::endl;
+        return;
+    }
+
+    if (options.optimize) {
+        covers.clear();
+        auto cover = this->label(cond);
+        if (cover && cover->pattern == Cover::COMPARE && cover->registers <= int64_t(scratch_registers.size())) {
+            std::vector<std::string> free_registers;
+            for (auto it = scratch_registers.rbegin(); it != scratch_registers.rend(); ++it) {
+                free_registers.push_back(it->first);
+            }
+            auto [a, b] = compare_operands(*cover, free_registers);
+            if (b == "0" && a.find('[') == std::string::npos) {
+                out_file << "    test " << a << ", " << a << std::endl;
+            } else {
+                out_file << "    cmp " << a << ", " << b << std::endl;
+            }
+            // The condition was swapped together with the operands
+            std::string cc = cover->instruction;
+            if (!jump_if) {
+                static const std::unordered_map<std::string, std::string> negated = {
+                    { "l", "ge" }, { "g", "le" }, { "le", "g" }, { "ge", "l" }, { "e", "ne" }, { "ne", "e" },
+                };
+                cc = negated.at(cc);
+            }
+            out_file << "    j" << cc << " " << label << std::endl;
+            return;
+        }
+    }
+
+    const auto& bin_op = std::get<BinOperation>(cond.var);
+    auto left = direct_operand(*bin_op.left_expr);
+    auto right = direct_operand(*bin_op.right_expr);
+    if (left && right && std::isalpha((*left)[0])) {
+        out_file << "    cmp " << *left << ", " << *right << std::endl;
+    } else if (left && right) {
+        out_file << "    mov rax, " << *left << "\n"
+                 << "    cmp rax, " << *right << std::endl;
+    } else if (right) {
+        generate_asm(*bin_op.left_expr);
+        out_file << "    pop_ rax\n"
+                 << "    cmp rax, " << *right << std::endl;
+    } else if (left && std::isalpha((*left)[0])) {
+        generate_asm(*bin_op.right_expr);
+        out_file << "    pop_ rbx\n"
+                 << "    cmp " << *left << ", rbx" << std::endl;
+    } else {
+        generate_asm(*bin_op.left_expr);
+        generate_asm(*bin_op.right_expr);
+        out_file << "    pop_ rbx\n"
+                 << "    pop_ rax\n"
+                 << "    cmp rax, rbx" << std::endl;
+    }
+    out_file << "    " << (jump_if ? jump_it->second.first : jump_it->second.second) << " " << label << std::endl;
+}
+
+// Whether control never reaches the end of `fun_body`, as it ends with a
+// jump: `return` with a value, `break`, `continue` or a complete if / else
+// of such bodies
+bool ends_in_jump(const FunBody& fun_body) {
+    if (fun_body.parts.empty() || !std::holds_alternative<Flow>(fun_body.parts.back().var)) {
+        return false;
+    }
+    const Flow& flow = std::get<Flow>(fun_body.parts.back().var);
+    if (std::holds_alternative<Flow::Control>(flow.var)) {
+        const Flow::Control& control = std::get<Flow::Control>(flow.var);
+        return control.first != Flow::ControlTypes::RETURN || control.second;
+    }
+    if (std::holds_alternative<Cond>(flow.var)) {
+        const Cond& cond = std::get<Cond>(flow.var);
+        return cond.else_body && ends_in_jump(*cond.else_body)
+            && std::all_of(cond.if_conds.begin(), cond.if_conds.end(), [](const IfCond& if_cond) {
+                   return ends_in_jump(if_cond.body);
+               });
+    }
+    return false;
+}
+
+// Constant compared against in a switch case
+std::optional<int64_t> case_value(const Expr& expr) {
+    if (auto constant = get_valid_index(expr)) {
+        return *constant;
+    }
+    if (!expr.minus && std::holds_alternative<TypeExpr>(expr.var)
+        && std::holds_alternative<char>(std::get<TypeExpr>(expr.var).expr)) {
+        return int(std::get<char>(std::get<TypeExpr>(expr.var).expr));
+    }
+    return {};
+}
+
+// Scrutinee and case values of a chain of `x == c` conditions over the same
+// side effect free int or char `x` with distinct constants `c`
+std::optional<std::pair<const Expr*, std::vector<int64_t>>> find_switch(const Cond& cond) {
+    if (int64_t(cond.if_conds.size()) < min_switch_cases) {
+        return {};
+    }
+    const Expr* scrutinee = nullptr;
+    std::string scrutinee_key;
+    std::vector<int64_t> values;
+    std::unordered_set<int64_t> seen;
     for (const IfCond& if_cond : cond.if_conds) {
-        generate_asm(if_cond.expr);
+        const Expr& expr = if_cond.expr;
+        if (expr.minus || !std::holds_alternative<BinOperation>(expr.var)
+            || std::get<BinOperation>(expr.var).op != BinOperation::IS_EQUAL) {
+            return {};
+        }
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        const Expr* value_expr = bin_op.right_expr.get();
+        const Expr* compared = bin_op.left_expr.get();
+        if (!case_value(*value_expr)) {
+            std::swap(value_expr, compared);
+        }
+        auto value = case_value(*value_expr);
+        if (!value || !seen.insert(*value).second) {
+            return {};
+        }
+        if (!scrutinee) {
+            const Type& type = *compared->type;
+            if (!std::holds_alternative<Type::Primitive>(type.var) || !is_pure(*compared)
+                || (std::get<Type::Primitive>(type.var) != Type::Primitive::INT
+                    && std::get<Type::Primitive>(type.var) != Type::Primitive::CHAR)) {
+                return {};
+            }
+            scrutinee = compared;
+            scrutinee_key = structural_key(*compared);
+        } else if (structural_key(*compared) != scrutinee_key) {
+            return {};
+        }
+        values.push_back(*value);
+    }
+    return std::make_pair(scrutinee, values);
+}
+
+// Binary search of rax among `cases` sorted by their value, jumps to the label
+// of the matching one or to `default_label`
+void CodeGenerator::generate_decision_tree(const std::vector<std::pair<int64_t, std::string>>& cases, size_t begin, size_t end,
+                                           const std::string& default_label) {
+    // Few cases are compared one by one
+    if (end - begin <= 3) {
+        for (size_t i = begin; i < end; ++i) {
+            out_file << "    cmp rax, " << cases[i].first << "\n"
+                     << "    je " << cases[i].second << std::endl;
+        }
+        out_file << "    jmp " << default_label << std::endl;
+        return;
+    }
+    size_t mid = (begin + end) / 2;
+    std::string upper = ".upper_cases" + std::to_string(id_gen++);
+    out_file << "    cmp rax, " << cases[mid].first << "\n"
+             << "    je " << cases[mid].second << "\n"
+             << "    jg " << upper << std::endl;
+    generate_decision_tree(cases, begin, mid, default_label);
+    out_file << "  " << upper << ":" << std::endl;
+    generate_decision_tree(cases, mid + 1, end, default_label);
+}
+
+// Evaluates the scrutinee once and jumps to the body of its case, through a
+// jump table when the values are dense and a decision tree otherwise
+void CodeGenerator::generate_switch(const Cond& cond, const Expr& scrutinee, const std::vector<int64_t>& values) {
+    int64_t if_id = id_gen++;
+    std::string end_label = ".end_if" + std::to_string(if_id);
+    std::string default_label = cond.else_body ? ".else" + std::to_string(if_id) : end_label;
+    std::vector<std::pair<int64_t, std::string>> cases;
+    for (int64_t value : values) {
+        cases.emplace_back(value, ".case" + std::to_string(id_gen++));
+    }
+    std::vector<std::pair<int64_t, std::string>> sorted_cases = cases;
+    std::sort(sorted_cases.begin(), sorted_cases.end());
+
+    out_file << "    ; switch" << std::endl;
+    auto reg = direct_operand(scrutinee);
+    if (reg && std::isalpha((*reg)[0])) {
+        out_file << "    mov rax, " << *reg << std::endl;
+    } else {
+        generate_asm(scrutinee);
+        out_file << "    pop_ rax" << std::endl;
+    }
+
+    int64_t min = sorted_cases.front().first;
+    int64_t spread = sorted_cases.back().first - min + 1;
+    if (spread <= max_jump_table_density * int64_t(cases.size())) {
+        // Values below the smallest one wrap around and fail the unsigned test too
+        std::string table = ".jump_table" + std::to_string(id_gen++);
+        if (min != 0) {
+            out_file << "    sub rax, " << min << std::endl;
+        }
+        out_file << "    cmp rax, " << spread - 1 << "\n"
+                 << "    ja " << default_label << "\n"
+                 << "    jmp qword [" << table << " + rax * 8]\n"
+                 << "  " << table << ":" << std::endl;
+        std::vector<std::string> entries(spread, default_label);
+        for (const auto& [value, label] : cases) {
+            entries[value - min] = label;
+        }
+        for (size_t i = 0; i < entries.size(); i += 8) {
+            out_file << "    dq ";
+            for (size_t j = i; j < entries.size() && j < i + 8; ++j) {
+                out_file << (j > i ? ", " : "") << entries[j];
+            }
+            out_file << std::endl;
+        }
+    } else {
+        generate_decision_tree(sorted_cases, 0, sorted_cases.size(), default_label);
+    }
 
+    for (size_t i = 0; i < cases.size(); ++i) {
+        out_file << "  " << cases[i].second << ":" << std::endl;
+        fun_scope.scopes_sym_tables.push_back({});
+        generate_asm(cond.if_conds[i].body);
+        fun_scope.scopes_sym_tables.pop_back();
+        bool last = i + 1 == cases.size() && !cond.else_body;
+        if (!last && !ends_in_jump(cond.if_conds[i].body)) {
+            out_file << "    jmp " << end_label << std::endl;
+        }
+    }
+    if (cond.else_body) {
+        out_file << "  " << default_label << ":" << std::endl;
+        fun_scope.scopes_sym_tables.push_back({});
+        generate_asm(*cond.else_body);
+        fun_scope.scopes_sym_tables.pop_back();
+    }
+    out_file << "  " << end_label << ":\n" << std::endl;
+}
+
+void CodeGenerator::generate_asm(const Cond& cond) {
+    if (auto switch_cases = find_switch(cond)) {
+        generate_switch(cond, *switch_cases->first, switch_cases->second);
+        return;
+    }
+
+    int64_t if_id = id_gen++;
+    for (size_t i = 0; i < cond.if_conds.size(); ++i) {
+        const IfCond& if_cond = cond.if_conds[i];
         int64_t loc_if_id = id_gen++;
-        out_file << "    ; if       \n"
-                 << "    pop_ rbx   \n"
-                 << "    cmp rbx, 0 \n"
-                 << "    je .end_loc_if" << loc_if_id << std::endl;
+        out_file << "    ; if" << std::endl;
+        generate_branch(if_cond.expr, false, ".end_loc_if" + std::to_string(loc_if_id));
 
         fun_scope.scopes_sym_tables.push_back({});
         generate_asm(if_cond.body);
         fun_scope.scopes_sym_tables.pop_back();
 
-        out_file << "    jmp .end_if" << if_id << std::endl;
+        // The last body without else falls through to the end
+        bool last = i + 1 == cond.if_conds.size() && !cond.else_body;
+        if (!last && !ends_in_jump(if_cond.body)) {
+            out_file << "    jmp .end_if" << if_id << std::endl;
+        }
         out_file << "  .end_loc_if" << loc_if_id << ":" << std::endl;
     }
 
     if (cond.else_body) {
+        fun_scope.scopes_sym_tables.push_back({});
         generate_asm(*cond.else_body);
+        fun_scope.scopes_sym_tables.pop_back();
     }
     out_file << "  .end_if" << if_id << ":\n" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const Loop& loop) {
-    int64_t id = id_gen++;
-    out_file << "    ; loop \n"
-             << "  .loop" << id << ":" << std::endl;
-
-    generate_asm(loop.expr);
+    auto induction_it = induction_loops.find(&loop);
+    const InductionLoop* induction = induction_it != induction_loops.end() ? &induction_it->second : nullptr;
+    if (induction) {
+        const Symbol& var = find_symbol(induction->var);
+        out_file << "    ; induction pointers" << std::endl;
+        for (const InductionPointer& pointer : induction->pointers) {
+            out_file << "    mov rax, " << operand(var) << std::endl;
+            generate_multiply("rax", pointer.el_size, "rcx");
+            out_file << "    add rax, rbp\n"
+                     << "    mov " << operand(pointer.location) << ", rax" << std::endl;
+        }
+        if (induction->exit_op) {
+            auto bound = get_valid_index(*induction->bound);
+            if (bound) {
+                out_file << "    mov rax, " << *bound * induction->pointers[0].el_size << std::endl;
+            } else {
+                out_file << "    mov rax, " << operand(find_symbol(std::get<ID>(induction->bound->var))) << std::endl;
+                generate_multiply("rax", induction->pointers[0].el_size, "rcx");
+            }
+            out_file << "    add rax, rbp\n"
+                     << "    mov " << operand(induction->end) << ", rax" << std::endl;
+        }
+    }
 
-    out_file << "    ; if       \n"
-             << "    pop_ rbx   \n"
-             << "    cmp rbx, 0 \n"
-             << "    je .loop_end" << id << std::endl;
+    // Rotated: the condition is tested once before the loop and then at the
+    // end of every iteration, which jumps back while it holds
+    int64_t id = id_gen++;
+    auto generate_test = [&](bool jump_if, const std::string& label) {
+        if (induction && induction->exit_op) {
+            // Pointers go up with the index
+            static const std::unordered_map<BinOperation::Operator, std::pair<std::string, std::string>> jumps = {
+                { BinOperation::LESS,      { "jb",  "jae" } },
+                { BinOperation::LEQ,       { "jbe", "ja"  } },
+                { BinOperation::GREATER,   { "ja",  "jbe" } },
+                { BinOperation::GEQ,       { "jae", "jb"  } },
+                { BinOperation::IS_EQUAL,  { "je",  "jne" } },
+                { BinOperation::NOT_EQUAL, { "jne", "je"  } },
+            };
+            const auto& jump = jumps.at(*induction->exit_op);
+            out_file << "    mov rax, " << operand(induction->pointers[0].location) << "\n"
+                     << "    cmp rax, " << operand(induction->end) << "\n"
+                     << "    " << (jump_if ? jump.first : jump.second) << " " << label << std::endl;
+        } else {
+            generate_branch(loop.expr, jump_if, label);
+        }
+    };
+    out_file << "    ; loop" << std::endl;
+    generate_test(false, ".loop_end" + std::to_string(id));
+    out_file << "  .loop" << id << ":" << std::endl;
 
     fun_scope.loop_labels_ids.push_back(id);
-    generate_asm(loop.body);
+    fun_scope.scopes_sym_tables.push_back({});
+    if (induction) {
+        active_induction_loops.push_back(induction);
+        for (size_t i = 0; i + 1 < loop.body.parts.size(); ++i) {
+            generate_asm(loop.body.parts[i]);
+        }
+        if (!induction->exit_op) {
+            generate_asm(loop.body.parts.back());
+        }
+        for (const InductionPointer& pointer : induction->pointers) {
+            out_file << "    add " << operand(pointer.location) << ", " << induction->step * pointer.el_size << std::endl;
+        }
+        active_induction_loops.pop_back();
+    } else {
+        generate_asm(loop.body);
+    }
+    fun_scope.scopes_sym_tables.pop_back();
     fun_scope.loop_labels_ids.pop_back();
 
-    out_file << "    jmp .loop" << id << "\n"
-             << "  .loop_end" << id << ":\n" << std::endl;
+    out_file << "  .loop_test" << id << ":" << std::endl;
+    generate_test(true, ".loop" + std::to_string(id));
+    out_file << "  .loop_end" << id << ":\n" << std::endl;
 }
 
 void CodeGenerator::generate_asm(const Flow::Control& control) {
     if (control.first == Flow::ControlTypes::RETURN && control.second) {
         generate_asm(*control.second);
-        out_file << "    jmp .fun_end" << std::endl;
+        generate_convert(*control.second->type, *fun_scope.return_type);
+        if (fun_scope.frameless) {
+            generate_frameless_return(size_of(*fun_scope.return_type));
+        } else {
+            out_file << "    jmp .fun_end" << std::endl;
+        }
     } else if (control.first == Flow::ControlTypes::CONTINUE) {
-        out_file << "    jmp .loop" << fun_scope.loop_labels_ids.back() << std::endl;
+        out_file << "    jmp .loop_test" << fun_scope.loop_labels_ids.back() << std::endl;
     } else if (control.first == Flow::ControlTypes::BREAK) {
         out_file << "    jmp .loop_end" << fun_scope.loop_labels_ids.back() << std::endl;
     }
 }
 
+// Returns right away from a function without frame, the stack holds nothing
+// but the `size` bytes of the return value
+void CodeGenerator::generate_frameless_return(int64_t size) {
+    if (size > 0) {
+        out_file << "    mov rax, [rsp + 8]" << std::endl;
+    }
+    if (size > 8) {
+        out_file << "    mov rdx, [rsp + 16]" << std::endl;
+    }
+    out_file << "    add rsp, " << size + 8 << std::endl;
+    for (auto it = fun_scope.pushed_registers.rbegin(); it != fun_scope.pushed_registers.rend(); ++it) {
+        out_file << "    pop " << *it << std::endl;
+    }
+    out_file << "    ret\n" << std::endl;
+}
+
 void CodeGenerator::generate_asm(const Flow& flow) {
-    std::visit([&](auto arg) { generate_asm(arg); }, flow.var);
+    std::visit([&](const auto& arg) { generate_asm(arg); }, flow.var);
 }
 
 void CodeGenerator::generate_asm(const FunBodyPart& fun_body_part) {
@@ -407,7 +2216,7 @@ void CodeGenerator::generate_asm(const FunBodyPart& fun_body_part) {
         generate_asm(std::get<Expr>(fun_body_part.var));
         out_file << "    mov rsp, r10" << std::endl;
     } else {
-        fun_body_part.var.visit([&](auto arg) { generate_asm(arg); });
+        fun_body_part.var.visit([&](const auto& arg) { generate_asm(arg); });
     }
 }
 
@@ -418,57 +2227,319 @@ void CodeGenerator::generate_asm(const FunBody& fun_body) {
 }
 
 void CodeGenerator::generate_asm(const FunDecl& fun_decl) {
-    auto fun_args_fold = [](int64_t acc, const FunArg& fun_arg) {
-        return fun_arg.type.byte_size() + acc;
+    auto fun_args_fold = [&](int64_t acc, const FunArg& fun_arg) {
+        return size_of(fun_arg.type) + acc;
     };
     int64_t args_size = std::accumulate(fun_decl.args.begin(), fun_decl.args.end(), 0, fun_args_fold);
-    int64_t return_val_size = fun_decl.ret_type.byte_size();
-    int64_t offset = args_size < return_val_size ? return_val_size - args_size : 0;
+    int64_t return_val_size = size_of(fun_decl.ret_type);
+    bool native = options.calling_convention == CallingConvention::NATIVE;
+    bool hidden_pointer = native && return_val_size > max_register_return_size;
+
+    // Native calls keep the return value out of the frame
+    int64_t offset = 0;
+    if (native) {
+        offset = 8;
+    } else if (args_size < return_val_size) {
+        offset = return_val_size - args_size;
+    }
+
+    std::vector<int64_t> arg_sizes;
+    for (const FunArg& fun_arg : fun_decl.args) {
+        arg_sizes.push_back(passed_size(fun_arg.type));
+    }
+    std::vector<std::optional<std::string>> arg_registers(fun_decl.args.size());
+    if (native) {
+        arg_registers = native_arg_registers(arg_sizes, hidden_pointer);
+    }
+
+    // Arguments passed by reference are copied, if this function could change them
+    address_taken.clear();
+    collect_address_taken(fun_decl.body, address_taken);
+    std::unordered_set<ID> assigned;
+    bool writes_memory = false;
+    collect_assigned(fun_decl.body, assigned, writes_memory);
+    reference_args.clear();
+    std::vector<const ID*> copied_args;
 
     FunScope::SymbolTable sym_table;
 
     int64_t args_offset = 0;
-    for (const FunArg& fun_arg : fun_decl.args) {
-        args_offset += fun_arg.type.byte_size();
+    for (size_t i = 0; i < fun_decl.args.size(); ++i) {
+        const FunArg& fun_arg = fun_decl.args[i];
+        args_offset += arg_sizes[i];
+        bool by_reference = passed_by_reference(fun_arg.type);
+        int64_t address = -(16 + offset + args_offset - arg_sizes[i] + 8);
         sym_table[fun_arg.id] = Symbol{
-            .local_address = -(16 + offset + args_offset),
-            .end_address   = -(16 + offset + args_offset - fun_arg.type.byte_size()),
+            .local_address = address,
+            .end_address   = address + size_of(fun_arg.type),
+            .by_reference  = by_reference,
         };
+        if (by_reference && (assigned.count(fun_arg.id) || address_taken.count(fun_arg.id))) {
+            copied_args.push_back(&fun_arg.id);
+        } else if (by_reference) {
+            reference_args.insert(fun_arg.id);
+        }
     }
     fun_scope.scopes_sym_tables.push_back(sym_table);
 
+    induction_loops.clear();
+    induction_loops_order.clear();
+    allocation = RegisterAllocation{};
+    if (options.optimize) {
+        plan_induction_loops(fun_decl.body, fun_decl.body);
+        allocation = allocate_registers(fun_decl, induction_loops, address_taken);
+    }
+    frame = allocate_frame(fun_decl, allocation, address_taken, options);
+
+    // Hidden slots: saved registers and spilled induction pointers
+    int64_t hidden_size = 0;
+    std::vector<std::pair<std::string, int64_t>> saved_registers;
+    for (const std::string& reg : allocation.used) {
+        saved_registers.emplace_back(reg, hidden_size);
+        hidden_size += 8;
+    }
+    int64_t hidden_pointer_slot = 0;
+    if (hidden_pointer) {
+        hidden_pointer_slot = hidden_size;
+        hidden_size += 8;
+    }
+    std::vector<std::pair<std::string, const ID*>> register_args;
+    for (size_t i = 0; i < fun_decl.args.size(); ++i) {
+        if (!arg_registers[i]) {
+            continue;
+        }
+        const ID& id = fun_decl.args[i].id;
+        register_args.emplace_back(*arg_registers[i], &id);
+        bool in_register = std::any_of(allocation.args.begin(), allocation.args.end(), [&](const auto& arg) {
+            return arg.first == id;
+        });
+        if (!in_register) {
+            Symbol& symbol = fun_scope.scopes_sym_tables.back()[id];
+            symbol = Symbol{
+                .local_address = hidden_size,
+                .end_address   = hidden_size + symbol.end_address - symbol.local_address,
+                .by_reference  = symbol.by_reference,
+            };
+            hidden_size += 8;
+        }
+    }
+    std::vector<std::pair<const ID*, int64_t>> arg_copies;
+    for (const ID* id : copied_args) {
+        const Symbol& symbol = fun_scope.scopes_sym_tables.back()[*id];
+        int64_t size = symbol.end_address - symbol.local_address;
+        arg_copies.emplace_back(id, hidden_size + size - 8);
+        hidden_size += size;
+    }
+    for (const Loop* loop : induction_loops_order) {
+        InductionLoop& induction = induction_loops[loop];
+        for (InductionPointer& pointer : induction.pointers) {
+            if (!pointer.location.reg) {
+                pointer.location.local_address = hidden_size;
+                hidden_size += 8;
+            }
+        }
+        if (induction.exit_op && !induction.end.reg) {
+            induction.end.local_address = hidden_size;
+            hidden_size += 8;
+        }
+    }
+
+    // Without any slot nothing uses rbp
+    bool no_pointers = std::all_of(induction_loops.begin(), induction_loops.end(), [](const auto& loop) {
+        return loop.second.pointers.empty();
+    });
+    bool registers_only = std::all_of(arg_registers.begin(), arg_registers.end(), [](const auto& reg) {
+        return reg.has_value();
+    });
+    fun_scope.frameless = native && hidden_size == int64_t(8 * saved_registers.size()) && frame.size == 0
+        && registers_only && no_pointers;
+    fun_scope.pushed_registers.clear();
+
     fun_ids.insert(fun_decl.id);
-    out_file << fun_decl.id.name << ":\n"
-             << "    fun_init " << offset << "\n" << std::endl;
+    out_file << fun_decl.id.name << ":" << std::endl;
+    if (fun_scope.frameless) {
+        for (const auto& [reg, slot] : saved_registers) {
+            out_file << "    push " << reg << std::endl;
+            fun_scope.pushed_registers.push_back(reg);
+        }
+        out_file << "    sub rsp, 8 ; frameless\n" << std::endl;
+    } else if (native) {
+        out_file << "    fun_enter\n" << std::endl;
+    } else {
+        out_file << "    fun_init " << offset << "\n" << std::endl;
+    }
+    frame_sizes.push_back(FrameSizes{
+        .fun             = fun_decl.id.name,
+        .hidden          = hidden_size,
+        .locals          = frame.size,
+        .unshared_locals = frame.unshared_size,
+    });
+    if (!fun_scope.frameless) {
+        if (hidden_size + frame.size > 0) {
+            out_file << "    sub rsp, " << hidden_size + frame.size << std::endl;
+        }
+        for (const auto& [reg, slot] : saved_registers) {
+            out_file << "    mov " << frame_ref(slot) << ", " << reg << std::endl;
+        }
+    }
+    if (hidden_pointer) {
+        out_file << "    mov " << frame_ref(hidden_pointer_slot) << ", rdi" << std::endl;
+    }
+    for (const auto& [id, reg] : allocation.args) {
+        Symbol& symbol = fun_scope.scopes_sym_tables.back()[id];
+        auto register_arg = std::find_if(register_args.begin(), register_args.end(), [&](const auto& arg) {
+            return *arg.second == id;
+        });
+        if (register_arg != register_args.end()) {
+            out_file << "    mov " << reg << ", " << register_arg->first << std::endl;
+        } else {
+            out_file << "    mov " << reg << ", " << operand(symbol) << std::endl;
+        }
+        symbol.reg = reg;
+    }
+    for (const auto& [reg, id] : register_args) {
+        const Symbol& symbol = fun_scope.scopes_sym_tables.back()[*id];
+        if (!symbol.reg) {
+            out_file << "    mov " << operand(symbol) << ", " << reg << std::endl;
+        }
+    }
+    for (const auto& [id, slot] : arg_copies) {
+        Symbol& symbol = fun_scope.scopes_sym_tables.back()[*id];
+        int64_t size = symbol.end_address - symbol.local_address;
+        out_file << "    mov rax, " << operand(symbol) << "\n"
+                 << "    lea rcx, " << frame_ref(slot) << std::endl;
+        generate_copy(size);
+        symbol = Symbol{ .local_address = slot, .end_address = slot + size };
+    }
+    out_file << std::endl;
 
-    fun_scope.local_rsp = 0;
-    generate_asm(fun_decl.body);
+    fun_scope.locals_address = hidden_size;
+    fun_scope.return_type = &fun_decl.ret_type;
+    for (const FunBodyPart& part : fun_decl.body.parts) {
+        // The final return falls through to .fun_end
+        const Flow* flow = std::holds_alternative<Flow>(part.var) ? &std::get<Flow>(part.var) : nullptr;
+        if (!fun_scope.frameless && &part == &fun_decl.body.parts.back() && flow
+            && std::holds_alternative<Flow::Control>(flow->var)
+            && std::get<Flow::Control>(flow->var).first == Flow::ControlTypes::RETURN
+            && std::get<Flow::Control>(flow->var).second) {
+            const Expr& value = *std::get<Flow::Control>(flow->var).second;
+            generate_asm(value);
+            generate_convert(*value.type, fun_decl.ret_type);
+        } else {
+            generate_asm(part);
+        }
+    }
     fun_scope.scopes_sym_tables.pop_back();
 
+    if (fun_scope.frameless) {
+        // Every return leaves on its own, only the end of the body is left
+        if (!ends_in_jump(fun_decl.body)) {
+            generate_frameless_return(0);
+        }
+        flush_function();
+        return;
+    }
+
     out_file << "  .fun_end:" << std::endl;
-    if (return_val_size > 0) {
-        out_file << "    ret_val " << id_gen++ << ", " <<  return_val_size  << std::endl;
+    if (hidden_pointer) {
+        out_file << "    mov rax, " << frame_ref(hidden_pointer_slot) << "\n"
+                 << "    lea rbx, [rsp + 8]" << std::endl;
+        generate_move(return_val_size);
+    } else if (native && return_val_size > 0) {
+        out_file << "    mov rax, [rsp + 8]" << std::endl;
+        if (return_val_size > 8) {
+            out_file << "    mov rdx, [rsp + 16]" << std::endl;
+        }
+    } else if (return_val_size > 0) {
+        out_file << "    lea rax, [rbp + 24]\n"
+                 << "    lea rbx, [rsp + 8]" << std::endl;
+        generate_move(return_val_size);
+    }
+    for (const auto& [reg, slot] : saved_registers) {
+        out_file << "    mov " << reg << ", " << frame_ref(slot) << std::endl;
+    }
+    if (native) {
+        out_file << "    fun_leave\n" << std::endl;
+    } else {
+        out_file << "    ret_\n" << std::endl;
+    }
+    flush_function();
+}
+
+void CodeGenerator::flush_function() {
+    if (options.optimize) {
+        std::vector<Instruction> code = parse_asm(out_file.str());
+        peephole(code, peephole_stats);
+        asm_file << to_string(code);
+    } else {
+        asm_file << out_file.str();
     }
-    out_file << "    ret_\n" << std::endl;
+    out_file.str("");
 }
 
 
 void CodeGenerator::generate_asm(const Program& program) {
-    out_file << asm_macros <<
+    asm_file << asm_macros <<
         "section .text                                              \n"
         "    global _start                                          \n"
         "                                                           \n"
-        "_start:                                                    \n"
-        "    sub rsp, 8                                             \n"
-        "    call_ " << id_gen++ <<  ", main                        \n"
-        "    pop_ rdi                                               \n"
+        "_start:                                                    \n";
+    if (options.calling_convention == CallingConvention::NATIVE) {
+        asm_file <<
+            "    call main                                              \n"
+            "    mov rdi, rax                                           \n";
+    } else {
+        asm_file <<
+            "    sub rsp, 8                                             \n"
+            "    call_ " << id_gen++ <<  ", main                        \n"
+            "    pop_ rdi                                               \n";
+    }
+    asm_file <<
         "    mov rax, 60                                            \n"
         "    syscall                                                \n"
         << std::endl;
 
+    for (const FunDecl& decl : program.decls) {
+        fun_ids.insert(decl.id);
+    }
+    if (options.packed && mixes_packed_layouts(program)) {
+        options.packed = false;
+    }
     for (const FunDecl& decl : program.decls) {
         generate_asm(decl);
     }
+
+    if (!literals.empty()) {
+        asm_file << "section .rodata\n"
+                 << "    align 8" << std::endl;
+        for (const std::string& bytes : literals) {
+            asm_file << literal_labels.at(bytes) << ":\n"
+                     << "    dq ";
+            for (size_t word = 0; word < bytes.size(); word += 8) {
+                uint64_t value = 0;
+                for (size_t i = 0; i < 8; ++i) {
+                    value |= uint64_t(uint8_t(bytes[word + i])) << (8 * i);
+                }
+                asm_file << (word ? ", " : "") << int64_t(value);
+            }
+            asm_file << std::endl;
+        }
+        asm_file << std::endl;
+    }
+
+    if (options.peephole_stats) {
+        std::cout << "Peephole rule hits:" << std::endl;
+        for (const auto& [rule, hits] : peephole_stats) {
+            std::cout << "\t" << rule << "\t" << hits << std::endl;
+        }
+    }
+    if (options.frame_sizes) {
+        std::cout << "Frame sizes (hidden + locals, locals without slot sharing):" << std::endl;
+        for (const FrameSizes& sizes : frame_sizes) {
+            std::cout << "\t" << sizes.fun << "\t" << sizes.hidden + sizes.locals
+                      << "\t(" << sizes.hidden << " + " << sizes.locals << ", " << sizes.unshared_locals << ")" << std::endl;
+        }
+    }
 }
 
 }
@@ -1,15 +1,166 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <numeric>
+#include <sstream>
 #include <unordered_set>
 
+#include "peephole.hpp"
 #include "syntax_tree.hpp"
 
 namespace foc {
 
+enum class CallingConvention {
+    // call_/ret_ macros, everything passed and returned on the stack
+    LEGACY,
+    // call/ret, scalars in registers, results in rax:rdx or through a hidden pointer
+    NATIVE,
+};
+
+struct CodeGenOptions {
+    bool optimize = false;
+    CallingConvention calling_convention = CallingConvention::NATIVE;
+    // Prints how often each peephole rule was applied
+    bool peephole_stats = false;
+    // Prints the frame size of every function
+    bool frame_sizes = false;
+    // Stores chars and bools of arrays in a byte each
+    bool packed = false;
+};
+
 struct Symbol {
+    // The value starts at [rbp - local_address], end_address - local_address is its size
     int64_t local_address = 0;
     int64_t end_address = 0;
+    // Scalars may live in a register instead of [rbp - local_address]
+    std::optional<std::string> reg = std::nullopt;
+    // Argument passed by reference, [rbp - local_address] holds its address,
+    // end_address - local_address is still the size of the aggregate
+    bool by_reference = false;
+};
+
+// Pointer to the element `var` of arrays with `el_size` big elements,
+// kept relative to rbp in a register or a hidden frame slot
+struct InductionPointer {
+    int64_t el_size = 0;
+    Symbol location = {};
+};
+
+// Loop stepping `var` by a constant `step` at the end of its body
+struct InductionLoop {
+    ID var = {};
+    int64_t step = 0;
+    std::vector<InductionPointer> pointers = {};
+
+    // Exit test done on the first pointer when `var` isn't used otherwise
+    std::optional<BinOperation::Operator> exit_op = std::nullopt;
+    std::shared_ptr<Expr> bound = nullptr;
+    Symbol end = {};
+};
+
+// Memory operand of a frame slot and register or memory operand of an 8 byte symbol
+std::string frame_ref(int64_t local_address);
+std::string operand(const Symbol& symbol);
+
+// Registers the macros never touch, callee saved
+const std::vector<std::string> allocatable_registers = { "r12", "r13", "r14", "r15" };
+
+// Registers of the native convention for 8 byte arguments, in order
+const std::vector<std::string> argument_registers = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
+
+// Results bigger than this are returned through a hidden pointer
+const int64_t max_register_return_size = 16;
+
+// Bigger blocks are copied with `rep movsq` instead of unrolled movs
+const int64_t max_unrolled_copy_size = 64;
+
+// Bigger aggregate arguments are passed by reference in the native convention
+const int64_t max_value_argument_size = 64;
+
+// Elif chains over one value with this many cases are dispatched at once
+const int64_t min_switch_cases = 4;
+
+// Jump tables get at most this many entries per case, sparser cases are
+// found by a binary decision tree
+const int64_t max_jump_table_density = 3;
+
+// Estimated cycles of generate_multiply
+int64_t multiply_cost(int64_t factor);
+
+// Whether an index can be scaled by `factor` inside an address
+bool is_scale(int64_t factor);
+
+// Scratch registers of the instruction selector, with their low bytes
+const std::vector<std::pair<std::string, std::string>> scratch_registers = {
+    { "rax", "al" }, { "rcx", "cl" }, { "rdx", "dl" }, { "rsi", "sil" }, { "rdi", "dil" }, { "r11", "r11b" },
+};
+
+// Cheapest pattern found by the instruction selector for an expression
+struct Cover {
+    enum Pattern {
+        // Immediate, register variable or memory operand
+        OPERAND,
+        // `instruction` on the value of `first` and the operand / value of `second`
+        BINARY,
+        // inc or dec of `first`
+        INC_DEC,
+        // lea with base `first`, index `second` times `scale` and `displacement`
+        LEA,
+        // `first` multiplied by `factor`
+        MULTIPLY,
+        // cmp (or test) of `first` with `second`, `instruction` is the condition
+        COMPARE,
+        // Load by `instruction` from rbp + `displacement`, plus `second` times `scale`
+        ELEMENT,
+    };
+
+    Pattern pattern = OPERAND;
+    std::string operand = {};
+    std::string instruction = {};
+    const Expr* first = nullptr;
+    const Expr* second = nullptr;
+    int64_t scale = 1;
+    int64_t displacement = 0;
+    int64_t factor = 1;
+    // Unary minus applied afterwards
+    bool negate = false;
+
+    // Estimated cycles to get the value to a scratch register and the scratch registers needed for it
+    int64_t cost = 0;
+    int64_t registers = 1;
+};
+
+struct RegisterAllocation {
+    std::unordered_map<const VarDecl*, std::string> decls;
+    std::vector<std::pair<ID, std::string>> args;
+    std::vector<std::string> used;
+};
+
+RegisterAllocation allocate_registers(const FunDecl& fun_decl,
+                                      std::unordered_map<const Loop*, InductionLoop>& induction_loops,
+                                      const std::unordered_set<ID>& address_taken);
+
+// Offsets of the declarations kept in memory from the start of the locals,
+// declarations with disjoint lifetimes share their slot
+struct FrameLayout {
+    std::unordered_map<const VarDecl*, int64_t> slots;
+    int64_t size = 0;
+    // Size of the locals, if every declaration had its own slot
+    int64_t unshared_size = 0;
+};
+
+// Type a declaration is stored as
+Type stored_type(const VarDecl& var_decl, bool packed);
+
+FrameLayout allocate_frame(const FunDecl& fun_decl, const RegisterAllocation& allocation,
+                           const std::unordered_set<ID>& address_taken, const CodeGenOptions& options);
+
+// Frame of a generated function, for the frame size report
+struct FrameSizes {
+    std::string fun;
+    int64_t hidden;
+    int64_t locals;
+    int64_t unshared_locals;
 };
 
 struct FunScope {
@@ -17,14 +168,19 @@ struct FunScope {
 
     std::vector<SymbolTable> scopes_sym_tables;
     std::vector<int64_t> loop_labels_ids;
-    int64_t local_rsp;
+    // Frame offset of the locals, they follow the hidden slots
+    int64_t locals_address;
+    const Type* return_type;
+    // No rbp frame, the callee saved registers are pushed in this order
+    bool frameless = false;
+    std::vector<std::string> pushed_registers;
 };
 
 class CodeGenerator {
 public:
-    CodeGenerator(const std::string& file_name) : out_file(file_name) {}
+    CodeGenerator(const std::string& file_name, CodeGenOptions options = {}) : asm_file(file_name), options(options) {}
     ~CodeGenerator() {
-        out_file.close();
+        asm_file.close();
     }
 
     void generate_asm(const Expr& expr);
@@ -56,11 +212,73 @@ public:
     void generate_asm(const Program& program);
 
 private:
+    const Symbol& find_symbol(const ID& id) const;
+    int64_t size_of(const Type& type) const;
+    int64_t el_size(const Type& array_type) const;
+    bool same_layout(const Type& a, const Type& b) const;
+    int64_t pointee_size(const Type& ptr_type) const;
+    bool is_byte(const Expr& expr) const;
+    void generate_convert(const Type& from, const Type& to);
+    void convert_elements(const Type& from, const Type& to, int64_t from_address, int64_t to_address);
+    bool passed_by_reference(const Type& type) const;
+    int64_t passed_size(const Type& type) const;
+    bool is_shareable(const Expr& expr) const;
+    void generate_native_call(const FunCall& fun_call, const Symbol* destination = nullptr);
+    bool is_return_destination(const Assign& assign) const;
+    bool is_return_destination(const VarDecl& var_decl) const;
+    std::optional<std::string> direct_operand(const Expr& expr) const;
+    void generate_branch(const Expr& cond, bool jump_if, const std::string& label);
+    void generate_switch(const Cond& cond, const Expr& scrutinee, const std::vector<int64_t>& values);
+    void generate_decision_tree(const std::vector<std::pair<int64_t, std::string>>& cases, size_t begin, size_t end,
+                                const std::string& default_label);
+    void generate_frameless_return(int64_t size);
+    void flush_function();
+    void generate_copy(int64_t size, bool may_overlap = false);
+    void generate_move(int64_t size);
+    void generate_multiply(const std::string& reg, int64_t factor, const std::string& scratch);
+    void generate_divide(int64_t divisor);
+    std::optional<int64_t> constant_address(const Expr& expr) const;
+    std::optional<Cover> label(const Expr& expr);
+    std::optional<Cover> label_node(const Expr& expr);
+    std::optional<Cover> label_element(const DerefArray& deref_array);
+    std::string reduce(const Expr& expr, std::vector<std::string>& free_registers);
+    std::string use(const Expr& expr, std::vector<std::string>& free_registers);
+    std::pair<std::string, std::string> compare_operands(const Cover& cover, std::vector<std::string>& free_registers);
+    bool generate_selected(const Expr& expr);
+    bool is_addressable(const Expr& expr) const;
+    void generate_address(const Expr& expr);
+    void generate_address(const ID& id);
+    void generate_address(const DerefArray& deref_array);
+    void generate_load(int64_t size);
+    void generate_element(const Expr& expr, const Type& type, int64_t size, int64_t offset);
+    bool append_constant(const Expr& expr, int64_t size, std::string& bytes) const;
+    std::optional<std::string> constant_bytes(const Expr& expr) const;
+    std::string literal_label(const std::string& bytes);
+    void plan_induction_loops(const FunBody& fun_body, const FunBody& loops_body);
+    std::optional<std::pair<InductionPointer, int64_t>> induction_pointer(const DerefArray& deref_array) const;
+
     FunScope fun_scope;
     std::unordered_set<ID> fun_ids;
     int64_t id_gen = 0;
 
-    std::ofstream out_file;
+    std::unordered_set<ID> address_taken;
+    std::unordered_set<ID> reference_args;
+    std::unordered_map<const Loop*, InductionLoop> induction_loops;
+    std::vector<const Loop*> induction_loops_order;
+    std::vector<const InductionLoop*> active_induction_loops;
+    RegisterAllocation allocation;
+    FrameLayout frame;
+    std::vector<FrameSizes> frame_sizes;
+    std::unordered_map<const Expr*, std::optional<Cover>> covers;
+    // Contents of the constant literals in .rodata, in the order of their labels
+    std::vector<std::string> literals;
+    std::unordered_map<std::string, std::string> literal_labels;
+
+    // Code of the function being generated, written to asm_file when it's done
+    std::stringstream out_file;
+    std::ofstream asm_file;
+    CodeGenOptions options;
+    PeepholeStats peephole_stats;
 };
 
 const std::string asm_macros =
@@ -82,13 +300,16 @@ const std::string asm_macros =
         "  .fun_ret%1:                                              \n"
         "%endmacro                                                  \n"
         "                                                           \n"
-        "%macro ret_val 2                                           \n"
-        "    mov rax, rbp                                           \n"
-        "    add rax, 16 + %2                                       \n"
-        "    mov rbx, rsp                                           \n"
-        "    add rbx, %2                                            \n"
+        "%macro fun_enter 0                                         \n"
+        "    push rbp     ; return address is already on stack      \n"
+        "    lea rbp, [rsp - 8]                                     \n"
+        "    mov rsp, rbp                                           \n"
+        "%endmacro                                                  \n"
         "                                                           \n"
-        "    move %1                                                \n"
+        "%macro fun_leave 0                                         \n"
+        "    lea rsp, [rbp + 8]                                     \n"
+        "    pop rbp                                                \n"
+        "    ret                                                    \n"
         "%endmacro                                                  \n"
         "                                                           \n"
         "%macro ret_ 0                                              \n"
@@ -98,28 +319,6 @@ const std::string asm_macros =
         "    jmp rbx                                                \n"
         "%endmacro                                                  \n"
         "                                                           \n"
-        "%macro move 1                                              \n"
-        "    mov rdx, rbx                                           \n"
-        "  .move%1:                                                 \n"
-        "    mov rcx, [rbx]                                         \n"
-        "    mov [rax], rcx                                         \n"
-        "    sub rax, 8                                             \n"
-        "    sub rbx, 8                                             \n"
-        "    cmp rsp, rbx                                           \n"
-        "    jl .move%1                                             \n"
-        "    mov rsp, rdx                                           \n"
-        "%endmacro                                                  \n"
-        "                                                           \n"
-        "%macro copy 1                                              \n"
-        "  .copy%1:                                                 \n"
-        "     mov rdx, [rax]                                        \n"
-        "     mov [rcx], rdx                                        \n"
-        "     sub rax, 8                                            \n"
-        "     sub rcx, 8                                            \n"
-        "     cmp rbx, rax                                          \n"
-        "     jl .copy%1                                            \n"
-        "%endmacro                                                  \n"
-        "                                                           \n"
         "%macro fun_init 1                                          \n"
         "    pop_ rax     ; moving return address to rax            \n"
         "    sub rsp, %1  ; make space for return value             \n"
@@ -128,27 +327,16 @@ const std::string asm_macros =
         "    mov rbp, rsp ; saving frame address to rbp             \n"
         "%endmacro                                                  \n"
         "                                                           \n"
-        "%macro print 0                                             \n"
+        "%macro print 1                                             \n"
         "    mov rsi, rsp                                           \n"
         "    add rsi, 8                                             \n"
         "    mov rax, 1                                             \n"
-        "    mov rdx, 8                                             \n"
+        "    mov rdi, 1   ; stdout                                  \n"
+        "    mov rdx, %1  ; size                                    \n"
         "    syscall                                                \n"
         "    add rsp, 8                                             \n"
         "%endmacro                                                  \n"
         "                                                           \n"
-        "; rax = idx, rbx = array address, rcx = el size            \n"
-        "%macro deref_array 1                                       \n"
-        "    mul rcx                                                \n"
-        "    mov rdx, rbx                                           \n"
-        "    sub rbx, rax                                           \n"
-        "    mov rax, rbx                                           \n"
-        "    sub rbx, rcx                                           \n"
-        "    mov rcx, rdx                                           \n"
-        "    copy %1                                                \n"
-        "    mov rsp, rcx                                           \n"
-        "%endmacro                                                  \n"
-        "                                                           \n"
         "%macro add_op 0                                            \n"
         "    pop_ rbx                                               \n"
         "    add [rsp + 8], rbx                                     \n"
@@ -163,14 +351,15 @@ const std::string asm_macros =
         "                                                           \n"
         "%macro mul_op 0                                            \n"
         "    pop_ rax                                               \n"
-        "    mul dword [rsp + 8]                                    \n"
+        "    imul rax, [rsp + 8]                                    \n"
         "    mov [rsp + 8], rax                                     \n"
         "%endmacro                                                  \n"
         "                                                           \n"
         "%macro div_op 0                                            \n"
         "    pop_ rbx                                               \n"
         "    pop_ rax                                               \n"
-        "    div rbx                                                \n"
+        "    cqo                                                    \n"
+        "    idiv rbx                                               \n"
         "    push_ rax                                              \n"
         "%endmacro                                                  \n"
         "                                                           \n"
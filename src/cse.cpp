@@ -0,0 +1,492 @@
+#include <deque>
+
+#include "optimizer.hpp"
+#include "syntax_check.hpp"
+
+namespace foc {
+
+//*********************************************
+// Value numbering:
+//     Every pure expression gets a key built from the keys of its operands.
+//     Reading an ID is keyed by the current version of the variable, which
+//     changes on every declaration of or assignment to it, so two expressions
+//     with equal keys always compute the same value.
+//
+//     Reads through pointers are additionally keyed by the version of memory
+//     (pseudo variable `$mem`). Writes through pointers and function calls
+//     change it together with every address-taken variable, writes to an
+//     address-taken variable change it as well.
+//
+// Elimination:
+//     Keys are kept in scoped tables following the nesting of bodies, which
+//     in our structured code is exactly the dominator tree. When a key is
+//     already available, the expression is replaced by a temporary. The first
+//     occurrence computes the temporary just before its statement. Temporaries
+//     are declared at the start of the function, so they never change the
+//     stack layout of nested scopes.
+//
+//     Loop conditions and elif conditions have no place to compute a
+//     temporary, so they can only reuse already available values. The same
+//     holds for the right operand of `&&` and `||`, which is not evaluated
+//     when the left one decides.
+//
+
+struct ValueEntry {
+    Expr* first = nullptr;
+    std::optional<ID> temp;
+    bool needed = false;
+};
+
+struct CSEStatement {
+    FunBody* body = nullptr;
+    size_t idx = 0;
+    std::vector<std::shared_ptr<ValueEntry>> firsts = {};
+};
+
+class CSEContext {
+public:
+    CSEContext(FunDecl& fun_decl, const std::unordered_set<ID>& fun_ids) : fun_decl(fun_decl), fun_ids(fun_ids) {
+        collect_address_taken(fun_decl.body, address_taken);
+    }
+
+    void run();
+
+private:
+    using Versions = std::vector<std::unordered_map<ID, int64_t>>;
+
+    int64_t version(const ID& id) const;
+    void declare(const ID& id);
+    void assign(const ID& id);
+    void clobber_memory();
+    void kill(const Expr& assign_expr);
+    void kill(const std::unordered_set<ID>& ids, bool writes_memory);
+
+    std::string key(const Expr& expr);
+    bool is_candidate(const Expr& expr) const;
+
+    void visit(Expr& expr);
+    void visit_lvalue(Expr& expr);
+    void visit_stmt(Expr& expr, FunBody& body, size_t idx);
+    void visit(FunBody& body);
+    void visit(Cond& cond, FunBody& body, size_t idx);
+    void visit(Loop& loop);
+
+    FunDecl& fun_decl;
+    const std::unordered_set<ID>& fun_ids;
+    std::unordered_set<ID> address_taken;
+
+    Versions versions;
+    std::vector<std::unordered_map<std::string, std::shared_ptr<ValueEntry>>> available;
+    int64_t version_gen = 0;
+    int64_t call_gen = 0;
+
+    std::deque<CSEStatement> statements;
+    std::vector<std::pair<Expr*, std::shared_ptr<ValueEntry>>> reuses;
+    CSEStatement* current = nullptr;
+};
+
+int64_t CSEContext::version(const ID& id) const {
+    for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+        auto found = it->find(id);
+        if (found != it->end()) {
+            return found->second;
+        }
+    }
+    return -1;
+}
+
+void CSEContext::declare(const ID& id) {
+    versions.back()[id] = version_gen++;
+}
+
+void CSEContext::assign(const ID& id) {
+    for (auto it = versions.rbegin(); it != versions.rend(); ++it) {
+        auto found = it->find(id);
+        if (found != it->end()) {
+            found->second = version_gen++;
+            return;
+        }
+    }
+    versions.front()[id] = version_gen++;
+}
+
+void CSEContext::clobber_memory() {
+    assign(ID{ .name = "$mem" });
+    for (const ID& id : address_taken) {
+        assign(id);
+    }
+}
+
+void CSEContext::kill(const Expr& assign_expr) {
+    auto root = lvalue_root(assign_expr);
+    if (!root) {
+        clobber_memory();
+        return;
+    }
+    assign(*root);
+    if (address_taken.count(*root)) {
+        assign(ID{ .name = "$mem" });
+    }
+}
+
+void CSEContext::kill(const std::unordered_set<ID>& ids, bool writes_memory) {
+    for (const ID& id : ids) {
+        assign(id);
+        // Pointers may read the variable
+        if (address_taken.count(id)) {
+            assign(ID{ .name = "$mem" });
+        }
+    }
+    if (writes_memory) {
+        clobber_memory();
+    }
+}
+
+std::string CSEContext::key(const Expr& expr) {
+    std::string res;
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        std::string left = key(*bin_op.left_expr);
+        std::string right = key(*bin_op.right_expr);
+        bool commutative = bin_op.op == BinOperation::Operator::PLUS
+                        || bin_op.op == BinOperation::Operator::STAR
+                        || bin_op.op == BinOperation::Operator::IS_EQUAL
+                        || bin_op.op == BinOperation::Operator::NOT_EQUAL;
+        if (commutative && right < left) {
+            std::swap(left, right);
+        }
+        res = "(" + left + " " + std::to_string(bin_op.op) + " " + right + ")";
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        res = key(*deref_array.array_expr) + "[" + key(*deref_array.deref_expr) + "]";
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        res = key(*deref_tuple.tuple_expr) + "<" + std::to_string(*get_valid_index(*deref_tuple.deref_expr)) + ">";
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        res = "call" + std::to_string(call_gen++);
+    } else if (std::holds_alternative<ID>(expr.var)) {
+        const ID& id = std::get<ID>(expr.var);
+        int64_t id_version = version(id);
+        if (id_version < 0 && fun_ids.count(id)) {
+            res = "fun " + id.name;
+        } else {
+            res = id.name + "#" + std::to_string(id_version);
+        }
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        if (std::holds_alternative<int>(type_expr)) {
+            res = std::to_string(std::get<int>(type_expr));
+        } else if (std::holds_alternative<char>(type_expr)) {
+            res = "'" + std::string(1, std::get<char>(type_expr)) + "'";
+        } else if (std::holds_alternative<bool>(type_expr)) {
+            res = std::get<bool>(type_expr) ? "T" : "F";
+        } else if (std::holds_alternative<std::string>(type_expr)) {
+            res = "\"" + std::get<std::string>(type_expr) + "\"";
+        } else if (std::holds_alternative<PtrExpr>(type_expr)) {
+            const PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr);
+            if (ptr_expr.ref_expr) {
+                res = "&" + key(*ptr_expr.ref_expr);
+            } else if (ptr_expr.deref_expr) {
+                res = "*" + key(*ptr_expr.deref_expr) + "@" + std::to_string(version(ID{ .name = "$mem" }));
+            } else {
+                res = "&$";
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr)) {
+            res = "<";
+            for (const Expr& sub_expr : std::get<TupleExpr>(type_expr).exprs) {
+                res += key(sub_expr) + ",";
+            }
+            res += ">";
+        } else if (std::holds_alternative<ArrayExpr>(type_expr)) {
+            res = "[";
+            for (const Expr& sub_expr : std::get<ArrayExpr>(type_expr).exprs) {
+                res += key(sub_expr) + ",";
+            }
+            res += "]";
+        }
+    }
+    return expr.minus ? "-" + res : res;
+}
+
+bool CSEContext::is_candidate(const Expr& expr) const {
+    // IDs and constants are as cheap to compute as the temporary itself
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        // So is `i + c`, and keeping it in place leaves `arr[i + c]` to the
+        // induction pointers of the code generator
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        bool is_offset = (bin_op.op == BinOperation::PLUS || bin_op.op == BinOperation::MINUS)
+            && std::holds_alternative<ID>(bin_op.left_expr->var) && get_valid_index(*bin_op.right_expr);
+        return !is_offset;
+    }
+    if (std::holds_alternative<DerefArray>(expr.var)
+            || std::holds_alternative<DerefTuple>(expr.var)) {
+        return true;
+    }
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        return std::holds_alternative<PtrExpr>(type_expr) && std::get<PtrExpr>(type_expr).deref_expr;
+    }
+    return false;
+}
+
+void CSEContext::visit(Expr& expr) {
+    bool candidate = is_candidate(expr);
+    std::string expr_key;
+    if (candidate) {
+        expr_key = key(expr);
+        for (auto it = available.rbegin(); it != available.rend(); ++it) {
+            auto found = it->find(expr_key);
+            if (found != it->end()) {
+                found->second->needed = true;
+                reuses.emplace_back(&expr, found->second);
+                return;
+            }
+        }
+    }
+
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        visit(*bin_op.left_expr);
+        // The right operand of `&&` and `||` may not run, so it can only reuse
+        CSEStatement* statement = current;
+        if (bin_op.op == BinOperation::Operator::AND || bin_op.op == BinOperation::Operator::OR) {
+            current = nullptr;
+        }
+        visit(*bin_op.right_expr);
+        current = statement;
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        visit(*deref_array.array_expr);
+        visit(*deref_array.deref_expr);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        visit(*std::get<DerefTuple>(expr.var).tuple_expr);
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        if (std::holds_alternative<PtrExpr>(type_expr)) {
+            PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr);
+            if (ptr_expr.ref_expr) {
+                // Address of the expression is needed, not its value
+                visit_lvalue(*ptr_expr.ref_expr);
+            } else if (ptr_expr.deref_expr) {
+                visit(*ptr_expr.deref_expr);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr)) {
+            for (Expr& sub_expr : std::get<TupleExpr>(type_expr).exprs) {
+                visit(sub_expr);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr)) {
+            for (Expr& sub_expr : std::get<ArrayExpr>(type_expr).exprs) {
+                visit(sub_expr);
+            }
+        }
+    }
+
+    if (candidate && current) {
+        auto entry = std::make_shared<ValueEntry>();
+        entry->first = &expr;
+        available.back()[expr_key] = entry;
+        current->firsts.push_back(entry);
+    }
+}
+
+void CSEContext::visit_lvalue(Expr& expr) {
+    if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        visit_lvalue(*deref_array.array_expr);
+        visit(*deref_array.deref_expr);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        visit_lvalue(*std::get<DerefTuple>(expr.var).tuple_expr);
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        if (std::holds_alternative<PtrExpr>(type_expr) && std::get<PtrExpr>(type_expr).deref_expr) {
+            visit(*std::get<PtrExpr>(type_expr).deref_expr);
+        }
+    }
+}
+
+void CSEContext::visit_stmt(Expr& expr, FunBody& body, size_t idx) {
+    statements.push_back(CSEStatement{ .body = &body, .idx = idx });
+    current = &statements.back();
+    visit(expr);
+    current = nullptr;
+}
+
+void CSEContext::visit(Cond& cond, FunBody& body, size_t idx) {
+    std::unordered_set<ID> assigned;
+    bool writes_memory = false;
+
+    for (size_t i = 0; i < cond.if_conds.size(); ++i) {
+        IfCond& if_cond = cond.if_conds[i];
+        if (!is_pure(if_cond.expr)) {
+            clobber_memory();
+            writes_memory = true;
+        } else if (i == 0) {
+            visit_stmt(if_cond.expr, body, idx);
+        } else {
+            visit(if_cond.expr);
+        }
+
+        Versions saved_versions = versions;
+        versions.emplace_back();
+        available.emplace_back();
+        visit(if_cond.body);
+        available.pop_back();
+        versions = saved_versions;
+
+        collect_assigned(if_cond.body, assigned, writes_memory);
+    }
+
+    if (cond.else_body) {
+        Versions saved_versions = versions;
+        versions.emplace_back();
+        available.emplace_back();
+        visit(*cond.else_body);
+        available.pop_back();
+        versions = saved_versions;
+
+        collect_assigned(*cond.else_body, assigned, writes_memory);
+    }
+
+    kill(assigned, writes_memory);
+}
+
+void CSEContext::visit(Loop& loop) {
+    // Values flowing over the back edge are unknown at the start of the loop
+    std::unordered_set<ID> assigned;
+    bool writes_memory = !is_pure(loop.expr);
+    collect_assigned(loop.body, assigned, writes_memory);
+    kill(assigned, writes_memory);
+
+    if (is_pure(loop.expr)) {
+        visit(loop.expr);
+    }
+
+    versions.emplace_back();
+    available.emplace_back();
+    visit(loop.body);
+    available.pop_back();
+    versions.pop_back();
+
+    kill(assigned, writes_memory);
+}
+
+void CSEContext::visit(FunBody& body) {
+    for (size_t idx = 0; idx < body.parts.size(); ++idx) {
+        FunBodyPart& part = body.parts[idx];
+
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                if (is_pure(*var_decl.expr)) {
+                    visit_stmt(*var_decl.expr, body, idx);
+                } else {
+                    clobber_memory();
+                }
+            }
+            if (var_decl.ids) {
+                for (const ID& id : *var_decl.ids) {
+                    declare(id);
+                }
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            if (is_pure(assign.expr) && is_pure(assign.assign_expr)) {
+                visit_stmt(assign.expr, body, idx);
+                current = &statements.back();
+                visit_lvalue(assign.assign_expr);
+                current = nullptr;
+            } else {
+                clobber_memory();
+            }
+            kill(assign.assign_expr);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            Expr& expr = std::get<Expr>(part.var);
+            if (is_pure(expr)) {
+                visit_stmt(expr, body, idx);
+            } else {
+                clobber_memory();
+            }
+        } else if (std::holds_alternative<Print>(part.var)) {
+            Expr& expr = std::get<Print>(part.var).expr;
+            if (is_pure(expr)) {
+                visit_stmt(expr, body, idx);
+            } else {
+                clobber_memory();
+            }
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                visit(std::get<Cond>(flow.var), body, idx);
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                visit(std::get<Loop>(flow.var));
+            } else {
+                auto& control = std::get<Flow::Control>(flow.var);
+                if (control.second && is_pure(*control.second)) {
+                    visit_stmt(*control.second, body, idx);
+                }
+            }
+        }
+    }
+}
+
+void CSEContext::run() {
+    versions.emplace_back();
+    available.emplace_back();
+    for (const FunArg& fun_arg : fun_decl.args) {
+        declare(fun_arg.id);
+    }
+
+    visit(fun_decl.body);
+
+    std::vector<VarDecl> temp_decls;
+    for (CSEStatement& statement : statements) {
+        for (auto& entry : statement.firsts) {
+            if (entry->needed) {
+                entry->temp = ID{ .name = "_cse" + std::to_string(temp_decls.size()) };
+                temp_decls.push_back(VarDecl{
+                    .type = *entry->first->type,
+                    .ids  = std::vector<ID>{ *entry->temp },
+                    .expr = std::nullopt,
+                });
+            }
+        }
+    }
+
+    for (auto& [expr, entry] : reuses) {
+        *expr = make_id_expr(*entry->temp, expr->type);
+    }
+
+    // Going backwards keeps the indices of not yet processed statements valid
+    for (auto it = statements.rbegin(); it != statements.rend(); ++it) {
+        std::vector<FunBodyPart> computations;
+        for (auto& entry : it->firsts) {
+            if (!entry->needed) {
+                continue;
+            }
+            std::shared_ptr<Type> type = entry->first->type;
+            FunBodyPart part;
+            part.var = Assign{
+                .assign_expr = make_id_expr(*entry->temp, type),
+                .expr        = std::move(*entry->first),
+            };
+            *entry->first = make_id_expr(*entry->temp, type);
+            computations.push_back(part);
+        }
+        it->body->parts.insert(it->body->parts.begin() + it->idx, computations.begin(), computations.end());
+    }
+
+    std::vector<FunBodyPart> decl_parts;
+    for (VarDecl& var_decl : temp_decls) {
+        FunBodyPart part;
+        part.var = std::move(var_decl);
+        decl_parts.push_back(part);
+    }
+    fun_decl.body.parts.insert(fun_decl.body.parts.begin(), decl_parts.begin(), decl_parts.end());
+}
+
+void common_subexpression_elimination(FunDecl& fun_decl, const std::unordered_set<ID>& fun_ids) {
+    CSEContext context(fun_decl, fun_ids);
+    context.run();
+}
+
+}
@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <set>
+
+#include "optimizer.hpp"
+
+namespace foc {
+
+//*********************************************
+// Devirtualization:
+//     Calls through values of function type become direct calls where the
+//     called function is known. A forward pass over a body keeps the set of
+//     functions each local, argument and element of a tuple local may hold:
+//       - a declaration or an assignment sets it to the functions of its
+//         value, i.e. a function name, a known variable or tuple element, any
+//         other write makes it unknown
+//       - after an if / elif / else the sets of all branches are merged
+//       - variables assigned in a loop are unknown in it and after it
+//     Variables whose address is taken are never known.
+//
+//     An argument is known when its function is only ever called directly,
+//     i.e. its name is used nowhere else, and every call passes a known
+//     value. Arguments may be passed on from function to function, so this
+//     is repeated as long as something new becomes known.
+//
+//     A call of a pure value with a single possible function calls it
+//     directly. With up to max_guarded_targets functions, or a value with
+//     side effects, the call keeps them in FunCall::targets, the code
+//     generator compares the value against them and calls the matching one
+//     directly.
+//
+
+const size_t max_guarded_targets = 3;
+
+// Names of the functions a value may be, empty when it's unknown
+using Targets = std::set<std::string>;
+
+// Targets of the variables in scope and of the elements of tuple variables,
+// which are keyed `t<i>`. Every declared variable has an entry.
+using Bindings = std::unordered_map<std::string, Targets>;
+
+// Targets passed to each argument of a function by all its calls, none for
+// an argument no call was seen for yet
+using CallArgs = std::unordered_map<std::string, std::vector<std::optional<Targets>>>;
+
+std::string element_key(const std::string& tuple, size_t idx) {
+    return tuple + "<" + std::to_string(idx) + ">";
+}
+
+bool is_fun_type(const Type& type) {
+    return std::holds_alternative<Type::Fun>(type.var);
+}
+
+class DevirtualizationContext {
+public:
+    DevirtualizationContext(FunDecl& fun_decl, const std::unordered_set<ID>& fun_ids,
+                            const std::unordered_map<std::string, std::vector<Targets>>& arg_targets)
+        : fun_decl(fun_decl), fun_ids(fun_ids), arg_targets(arg_targets) {
+        collect_address_taken(fun_decl.body, address_taken);
+    }
+
+    void collect(CallArgs& call_args);
+    void rewrite();
+
+private:
+    void run();
+    Targets targets(const Expr& expr, const Bindings& bindings) const;
+    Targets element_targets(const Expr& tuple_expr, size_t idx, const Bindings& bindings) const;
+    std::optional<std::string> callee(const FunCall& fun_call, const Bindings& bindings) const;
+    void kill(const std::string& name, Bindings& bindings) const;
+    void bind(const std::string& name, const Type& type, const Expr& value, Bindings& bindings) const;
+    void visit(Expr& expr, const Bindings& bindings);
+    void visit(FunBody& body, Bindings& bindings);
+    void visit_scope(FunBody& body, Bindings& bindings);
+
+    FunDecl& fun_decl;
+    const std::unordered_set<ID>& fun_ids;
+    const std::unordered_map<std::string, std::vector<Targets>>& arg_targets;
+    std::unordered_set<ID> address_taken;
+
+    CallArgs* call_args = nullptr;
+    bool rewriting = false;
+};
+
+Targets DevirtualizationContext::targets(const Expr& expr, const Bindings& bindings) const {
+    if (expr.minus) {
+        return {};
+    }
+    if (std::holds_alternative<ID>(expr.var)) {
+        const ID& id = std::get<ID>(expr.var);
+        auto it = bindings.find(id.name);
+        if (it != bindings.end()) {
+            return it->second;
+        }
+        return fun_ids.count(id) ? Targets{ id.name } : Targets{};
+    }
+    if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        int idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+        return element_targets(*deref_tuple.tuple_expr, idx, bindings);
+    }
+    return {};
+}
+
+Targets DevirtualizationContext::element_targets(const Expr& tuple_expr, size_t idx, const Bindings& bindings) const {
+    if (tuple_expr.minus) {
+        return {};
+    }
+    if (std::holds_alternative<ID>(tuple_expr.var)) {
+        auto it = bindings.find(element_key(std::get<ID>(tuple_expr.var).name, idx));
+        return it != bindings.end() ? it->second : Targets{};
+    }
+    if (std::holds_alternative<TypeExpr>(tuple_expr.var)
+        && std::holds_alternative<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr)) {
+        return targets(std::get<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr).exprs[idx], bindings);
+    }
+    return {};
+}
+
+// The function called, if it's called directly
+std::optional<std::string> DevirtualizationContext::callee(const FunCall& fun_call, const Bindings& bindings) const {
+    const Expr& fun = *fun_call.fun;
+    if (!fun.minus && std::holds_alternative<ID>(fun.var) && !bindings.count(std::get<ID>(fun.var).name)
+        && fun_ids.count(std::get<ID>(fun.var))) {
+        return std::get<ID>(fun.var).name;
+    }
+    return {};
+}
+
+// Forgets everything about variable `name` and its elements
+void DevirtualizationContext::kill(const std::string& name, Bindings& bindings) const {
+    for (auto it = bindings.begin(); it != bindings.end();) {
+        if (it->first.rfind(name + "<", 0) == 0) {
+            it = bindings.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    bindings[name] = {};
+}
+
+// Binds variable `name` of `type` to `value`
+void DevirtualizationContext::bind(const std::string& name, const Type& type, const Expr& value, Bindings& bindings) const {
+    Bindings values;
+    if (is_fun_type(type)) {
+        values[name] = targets(value, bindings);
+    } else if (std::holds_alternative<Type::Tuple>(type.var)) {
+        const Type::Tuple& tuple_type = std::get<Type::Tuple>(type.var);
+        for (size_t i = 0; i < tuple_type.size(); ++i) {
+            if (is_fun_type(tuple_type[i])) {
+                values[element_key(name, i)] = element_targets(value, i, bindings);
+            }
+        }
+    }
+    kill(name, bindings);
+    if (address_taken.count(ID{ name })) {
+        return;
+    }
+    for (auto& [key, key_targets] : values) {
+        bindings[key] = key_targets;
+    }
+}
+
+void DevirtualizationContext::visit(Expr& expr, const Bindings& bindings) {
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        visit(*bin_op.left_expr, bindings);
+        visit(*bin_op.right_expr, bindings);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        visit(*deref_array.array_expr, bindings);
+        visit(*deref_array.deref_expr, bindings);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        visit(*std::get<DerefTuple>(expr.var).tuple_expr, bindings);
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+            PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+            if (ptr_expr.ref_expr) {
+                visit(*ptr_expr.ref_expr, bindings);
+            }
+            if (ptr_expr.deref_expr) {
+                visit(*ptr_expr.deref_expr, bindings);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+                visit(sub_expr, bindings);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+                visit(sub_expr, bindings);
+            }
+        }
+    }
+    if (!std::holds_alternative<FunCall>(expr.var)) {
+        return;
+    }
+
+    auto& fun_call = std::get<FunCall>(expr.var);
+    visit(*fun_call.fun, bindings);
+    if (fun_call.fun_args) {
+        for (Expr& arg : *fun_call.fun_args) {
+            visit(arg, bindings);
+        }
+    }
+
+    Targets fun_targets = targets(*fun_call.fun, bindings);
+    // A function shadowed by a variable can't be named here
+    bool nameable = std::all_of(fun_targets.begin(), fun_targets.end(), [&](const std::string& name) {
+        return !bindings.count(name);
+    });
+    auto direct = callee(fun_call, bindings);
+    if (!direct && fun_targets.size() == 1 && nameable) {
+        direct = *fun_targets.begin();
+    }
+
+    if (call_args && direct) {
+        std::vector<std::optional<Targets>>& args = (*call_args)[*direct];
+        size_t args_count = fun_call.fun_args ? fun_call.fun_args->size() : 0;
+        args.resize(args_count);
+        for (size_t i = 0; i < args_count; ++i) {
+            Targets arg_targets = targets((*fun_call.fun_args)[i], bindings);
+            if (!args[i]) {
+                args[i] = arg_targets;
+            } else if (!args[i]->empty() && !arg_targets.empty()) {
+                args[i]->insert(arg_targets.begin(), arg_targets.end());
+            } else {
+                args[i]->clear();
+            }
+        }
+    }
+
+    if (!rewriting || callee(fun_call, bindings) || !nameable) {
+        return;
+    }
+    // The called value is still computed when it may have side effects, e.g. `<f, g(1)><0>(x)`
+    if (fun_targets.size() == 1 && is_pure(*fun_call.fun)) {
+        fun_call.fun = std::make_shared<Expr>(make_id_expr(ID{ *fun_targets.begin() }, fun_call.fun->type));
+    } else if (!fun_targets.empty() && fun_targets.size() <= max_guarded_targets) {
+        fun_call.targets.clear();
+        for (const std::string& name : fun_targets) {
+            fun_call.targets.push_back(ID{ name });
+        }
+    }
+}
+
+// Visits a nested body, its declarations are gone afterwards
+void DevirtualizationContext::visit_scope(FunBody& body, Bindings& bindings) {
+    Bindings outer = bindings;
+    visit(body, bindings);
+    // Variables of the outer scope shadowed in the body kept their value
+    for (FunBodyPart& part : body.parts) {
+        if (!std::holds_alternative<VarDecl>(part.var) || !std::get<VarDecl>(part.var).ids) {
+            continue;
+        }
+        for (const ID& id : *std::get<VarDecl>(part.var).ids) {
+            kill(id.name, bindings);
+            bindings.erase(id.name);
+            for (const auto& [key, key_targets] : outer) {
+                if (key == id.name || key.rfind(id.name + "<", 0) == 0) {
+                    bindings[key] = key_targets;
+                }
+            }
+        }
+    }
+}
+
+void DevirtualizationContext::visit(FunBody& body, Bindings& bindings) {
+    for (FunBodyPart& part : body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                visit(*var_decl.expr, bindings);
+            }
+            if (!var_decl.ids) {
+                continue;
+            }
+            const std::vector<ID>& ids = *var_decl.ids;
+            if (ids.size() == 1 && var_decl.expr) {
+                bind(ids[0].name, *var_decl.type, *var_decl.expr, bindings);
+                continue;
+            }
+            // Unpacked tuples
+            Bindings values;
+            if (var_decl.expr && std::holds_alternative<Type::Tuple>(var_decl.type->var)) {
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    values[ids[i].name] = element_targets(*var_decl.expr, i, bindings);
+                }
+            }
+            for (const ID& id : ids) {
+                kill(id.name, bindings);
+                if (!address_taken.count(id)) {
+                    bindings[id.name] = values[id.name];
+                }
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            visit(assign.expr, bindings);
+            visit(assign.assign_expr, bindings);
+            const Expr& target = assign.assign_expr;
+            if (!target.minus && std::holds_alternative<ID>(target.var)) {
+                bind(std::get<ID>(target.var).name, *target.type, assign.expr, bindings);
+            } else if (!target.minus && std::holds_alternative<DerefTuple>(target.var)
+                       && std::holds_alternative<ID>(std::get<DerefTuple>(target.var).tuple_expr->var)
+                       && !std::get<DerefTuple>(target.var).tuple_expr->minus) {
+                const auto& deref_tuple = std::get<DerefTuple>(target.var);
+                const ID& tuple_id = std::get<ID>(deref_tuple.tuple_expr->var);
+                int idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+                if (!address_taken.count(tuple_id) && is_fun_type(*target.type)) {
+                    bindings[element_key(tuple_id.name, idx)] = targets(assign.expr, bindings);
+                } else {
+                    bindings.erase(element_key(tuple_id.name, idx));
+                }
+            } else if (auto root = lvalue_root(target)) {
+                kill(root->name, bindings);
+            }
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            visit(std::get<Expr>(part.var), bindings);
+        } else if (std::holds_alternative<Print>(part.var)) {
+            visit(std::get<Print>(part.var).expr, bindings);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                std::vector<Bindings> branches;
+                for (IfCond& if_cond : cond.if_conds) {
+                    visit(if_cond.expr, bindings);
+                    branches.push_back(bindings);
+                    visit_scope(if_cond.body, branches.back());
+                }
+                branches.push_back(bindings);
+                if (cond.else_body) {
+                    visit_scope(*cond.else_body, branches.back());
+                }
+                for (auto& [key, key_targets] : bindings) {
+                    key_targets.clear();
+                    for (const Bindings& branch : branches) {
+                        auto it = branch.find(key);
+                        if (it == branch.end() || it->second.empty()) {
+                            key_targets.clear();
+                            break;
+                        }
+                        key_targets.insert(it->second.begin(), it->second.end());
+                    }
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                Loop& loop = std::get<Loop>(flow.var);
+                std::unordered_set<ID> assigned;
+                bool writes_memory = false;
+                collect_assigned(loop.body, assigned, writes_memory);
+                for (const ID& id : assigned) {
+                    if (bindings.count(id.name)) {
+                        kill(id.name, bindings);
+                    }
+                }
+                visit(loop.expr, bindings);
+                Bindings body_bindings = bindings;
+                visit_scope(loop.body, body_bindings);
+            } else {
+                Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    visit(*control.second, bindings);
+                }
+            }
+        }
+    }
+}
+
+void DevirtualizationContext::run() {
+    Bindings bindings;
+    auto known_args = arg_targets.find(fun_decl.id.name);
+    for (size_t i = 0; i < fun_decl.args.size(); ++i) {
+        const FunArg& arg = fun_decl.args[i];
+        bindings[arg.id.name] = {};
+        if (known_args != arg_targets.end() && !address_taken.count(arg.id)) {
+            bindings[arg.id.name] = known_args->second[i];
+        }
+    }
+    visit(fun_decl.body, bindings);
+}
+
+void DevirtualizationContext::collect(CallArgs& res) {
+    call_args = &res;
+    run();
+    call_args = nullptr;
+}
+
+void DevirtualizationContext::rewrite() {
+    rewriting = true;
+    run();
+    rewriting = false;
+}
+
+void devirtualization(Program& program, const std::unordered_set<ID>& fun_ids) {
+    // Functions whose name is used as a value may be called with anything
+    std::unordered_set<const Expr*> called;
+    std::unordered_set<std::string> escaping = { "main" };
+    for (const FunDecl& fun_decl : program.decls) {
+        walk(fun_decl.body, [&](const Expr& expr) {
+            if (std::holds_alternative<FunCall>(expr.var)) {
+                called.insert(std::get<FunCall>(expr.var).fun.get());
+            }
+        });
+        walk(fun_decl.body, [&](const Expr& expr) {
+            if (std::holds_alternative<ID>(expr.var) && !called.count(&expr) && fun_ids.count(std::get<ID>(expr.var))) {
+                escaping.insert(std::get<ID>(expr.var).name);
+            }
+        });
+    }
+
+    std::unordered_map<std::string, std::vector<Targets>> arg_targets;
+    for (size_t round = 0; round <= program.decls.size(); ++round) {
+        CallArgs call_args;
+        for (FunDecl& fun_decl : program.decls) {
+            DevirtualizationContext(fun_decl, fun_ids, arg_targets).collect(call_args);
+        }
+
+        std::unordered_map<std::string, std::vector<Targets>> known;
+        for (const FunDecl& fun_decl : program.decls) {
+            auto args = call_args.find(fun_decl.id.name);
+            if (escaping.count(fun_decl.id.name) || args == call_args.end()) {
+                continue;
+            }
+            std::vector<Targets>& fun_known = known[fun_decl.id.name];
+            for (size_t i = 0; i < fun_decl.args.size(); ++i) {
+                bool is_known = is_fun_type(fun_decl.args[i].type) && i < args->second.size() && args->second[i];
+                fun_known.push_back(is_known ? *args->second[i] : Targets{});
+            }
+        }
+        if (known == arg_targets) {
+            break;
+        }
+        arg_targets = std::move(known);
+    }
+
+    for (FunDecl& fun_decl : program.decls) {
+        DevirtualizationContext(fun_decl, fun_ids, arg_targets).rewrite();
+    }
+}
+
+}
@@ -0,0 +1,502 @@
+#include "code_generator.hpp"
+#include "syntax_check.hpp"
+
+namespace foc {
+
+//*********************************************
+// Instruction selection (with optimizations):
+//     Scalar expressions made of +, -, *, comparisons, constants, variables
+//     and elements of variables in the frame aren't lowered node by node to the
+//     stack macros. They are labeled bottom-up instead, every node gets the
+//     cheapest of the patterns matching it, with its cost in estimated
+//     cycles. A node usable directly as an operand (immediate, register
+//     variable or memory) costs nothing where an operand is accepted.
+//
+//     Patterns are operands folded into add / sub / imul / cmp, lea for sums
+//     of registers, constants and scaled indices, inc / dec, shifts and lea
+//     for multiplications by constants, test for comparisons with 0 and
+//     setcc for comparisons used as values. An element at a variable position
+//     is a memory operand with the index scaled by the element size, e.g.
+//     [rbp + r12 * 8 - 40], if the index is a register variable, and loaded
+//     after computing the index otherwise.
+//
+//     The covers are emitted top-down to scratch registers, the operand
+//     needing more registers first. Anything else, e.g. calls, divisions or
+//     trees needing more scratch registers than there are, falls back to the
+//     macros. In branches only the comparison is selected, the jump follows.
+//
+
+const int64_t simple_cost = 1;
+const int64_t imul_cost = 3;
+
+bool is_usable(const Cover& cover) {
+    return cover.pattern == Cover::OPERAND && !cover.negate;
+}
+
+bool is_immediate(const Cover& cover) {
+    return is_usable(cover) && (std::isdigit(cover.operand[0]) || cover.operand[0] == '-');
+}
+
+bool is_memory_operand(const Cover& cover) {
+    return is_usable(cover) && cover.operand.find('[') != std::string::npos;
+}
+
+bool is_register_variable(const Cover& cover) {
+    return is_usable(cover) && !is_immediate(cover) && !is_memory_operand(cover);
+}
+
+// Cost of `cover` where an operand is accepted
+int64_t use_cost(const Cover& cover) {
+    return is_usable(cover) ? 0 : cover.cost;
+}
+
+// Scratch registers needed for `first` in a register and `second` as operand
+int64_t binary_registers(const Cover& first, const Cover& second) {
+    if (is_usable(second)) {
+        return first.registers;
+    }
+    if (second.registers > first.registers) {
+        return second.registers;
+    }
+    return std::max(first.registers, second.registers + 1);
+}
+
+// Scratch registers needed for two values both kept in registers, the null ones aren't needed
+int64_t pair_registers(const Cover* first, const Cover* second) {
+    int64_t a = first ? first->registers : 0;
+    int64_t b = second ? second->registers : 0;
+    return std::max(std::max(a, b), std::min(a, b) + 1);
+}
+
+std::optional<Cover> CodeGenerator::label(const Expr& expr) {
+    auto cover_it = covers.find(&expr);
+    if (cover_it != covers.end()) {
+        return cover_it->second;
+    }
+    std::optional<Cover> res = label_node(expr);
+    if (res && expr.minus && !get_valid_index(expr)) {
+        res->negate = true;
+        res->cost += simple_cost;
+    }
+    covers[&expr] = res;
+    return res;
+}
+
+std::optional<Cover> CodeGenerator::label_node(const Expr& expr) {
+    if (auto constant = get_valid_index(expr)) {
+        return Cover{ .operand = std::to_string(*constant), .cost = simple_cost };
+    }
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<char>(type_expr.expr)) {
+            return Cover{ .operand = std::to_string(int(std::get<char>(type_expr.expr))), .cost = simple_cost };
+        }
+        if (std::holds_alternative<bool>(type_expr.expr)) {
+            return Cover{ .operand = std::to_string(int(std::get<bool>(type_expr.expr))), .cost = simple_cost };
+        }
+        return {};
+    }
+    if (std::holds_alternative<ID>(expr.var) && !fun_ids.count(std::get<ID>(expr.var))) {
+        const Symbol& symbol = find_symbol(std::get<ID>(expr.var));
+        if (symbol.by_reference) {
+            return {};
+        }
+        return Cover{ .operand = operand(symbol), .cost = simple_cost };
+    }
+    if (std::holds_alternative<DerefArray>(expr.var) || std::holds_alternative<DerefTuple>(expr.var)) {
+        Expr element = expr;
+        element.minus = false;
+        if (auto address = constant_address(element)) {
+            return Cover{ .operand = "qword " + frame_ref(*address), .cost = simple_cost };
+        }
+        if (std::holds_alternative<DerefArray>(expr.var)) {
+            return label_element(std::get<DerefArray>(expr.var));
+        }
+        return {};
+    }
+    if (!std::holds_alternative<BinOperation>(expr.var)) {
+        return {};
+    }
+
+    const auto& bin_op = std::get<BinOperation>(expr.var);
+    static const std::unordered_map<BinOperation::Operator, std::pair<std::string, std::string>> conditions = {
+        { BinOperation::LESS,      { "l",  "g"  } },
+        { BinOperation::GREATER,   { "g",  "l"  } },
+        { BinOperation::LEQ,       { "le", "ge" } },
+        { BinOperation::GEQ,       { "ge", "le" } },
+        { BinOperation::IS_EQUAL,  { "e",  "e"  } },
+        { BinOperation::NOT_EQUAL, { "ne", "ne" } },
+    };
+    bool arithmetic = bin_op.op == BinOperation::PLUS || bin_op.op == BinOperation::MINUS || bin_op.op == BinOperation::STAR;
+    auto condition = conditions.find(bin_op.op);
+    if (!arithmetic && condition == conditions.end()) {
+        return {};
+    }
+    auto left = label(*bin_op.left_expr);
+    auto right = label(*bin_op.right_expr);
+    if (!left || !right) {
+        return {};
+    }
+
+    std::optional<Cover> best;
+    auto consider = [&](Cover cover) {
+        if (!best || cover.cost < best->cost) {
+            best = cover;
+        }
+    };
+
+    if (condition != conditions.end()) {
+        // cmp takes a register or memory first, and no two memory operands
+        auto compare = [&](const Expr& first, const Cover& first_cover, const Expr& second, const Cover& second_cover,
+                           const std::string& cc) {
+            bool first_direct = is_usable(first_cover) && !is_immediate(first_cover);
+            bool second_direct = is_usable(second_cover) && !(is_memory_operand(first_cover) && is_memory_operand(second_cover));
+            int64_t held = (first_direct ? 0 : 1) + (second_direct ? 0 : 1);
+            Cover cover{
+                .pattern = Cover::COMPARE,
+                .instruction = cc,
+                .first = &first,
+                .second = &second,
+                .cost = (first_direct ? 0 : first_cover.cost) + (second_direct ? 0 : second_cover.cost) + 3 * simple_cost,
+            };
+            cover.registers = std::max(pair_registers(first_direct ? nullptr : &first_cover, second_direct ? nullptr : &second_cover),
+                                       held + 1);
+            consider(cover);
+        };
+        compare(*bin_op.left_expr, *left, *bin_op.right_expr, *right, condition->second.first);
+        compare(*bin_op.right_expr, *right, *bin_op.left_expr, *left, condition->second.second);
+        return best;
+    }
+
+    if (bin_op.op == BinOperation::STAR && (is_immediate(*left) || is_immediate(*right))) {
+        bool constant_right = is_immediate(*right);
+        const Cover& value = constant_right ? *left : *right;
+        int64_t factor = std::stoll(constant_right ? right->operand : left->operand);
+        return Cover{
+            .pattern = Cover::MULTIPLY,
+            .first = constant_right ? bin_op.left_expr.get() : bin_op.right_expr.get(),
+            .factor = factor,
+            .cost = value.cost + multiply_cost(factor),
+            .registers = std::max<int64_t>(value.registers, 2),
+        };
+    }
+
+    std::string instruction = bin_op.op == BinOperation::PLUS ? "add" : bin_op.op == BinOperation::MINUS ? "sub" : "imul";
+    int64_t op_cost = bin_op.op == BinOperation::STAR ? imul_cost : simple_cost;
+    consider(Cover{
+        .pattern = Cover::BINARY,
+        .instruction = instruction,
+        .first = bin_op.left_expr.get(),
+        .second = bin_op.right_expr.get(),
+        .cost = left->cost + use_cost(*right) + op_cost,
+        .registers = binary_registers(*left, *right),
+    });
+    if (bin_op.op != BinOperation::MINUS) {
+        consider(Cover{
+            .pattern = Cover::BINARY,
+            .instruction = instruction,
+            .first = bin_op.right_expr.get(),
+            .second = bin_op.left_expr.get(),
+            .cost = right->cost + use_cost(*left) + op_cost,
+            .registers = binary_registers(*right, *left),
+        });
+    }
+    if (bin_op.op == BinOperation::STAR) {
+        return best;
+    }
+
+    // x + 1, x - 1
+    if (is_immediate(*right) && (right->operand == "1" || right->operand == "-1")) {
+        bool increment = (right->operand == "1") == (bin_op.op == BinOperation::PLUS);
+        Cover cover{
+            .pattern = Cover::INC_DEC,
+            .instruction = increment ? "inc" : "dec",
+            .first = bin_op.left_expr.get(),
+            .cost = left->cost + simple_cost,
+            .registers = left->registers,
+        };
+        if (cover.cost <= best->cost) {
+            best = cover;
+        }
+    }
+
+    // lea doesn't destroy its operands, so register variables aren't copied first
+    if (is_register_variable(*left) && is_immediate(*right)) {
+        int64_t displacement = std::stoll(right->operand);
+        consider(Cover{
+            .pattern = Cover::LEA,
+            .first = bin_op.left_expr.get(),
+            .displacement = bin_op.op == BinOperation::PLUS ? displacement : -displacement,
+            .cost = simple_cost,
+        });
+    }
+    if (bin_op.op == BinOperation::MINUS) {
+        return best;
+    }
+    if (is_immediate(*left) && is_register_variable(*right)) {
+        consider(Cover{
+            .pattern = Cover::LEA,
+            .first = bin_op.right_expr.get(),
+            .displacement = std::stoll(left->operand),
+            .cost = simple_cost,
+        });
+    }
+
+    // base + index * scale, the base may be a constant or missing
+    auto scaled = [&](const Expr& base, const Cover& base_cover, const Expr& product) {
+        if (product.minus || !std::holds_alternative<BinOperation>(product.var)) {
+            return;
+        }
+        const auto& mul = std::get<BinOperation>(product.var);
+        if (mul.op != BinOperation::STAR) {
+            return;
+        }
+        auto mul_left = label(*mul.left_expr);
+        auto mul_right = label(*mul.right_expr);
+        if (!mul_left || !mul_right || !(is_immediate(*mul_left) || is_immediate(*mul_right))) {
+            return;
+        }
+        bool constant_right = is_immediate(*mul_right);
+        int64_t scale = std::stoll(constant_right ? mul_right->operand : mul_left->operand);
+        const Expr& index = constant_right ? *mul.left_expr : *mul.right_expr;
+        const Cover& index_cover = constant_right ? *mul_left : *mul_right;
+        if ((scale != 2 && scale != 4 && scale != 8) || is_immediate(index_cover)) {
+            return;
+        }
+        Cover cover{ .pattern = Cover::LEA, .second = &index, .scale = scale };
+        bool computed_base = !is_immediate(base_cover) && !is_register_variable(base_cover);
+        bool computed_index = !is_register_variable(index_cover);
+        if (is_immediate(base_cover)) {
+            cover.displacement = std::stoll(base_cover.operand);
+        } else {
+            cover.first = &base;
+        }
+        cover.cost = (computed_base ? base_cover.cost : 0) + (computed_index ? index_cover.cost : 0) + simple_cost;
+        cover.registers = std::max<int64_t>(pair_registers(computed_base ? &base_cover : nullptr,
+                                                           computed_index ? &index_cover : nullptr), 1);
+        consider(cover);
+    };
+    scaled(*bin_op.left_expr, *left, *bin_op.right_expr);
+    scaled(*bin_op.right_expr, *right, *bin_op.left_expr);
+    if (is_register_variable(*left) && is_register_variable(*right)) {
+        consider(Cover{
+            .pattern = Cover::LEA,
+            .first = bin_op.left_expr.get(),
+            .second = bin_op.right_expr.get(),
+            .cost = simple_cost,
+        });
+    }
+    return best;
+}
+
+// Element of an array in the frame at a variable position, or a packed one
+std::optional<Cover> CodeGenerator::label_element(const DerefArray& deref_array) {
+    int64_t size = el_size(*deref_array.array_expr->type);
+    auto base = constant_address(*deref_array.array_expr);
+    if (!base || (size != 1 && size != 8)) {
+        return {};
+    }
+    // Induction loops may not update the index at all
+    if (auto pointer = induction_pointer(deref_array)) {
+        if (!pointer->first.location.reg || size != 8) {
+            return {};
+        }
+        int64_t offset = pointer->second;
+        std::string displacement = offset < 0 ? " + " + std::to_string(-offset) : " - " + std::to_string(offset);
+        return Cover{ .operand = "qword [" + *pointer->first.location.reg + displacement + "]", .cost = simple_cost };
+    }
+
+    std::string instruction = size == 1 ? "movzx" : "mov";
+    if (auto index = get_valid_index(*deref_array.deref_expr)) {
+        return Cover{ .pattern = Cover::ELEMENT, .instruction = instruction, .displacement = *index * size - *base,
+                      .cost = simple_cost };
+    }
+    auto index = label(*deref_array.deref_expr);
+    if (!index) {
+        return {};
+    }
+    if (size == 8 && is_register_variable(*index)) {
+        std::string displacement = *base < 0 ? " + " + std::to_string(-*base) : " - " + std::to_string(*base);
+        return Cover{ .operand = "qword [rbp + " + index->operand + " * 8" + displacement + "]", .cost = simple_cost };
+    }
+    bool computed_index = !is_register_variable(*index);
+    return Cover{
+        .pattern = Cover::ELEMENT,
+        .instruction = instruction,
+        .second = deref_array.deref_expr.get(),
+        .scale = size,
+        .displacement = -*base,
+        .cost = (computed_index ? index->cost : 0) + simple_cost,
+        .registers = computed_index ? index->registers : 1,
+    };
+}
+
+std::string take_register(std::vector<std::string>& free_registers) {
+    if (free_registers.empty()) {
+        throw std::logic_error("Bug in instruction selector, out of scratch registers -- take_register");
+    }
+    std::string res = free_registers.back();
+    free_registers.pop_back();
+    return res;
+}
+
+void release_register(const std::string& reg, std::vector<std::string>& free_registers) {
+    for (const auto& [scratch, low_byte] : scratch_registers) {
+        if (scratch == reg) {
+            free_registers.push_back(reg);
+        }
+    }
+}
+
+std::string low_byte(const std::string& reg) {
+    for (const auto& [scratch, low] : scratch_registers) {
+        if (scratch == reg) {
+            return low;
+        }
+    }
+    throw std::logic_error("Bug in instruction selector, " + reg + " isn't a scratch register -- low_byte");
+}
+
+// Operand of `expr`, computed to a scratch register if it isn't one already
+std::string CodeGenerator::use(const Expr& expr, std::vector<std::string>& free_registers) {
+    const Cover& cover = *covers.at(&expr);
+    if (is_usable(cover)) {
+        return cover.operand;
+    }
+    return reduce(expr, free_registers);
+}
+
+// Operands of a comparison, the one needing more registers is computed first
+std::pair<std::string, std::string> CodeGenerator::compare_operands(const Cover& cover, std::vector<std::string>& free_registers) {
+    const Cover& first = *covers.at(cover.first);
+    const Cover& second = *covers.at(cover.second);
+    bool first_direct = is_usable(first) && !is_immediate(first);
+    bool second_direct = is_usable(second) && !(is_memory_operand(first) && is_memory_operand(second));
+    std::string a;
+    std::string b;
+    if (!second_direct && (first_direct || second.registers > first.registers)) {
+        b = reduce(*cover.second, free_registers);
+        a = first_direct ? first.operand : reduce(*cover.first, free_registers);
+    } else {
+        a = first_direct ? first.operand : reduce(*cover.first, free_registers);
+        b = second_direct ? second.operand : reduce(*cover.second, free_registers);
+    }
+    return { a, b };
+}
+
+// Emits the cover of `expr` to a scratch register from `free_registers` and returns the register
+std::string CodeGenerator::reduce(const Expr& expr, std::vector<std::string>& free_registers) {
+    const Cover& cover = *covers.at(&expr);
+    std::string res;
+    if (cover.pattern == Cover::OPERAND) {
+        res = take_register(free_registers);
+        if (cover.operand == "0") {
+            out_file << "    xor " << res << ", " << res << std::endl;
+        } else {
+            out_file << "    mov " << res << ", " << cover.operand << std::endl;
+        }
+    } else if (cover.pattern == Cover::BINARY) {
+        const Cover& first = *covers.at(cover.first);
+        const Cover& second = *covers.at(cover.second);
+        std::string value;
+        if (!is_usable(second) && second.registers > first.registers) {
+            value = reduce(*cover.second, free_registers);
+            res = reduce(*cover.first, free_registers);
+        } else {
+            res = reduce(*cover.first, free_registers);
+            value = use(*cover.second, free_registers);
+        }
+        out_file << "    " << cover.instruction << " " << res << ", " << value << std::endl;
+        release_register(value, free_registers);
+    } else if (cover.pattern == Cover::INC_DEC) {
+        res = reduce(*cover.first, free_registers);
+        out_file << "    " << cover.instruction << " " << res << std::endl;
+    } else if (cover.pattern == Cover::LEA) {
+        const Cover* base = cover.first ? &*covers.at(cover.first) : nullptr;
+        const Cover* index = cover.second ? &*covers.at(cover.second) : nullptr;
+        auto to_register = [&](const Expr* expr, const Cover* expr_cover) -> std::string {
+            if (!expr) {
+                return "";
+            }
+            return is_register_variable(*expr_cover) ? expr_cover->operand : reduce(*expr, free_registers);
+        };
+        std::string base_reg;
+        std::string index_reg;
+        if (base && index && !is_register_variable(*index)
+                && (is_register_variable(*base) || index->registers > base->registers)) {
+            index_reg = to_register(cover.second, index);
+            base_reg = to_register(cover.first, base);
+        } else {
+            base_reg = to_register(cover.first, base);
+            index_reg = to_register(cover.second, index);
+        }
+        std::string address = base_reg;
+        if (!index_reg.empty()) {
+            address += (address.empty() ? "" : " + ") + index_reg + (cover.scale != 1 ? " * " + std::to_string(cover.scale) : "");
+        }
+        if (cover.displacement != 0) {
+            address += (cover.displacement < 0 ? " - " : " + ") + std::to_string(std::abs(cover.displacement));
+        }
+        release_register(index_reg, free_registers);
+        release_register(base_reg, free_registers);
+        res = take_register(free_registers);
+        out_file << "    lea " << res << ", [" << address << "]" << std::endl;
+    } else if (cover.pattern == Cover::ELEMENT) {
+        std::string address = "rbp";
+        if (cover.second) {
+            const Cover& index = *covers.at(cover.second);
+            std::string index_reg = is_register_variable(index) ? index.operand : reduce(*cover.second, free_registers);
+            address += " + " + index_reg + (cover.scale != 1 ? " * " + std::to_string(cover.scale) : "");
+            release_register(index_reg, free_registers);
+        }
+        if (cover.displacement != 0) {
+            address += (cover.displacement < 0 ? " - " : " + ") + std::to_string(std::abs(cover.displacement));
+        }
+        res = take_register(free_registers);
+        out_file << "    " << cover.instruction << " " << res << (cover.instruction == "movzx" ? ", byte [" : ", qword [")
+                 << address << "]" << std::endl;
+    } else if (cover.pattern == Cover::MULTIPLY) {
+        res = reduce(*cover.first, free_registers);
+        std::string scratch = take_register(free_registers);
+        generate_multiply(res, cover.factor, scratch);
+        release_register(scratch, free_registers);
+    } else {
+        auto [a, b] = compare_operands(cover, free_registers);
+        res = take_register(free_registers);
+        out_file << "    xor " << res << ", " << res << std::endl;
+        if (b == "0" && a.find('[') == std::string::npos) {
+            out_file << "    test " << a << ", " << a << std::endl;
+        } else {
+            out_file << "    cmp " << a << ", " << b << std::endl;
+        }
+        out_file << "    set" << cover.instruction << " " << low_byte(res) << std::endl;
+        release_register(a, free_registers);
+        release_register(b, free_registers);
+    }
+
+    if (cover.negate) {
+        bool is_bool = expr.type && std::holds_alternative<Type::Primitive>(expr.type->var)
+            && std::get<Type::Primitive>(expr.type->var) == Type::Primitive::BOOL;
+        out_file << (is_bool ? "    xor " + res + ", 1" : "    neg " + res) << std::endl;
+    }
+    return res;
+}
+
+// Pushes `expr` computed by selected instructions, false if it has to fall back to the macros
+bool CodeGenerator::generate_selected(const Expr& expr) {
+    covers.clear();
+    auto cover = label(expr);
+    if (!cover || cover->registers > int64_t(scratch_registers.size())) {
+        return false;
+    }
+    std::vector<std::string> free_registers;
+    for (auto it = scratch_registers.rbegin(); it != scratch_registers.rend(); ++it) {
+        free_registers.push_back(it->first);
+    }
+    out_file << "    ; selected expr" << std::endl;
+    std::string res = reduce(expr, free_registers);
+    out_file << "    push_ " << res << std::endl;
+    return true;
+}
+
+}
@@ -0,0 +1,271 @@
+#include "optimizer.hpp"
+#include "syntax_check.hpp"
+
+namespace foc {
+
+//*********************************************
+// Loop-invariant code motion:
+//     An expression inside a `while` is invariant when it calls nothing and
+//     none of the variables it reads is declared or assigned in the loop.
+//     If the loop, its condition included, writes memory (through pointers,
+//     calls or to an address-taken variable), address-taken variables and
+//     pointer reads are not invariant either.
+//
+//     Invariant expressions are computed once into a temporary in front of
+//     the loop (the preheader) and the loop reads the temporary instead.
+//     The condition is evaluated at least once, so anything from it may be
+//     hoisted, except from the right operand of `&&` and `||`. The body may
+//     not run at all, so from there only expressions that cannot fault are
+//     hoisted, i.e. no pointer reads and no divisions by anything else than
+//     a known safe constant.
+//
+//     Outer loops are handled first, so an expression lands in front of the
+//     outermost loop it is invariant in.
+//
+
+struct InvariantExpr {
+    std::vector<Expr*> uses;
+};
+
+class LICMContext {
+public:
+    LICMContext(FunDecl& fun_decl) : fun_decl(fun_decl) {
+        collect_address_taken(fun_decl.body, address_taken);
+    }
+
+    void run();
+
+private:
+    void visit(FunBody& body);
+    void hoist(FunBody& body, size_t& idx);
+
+    bool is_invariant(const Expr& expr, bool always_evaluated) const;
+    void collect(Expr& expr, bool always_evaluated);
+    void collect_lvalue(Expr& expr);
+    void collect(FunBody& body);
+
+    FunDecl& fun_decl;
+    std::unordered_set<ID> address_taken;
+    std::vector<VarDecl> temp_decls;
+
+    // State of the loop being processed
+    std::unordered_set<ID> variant;
+    bool writes_memory = false;
+    std::vector<std::string> order;
+    std::unordered_map<std::string, InvariantExpr> invariants;
+};
+
+bool LICMContext::is_invariant(const Expr& expr, bool always_evaluated) const {
+    bool res = true;
+    walk(expr, [&](const Expr& sub_expr) {
+        if (std::holds_alternative<ID>(sub_expr.var)) {
+            const ID& id = std::get<ID>(sub_expr.var);
+            res &= !variant.count(id) && !(writes_memory && address_taken.count(id));
+        } else if (std::holds_alternative<FunCall>(sub_expr.var)) {
+            res = false;
+        } else if (std::holds_alternative<BinOperation>(sub_expr.var)) {
+            const auto& bin_op = std::get<BinOperation>(sub_expr.var);
+            if (bin_op.op == BinOperation::SLASH && !always_evaluated) {
+                auto divisor = get_valid_index(*bin_op.right_expr);
+                res &= divisor && *divisor != 0 && *divisor != -1;
+            }
+        } else if (std::holds_alternative<TypeExpr>(sub_expr.var)) {
+            const auto& type_expr = std::get<TypeExpr>(sub_expr.var);
+            if (std::holds_alternative<PtrExpr>(type_expr.expr) && std::get<PtrExpr>(type_expr.expr).deref_expr) {
+                res &= always_evaluated && !writes_memory;
+            }
+        }
+    });
+    return res;
+}
+
+void LICMContext::collect(Expr& expr, bool always_evaluated) {
+    bool worth_hoisting = std::holds_alternative<BinOperation>(expr.var)
+        || std::holds_alternative<DerefArray>(expr.var)
+        || std::holds_alternative<DerefTuple>(expr.var);
+    if (worth_hoisting && is_invariant(expr, always_evaluated)) {
+        std::string key = structural_key(expr);
+        if (!invariants.count(key)) {
+            order.push_back(key);
+        }
+        invariants[key].uses.push_back(&expr);
+        return;
+    }
+
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        bool short_circuit = bin_op.op == BinOperation::AND || bin_op.op == BinOperation::OR;
+        collect(*bin_op.left_expr, always_evaluated);
+        collect(*bin_op.right_expr, always_evaluated && !short_circuit);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        collect(*deref_array.array_expr, always_evaluated);
+        collect(*deref_array.deref_expr, always_evaluated);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        collect(*std::get<DerefTuple>(expr.var).tuple_expr, always_evaluated);
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        auto& fun_call = std::get<FunCall>(expr.var);
+        collect(*fun_call.fun, always_evaluated);
+        if (fun_call.fun_args) {
+            for (Expr& arg : *fun_call.fun_args) {
+                collect(arg, always_evaluated);
+            }
+        }
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+            PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+            if (ptr_expr.ref_expr) {
+                collect_lvalue(*ptr_expr.ref_expr);
+            } else if (ptr_expr.deref_expr) {
+                collect(*ptr_expr.deref_expr, always_evaluated);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+                collect(sub_expr, always_evaluated);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+                collect(sub_expr, always_evaluated);
+            }
+        }
+    }
+}
+
+void LICMContext::collect_lvalue(Expr& expr) {
+    // Only the indices of an lvalue are computed values
+    if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        collect_lvalue(*deref_array.array_expr);
+        collect(*deref_array.deref_expr, false);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        collect_lvalue(*std::get<DerefTuple>(expr.var).tuple_expr);
+    } else if (!std::holds_alternative<ID>(expr.var)) {
+        collect(expr, false);
+    }
+}
+
+void LICMContext::collect(FunBody& body) {
+    for (FunBodyPart& part : body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                collect(*var_decl.expr, false);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            collect(assign.expr, false);
+            collect_lvalue(assign.assign_expr);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            collect(std::get<Expr>(part.var), false);
+        } else if (std::holds_alternative<Print>(part.var)) {
+            collect(std::get<Print>(part.var).expr, false);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                for (IfCond& if_cond : cond.if_conds) {
+                    collect(if_cond.expr, false);
+                    collect(if_cond.body);
+                }
+                if (cond.else_body) {
+                    collect(*cond.else_body);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                Loop& loop = std::get<Loop>(flow.var);
+                collect(loop.expr, false);
+                collect(loop.body);
+            } else {
+                auto& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    collect(*control.second, false);
+                }
+            }
+        }
+    }
+}
+
+void LICMContext::hoist(FunBody& body, size_t& idx) {
+    Loop& loop = std::get<Loop>(std::get<Flow>(body.parts[idx].var).var);
+
+    variant.clear();
+    writes_memory = false;
+    order.clear();
+    invariants.clear();
+    collect_assigned(loop.body, variant, writes_memory);
+    // The condition runs on every iteration as well, calls in it may write memory
+    writes_memory |= !is_pure(loop.expr);
+    // Pointers may read an address-taken variable written in the loop
+    for (const ID& id : variant) {
+        writes_memory |= address_taken.count(id) > 0;
+    }
+
+    collect(loop.expr, true);
+    collect(loop.body);
+
+    std::vector<FunBodyPart> preheader;
+    for (const std::string& key : order) {
+        const InvariantExpr& invariant = invariants[key];
+        std::shared_ptr<Type> type = invariant.uses.front()->type;
+        ID temp{ .name = "_licm" + std::to_string(temp_decls.size()) };
+        temp_decls.push_back(VarDecl{
+            .type = *type,
+            .ids  = std::vector<ID>{ temp },
+            .expr = std::nullopt,
+        });
+
+        FunBodyPart part;
+        part.var = Assign{
+            .assign_expr = make_id_expr(temp, type),
+            .expr        = clone(*invariant.uses.front()),
+        };
+        preheader.push_back(part);
+        for (Expr* use : invariant.uses) {
+            *use = make_id_expr(temp, type);
+        }
+    }
+    body.parts.insert(body.parts.begin() + idx, preheader.begin(), preheader.end());
+    idx += preheader.size();
+}
+
+void LICMContext::visit(FunBody& body) {
+    for (size_t idx = 0; idx < body.parts.size(); ++idx) {
+        if (!std::holds_alternative<Flow>(body.parts[idx].var)) {
+            continue;
+        }
+        if (std::holds_alternative<Loop>(std::get<Flow>(body.parts[idx].var).var)) {
+            hoist(body, idx);
+        }
+
+        Flow& flow = std::get<Flow>(body.parts[idx].var);
+        if (std::holds_alternative<Cond>(flow.var)) {
+            Cond& cond = std::get<Cond>(flow.var);
+            for (IfCond& if_cond : cond.if_conds) {
+                visit(if_cond.body);
+            }
+            if (cond.else_body) {
+                visit(*cond.else_body);
+            }
+        } else if (std::holds_alternative<Loop>(flow.var)) {
+            visit(std::get<Loop>(flow.var).body);
+        }
+    }
+}
+
+void LICMContext::run() {
+    visit(fun_decl.body);
+
+    std::vector<FunBodyPart> decl_parts;
+    for (VarDecl& var_decl : temp_decls) {
+        FunBodyPart part;
+        part.var = std::move(var_decl);
+        decl_parts.push_back(part);
+    }
+    fun_decl.body.parts.insert(fun_decl.body.parts.begin(), decl_parts.begin(), decl_parts.end());
+}
+
+void loop_invariant_code_motion(FunDecl& fun_decl) {
+    LICMContext(fun_decl).run();
+}
+
+}
@@ -0,0 +1,394 @@
+#include <climits>
+
+#include "optimizer.hpp"
+#include "syntax_check.hpp"
+
+namespace foc {
+
+//*********************************************
+// Loop unrolling:
+//     A counted loop is
+//         i = c0;           // possibly followed by statements not writing i
+//         while (i < N) {      // or <=, >, >=, !=
+//             ...              // no other write to i, no break or continue
+//             i = i + s;       // or i - s
+//         }
+//     with c0, N and s known at compile time, so the number of iterations
+//     is known as well.
+//
+//     Small loops are replaced by straight-line copies of the body, with `i`
+//     replaced by its value in each copy. Bigger ones get a main loop running
+//     `unroll_factor` copies per iteration (reading `i + k * s`) followed by
+//     straight-line copies for the remaining iterations. Either way `i` ends
+//     with the same value as before.
+//
+//     Bodies declaring variables are left alone, copies of them would
+//     declare the same names twice in one scope.
+//
+
+const int64_t max_trip_count = 1 << 16;
+const int64_t max_unrolled_size = 64;
+const int64_t unroll_factor = 4;
+
+struct CountedLoop {
+    ID var;
+    int64_t start;
+    int64_t step;
+    int64_t trip_count;
+};
+
+Expr make_int_expr(int64_t value) {
+    Type int_type;
+    int_type.var = Type::Primitive::INT;
+    Expr res;
+    res.var = TypeExpr{ .expr = static_cast<int>(value) };
+    res.type = std::make_shared<Type>(int_type);
+    return res;
+}
+
+bool compare(BinOperation::Operator op, int64_t left, int64_t right) {
+    switch (op) {
+        case BinOperation::LESS:      return left < right;
+        case BinOperation::LEQ:       return left <= right;
+        case BinOperation::GREATER:   return left > right;
+        case BinOperation::GEQ:       return left >= right;
+        case BinOperation::NOT_EQUAL: return left != right;
+        default:
+            throw std::logic_error("Bug in loop unrolling, not a comparison -- compare");
+    }
+}
+
+BinOperation::Operator flip(BinOperation::Operator op) {
+    switch (op) {
+        case BinOperation::LESS:    return BinOperation::GREATER;
+        case BinOperation::LEQ:     return BinOperation::GEQ;
+        case BinOperation::GREATER: return BinOperation::LESS;
+        case BinOperation::GEQ:     return BinOperation::LEQ;
+        default:                    return op;
+    }
+}
+
+bool is_plain_id(const Expr& expr, const ID& id) {
+    return !expr.minus && std::holds_alternative<ID>(expr.var) && std::get<ID>(expr.var) == id;
+}
+
+std::optional<int64_t> constant_init(const FunBodyPart& part, const ID& id) {
+    if (std::holds_alternative<VarDecl>(part.var)) {
+        const VarDecl& var_decl = std::get<VarDecl>(part.var);
+        if (var_decl.ids && var_decl.ids->size() == 1 && var_decl.ids->front() == id && var_decl.expr) {
+            return get_valid_index(*var_decl.expr);
+        }
+    } else if (std::holds_alternative<Assign>(part.var)) {
+        const Assign& assign = std::get<Assign>(part.var);
+        if (is_plain_id(assign.assign_expr, id)) {
+            return get_valid_index(assign.expr);
+        }
+    }
+    return {};
+}
+
+std::optional<int64_t> constant_step(const FunBodyPart& part, const ID& id) {
+    if (!std::holds_alternative<Assign>(part.var)) {
+        return {};
+    }
+    const Assign& assign = std::get<Assign>(part.var);
+    if (!is_plain_id(assign.assign_expr, id) || assign.expr.minus
+            || !std::holds_alternative<BinOperation>(assign.expr.var)) {
+        return {};
+    }
+    const auto& bin_op = std::get<BinOperation>(assign.expr.var);
+    if (bin_op.op == BinOperation::PLUS && is_plain_id(*bin_op.left_expr, id)) {
+        return get_valid_index(*bin_op.right_expr);
+    } else if (bin_op.op == BinOperation::PLUS && is_plain_id(*bin_op.right_expr, id)) {
+        return get_valid_index(*bin_op.left_expr);
+    } else if (bin_op.op == BinOperation::MINUS && is_plain_id(*bin_op.left_expr, id)) {
+        auto step = get_valid_index(*bin_op.right_expr);
+        if (step) {
+            return -*step;
+        }
+    }
+    return {};
+}
+
+bool leaves_loop(const FunBody& body) {
+    // break and continue of nested loops belong to them
+    for (const FunBodyPart& part : body.parts) {
+        if (!std::holds_alternative<Flow>(part.var)) {
+            continue;
+        }
+        const Flow& flow = std::get<Flow>(part.var);
+        if (std::holds_alternative<Cond>(flow.var)) {
+            const Cond& cond = std::get<Cond>(flow.var);
+            for (const IfCond& if_cond : cond.if_conds) {
+                if (leaves_loop(if_cond.body)) {
+                    return true;
+                }
+            }
+            if (cond.else_body && leaves_loop(*cond.else_body)) {
+                return true;
+            }
+        } else if (std::holds_alternative<Flow::Control>(flow.var)) {
+            if (std::get<Flow::Control>(flow.var).first != Flow::ControlTypes::RETURN) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int64_t body_size(const FunBody& body) {
+    int64_t size = 0;
+    for (const FunBodyPart& part : body.parts) {
+        ++size;
+        if (!std::holds_alternative<Flow>(part.var)) {
+            continue;
+        }
+        const Flow& flow = std::get<Flow>(part.var);
+        if (std::holds_alternative<Cond>(flow.var)) {
+            const Cond& cond = std::get<Cond>(flow.var);
+            for (const IfCond& if_cond : cond.if_conds) {
+                size += body_size(if_cond.body);
+            }
+            if (cond.else_body) {
+                size += body_size(*cond.else_body);
+            }
+        } else if (std::holds_alternative<Loop>(flow.var)) {
+            size += body_size(std::get<Loop>(flow.var).body);
+        }
+    }
+    return size;
+}
+
+std::optional<CountedLoop> match_counted_loop(const FunBody& body, size_t idx, const std::unordered_set<ID>& address_taken) {
+    const Loop& loop = std::get<Loop>(std::get<Flow>(body.parts[idx].var).var);
+    if (idx == 0 || loop.body.parts.empty() || loop.expr.minus || !std::holds_alternative<BinOperation>(loop.expr.var)) {
+        return {};
+    }
+
+    // while (i op N) or while (N op i)
+    const auto& cond = std::get<BinOperation>(loop.expr.var);
+    BinOperation::Operator op = cond.op;
+    const Expr* var_expr = cond.left_expr.get();
+    auto bound = get_valid_index(*cond.right_expr);
+    if (!bound) {
+        var_expr = cond.right_expr.get();
+        bound = get_valid_index(*cond.left_expr);
+        op = flip(op);
+    }
+    bool is_comparison = op == BinOperation::LESS || op == BinOperation::LEQ || op == BinOperation::GREATER
+        || op == BinOperation::GEQ || op == BinOperation::NOT_EQUAL;
+    if (!bound || !is_comparison || var_expr->minus || !std::holds_alternative<ID>(var_expr->var)) {
+        return {};
+    }
+    const ID& var = std::get<ID>(var_expr->var);
+    if (address_taken.count(var)) {
+        return {};
+    }
+
+    // The closest write to i before the loop has to be a constant
+    std::optional<int64_t> start;
+    for (size_t prev = idx; prev-- > 0;) {
+        start = constant_init(body.parts[prev], var);
+        FunBody part_body;
+        part_body.parts.push_back(body.parts[prev]);
+        std::unordered_set<ID> assigned;
+        bool writes_memory = false;
+        collect_assigned(part_body, assigned, writes_memory);
+        if (start || assigned.count(var)) {
+            break;
+        }
+    }
+    auto step = constant_step(loop.body.parts.back(), var);
+    if (!start || !step || *step == 0) {
+        return {};
+    }
+
+    FunBody rest;
+    rest.parts.assign(loop.body.parts.begin(), loop.body.parts.end() - 1);
+    std::unordered_set<ID> assigned;
+    bool writes_memory = false;
+    collect_assigned(rest, assigned, writes_memory);
+    if (assigned.count(var) || leaves_loop(rest)) {
+        return {};
+    }
+    for (const FunBodyPart& part : rest.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            return {};
+        }
+    }
+
+    int64_t trip_count = 0;
+    int64_t value = *start;
+    while (compare(op, value, *bound)) {
+        if (++trip_count > max_trip_count) {
+            return {};
+        }
+        value += *step;
+    }
+    if (value < INT_MIN || value > INT_MAX) {
+        return {};
+    }
+
+    return CountedLoop{ .var = var, .start = *start, .step = *step, .trip_count = trip_count };
+}
+
+class LoopUnrollingContext {
+public:
+    LoopUnrollingContext(FunDecl& fun_decl) : fun_decl(fun_decl) {
+        collect_address_taken(fun_decl.body, address_taken);
+    }
+
+    void run() {
+        visit(fun_decl.body);
+    }
+
+private:
+    void visit(FunBody& body);
+    std::vector<FunBodyPart> unroll(const Loop& loop, const CountedLoop& counted);
+
+    FunDecl& fun_decl;
+    std::unordered_set<ID> address_taken;
+};
+
+// Body without the final increment, with every read of the loop variable replaced
+std::vector<FunBodyPart> copy_body(const Loop& loop, const ID& var, const std::function<Expr()>& replacement) {
+    FunBody copy;
+    copy.parts.assign(loop.body.parts.begin(), loop.body.parts.end() - 1);
+    copy = clone(copy);
+    for (Expr* use : collect_uses(copy, var)) {
+        bool minus = use->minus;
+        *use = replacement();
+        use->minus = minus;
+    }
+    return copy.parts;
+}
+
+Expr make_offset_expr(const Expr& var_expr, int64_t offset) {
+    Expr res;
+    res.type = var_expr.type;
+    res.var = BinOperation{
+        .left_expr  = std::make_shared<Expr>(make_id_expr(std::get<ID>(var_expr.var), var_expr.type)),
+        .right_expr = std::make_shared<Expr>(make_int_expr(std::abs(offset))),
+        .op         = offset > 0 ? BinOperation::PLUS : BinOperation::MINUS,
+    };
+    return res;
+}
+
+std::vector<FunBodyPart> LoopUnrollingContext::unroll(const Loop& loop, const CountedLoop& counted) {
+    const Assign& increment = std::get<Assign>(loop.body.parts.back().var);
+    const Expr& var_expr = increment.assign_expr;
+    int64_t size = std::max<int64_t>(body_size(loop.body) - 1, 1);
+
+    std::vector<FunBodyPart> res;
+    if (counted.trip_count == 0) {
+        return res;
+    }
+    auto append_copy = [&](std::vector<FunBodyPart> parts) {
+        res.insert(res.end(), parts.begin(), parts.end());
+    };
+    auto append_assign = [&](Expr expr) {
+        FunBodyPart part;
+        part.var = Assign{ .assign_expr = clone(var_expr), .expr = std::move(expr) };
+        res.push_back(part);
+    };
+
+    int64_t factor = counted.trip_count * size <= max_unrolled_size ? counted.trip_count : unroll_factor;
+    while (factor > 1 && factor * size > max_unrolled_size) {
+        --factor;
+    }
+    if (factor <= 1 && counted.trip_count > 1) {
+        // Not even two copies fit
+        return {};
+    }
+
+    int64_t main_trips = counted.trip_count - counted.trip_count % factor;
+    int64_t value = counted.start;
+    if (main_trips != counted.trip_count || factor != counted.trip_count) {
+        // while (i < end) { body(i); body(i + s); ...; i = i + factor * s; }
+        int64_t end = counted.start + main_trips * counted.step;
+        Loop main_loop;
+        main_loop.expr.type = loop.expr.type;
+        main_loop.expr.var = BinOperation{
+            .left_expr  = std::make_shared<Expr>(clone(var_expr)),
+            .right_expr = std::make_shared<Expr>(make_int_expr(end)),
+            .op         = counted.step > 0 ? BinOperation::LESS : BinOperation::GREATER,
+        };
+        for (int64_t k = 0; k < factor; ++k) {
+            auto parts = copy_body(loop, counted.var, [&]() {
+                return k == 0 ? clone(var_expr) : make_offset_expr(var_expr, k * counted.step);
+            });
+            main_loop.body.parts.insert(main_loop.body.parts.end(), parts.begin(), parts.end());
+        }
+        FunBodyPart step_part;
+        step_part.var = Assign{
+            .assign_expr = clone(var_expr),
+            .expr        = make_offset_expr(var_expr, factor * counted.step),
+        };
+        main_loop.body.parts.push_back(step_part);
+
+        FunBodyPart loop_part;
+        loop_part.var = Flow{ .var = std::move(main_loop) };
+        res.push_back(loop_part);
+        value = end;
+    } else {
+        main_trips = 0;
+    }
+
+    for (int64_t k = main_trips; k < counted.trip_count; ++k) {
+        append_copy(copy_body(loop, counted.var, [&]() { return make_int_expr(value); }));
+        value += counted.step;
+    }
+    if (main_trips != counted.trip_count) {
+        append_assign(make_int_expr(value));
+    }
+    return res;
+}
+
+void LoopUnrollingContext::visit(FunBody& body) {
+    size_t idx = 0;
+    while (idx < body.parts.size()) {
+        if (!std::holds_alternative<Flow>(body.parts[idx].var)) {
+            ++idx;
+            continue;
+        }
+        Flow& flow = std::get<Flow>(body.parts[idx].var);
+        if (std::holds_alternative<Cond>(flow.var)) {
+            Cond& cond = std::get<Cond>(flow.var);
+            for (IfCond& if_cond : cond.if_conds) {
+                visit(if_cond.body);
+            }
+            if (cond.else_body) {
+                visit(*cond.else_body);
+            }
+            ++idx;
+            continue;
+        } else if (!std::holds_alternative<Loop>(flow.var)) {
+            ++idx;
+            continue;
+        }
+
+        // Inner loops first, unrolling them may make the outer one small enough
+        Loop& loop = std::get<Loop>(flow.var);
+        visit(loop.body);
+
+        auto counted = match_counted_loop(body, idx, address_taken);
+        if (!counted) {
+            ++idx;
+            continue;
+        }
+        std::vector<FunBodyPart> parts = unroll(loop, *counted);
+        if (parts.empty() && counted->trip_count > 0) {
+            ++idx;
+            continue;
+        }
+        body.parts.erase(body.parts.begin() + idx);
+        body.parts.insert(body.parts.begin() + idx, parts.begin(), parts.end());
+        idx += parts.size();
+    }
+}
+
+void loop_unrolling(FunDecl& fun_decl) {
+    LoopUnrollingContext(fun_decl).run();
+}
+
+}
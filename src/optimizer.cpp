@@ -0,0 +1,376 @@
+#include "optimizer.hpp"
+
+namespace foc {
+
+Expr clone(const Expr& expr);
+
+TypeExpr clone(const TypeExpr& type_expr) {
+    TypeExpr res;
+    if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+        const PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+        PtrExpr ptr_res;
+        if (ptr_expr.ref_expr) {
+            ptr_res.ref_expr = std::make_shared<Expr>(clone(*ptr_expr.ref_expr));
+        }
+        if (ptr_expr.deref_expr) {
+            ptr_res.deref_expr = std::make_shared<Expr>(clone(*ptr_expr.deref_expr));
+        }
+        res.expr = ptr_res;
+    } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+        TupleExpr tuple_res;
+        for (const Expr& expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+            tuple_res.exprs.push_back(clone(expr));
+        }
+        res.expr = tuple_res;
+    } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+        ArrayExpr array_res;
+        for (const Expr& expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+            array_res.exprs.push_back(clone(expr));
+        }
+        res.expr = array_res;
+    } else {
+        res.expr = type_expr.expr;
+    }
+    return res;
+}
+
+Expr clone(const Expr& expr) {
+    // Types are never modified after syntax_check, so they can be shared
+    Expr res;
+    res.type = expr.type;
+    res.minus = expr.minus;
+
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        res.var = BinOperation{
+            .left_expr  = std::make_shared<Expr>(clone(*bin_op.left_expr)),
+            .right_expr = std::make_shared<Expr>(clone(*bin_op.right_expr)),
+            .op         = bin_op.op,
+        };
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        res.var = DerefArray{
+            .array_expr = std::make_shared<Expr>(clone(*deref_array.array_expr)),
+            .deref_expr = std::make_shared<Expr>(clone(*deref_array.deref_expr)),
+        };
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        res.var = DerefTuple{
+            .tuple_expr = std::make_shared<Expr>(clone(*deref_tuple.tuple_expr)),
+            .deref_expr = std::make_shared<Expr>(clone(*deref_tuple.deref_expr)),
+        };
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        const auto& fun_call = std::get<FunCall>(expr.var);
+        std::shared_ptr<std::vector<Expr>> fun_args;
+        if (fun_call.fun_args) {
+            fun_args = std::make_shared<std::vector<Expr>>();
+            for (const Expr& arg : *fun_call.fun_args) {
+                fun_args->push_back(clone(arg));
+            }
+        }
+        res.var = FunCall{
+            .fun      = std::make_shared<Expr>(clone(*fun_call.fun)),
+            .fun_args = fun_args,
+            .targets  = fun_call.targets,
+        };
+    } else if (std::holds_alternative<ID>(expr.var)) {
+        res.var = ID(std::get<ID>(expr.var));
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        res.var = clone(std::get<TypeExpr>(expr.var));
+    }
+    return res;
+}
+
+FunBody clone(const FunBody& fun_body);
+
+Flow clone(const Flow& flow) {
+    Flow res;
+    if (std::holds_alternative<Cond>(flow.var)) {
+        const Cond& cond = std::get<Cond>(flow.var);
+        Cond cond_res;
+        for (const IfCond& if_cond : cond.if_conds) {
+            cond_res.if_conds.push_back(IfCond{ .expr = clone(if_cond.expr), .body = clone(if_cond.body) });
+        }
+        if (cond.else_body) {
+            cond_res.else_body = clone(*cond.else_body);
+        }
+        res.var = cond_res;
+    } else if (std::holds_alternative<Loop>(flow.var)) {
+        const Loop& loop = std::get<Loop>(flow.var);
+        res.var = Loop{ .expr = clone(loop.expr), .body = clone(loop.body) };
+    } else {
+        const Flow::Control& control = std::get<Flow::Control>(flow.var);
+        std::optional<Expr> expr;
+        if (control.second) {
+            expr = clone(*control.second);
+        }
+        res.var = std::make_pair(control.first, expr);
+    }
+    return res;
+}
+
+FunBody clone(const FunBody& fun_body) {
+    FunBody res;
+    for (const FunBodyPart& part : fun_body.parts) {
+        FunBodyPart part_res;
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            VarDecl var_decl_res{ .type = var_decl.type, .ids = var_decl.ids, .expr = std::nullopt };
+            if (var_decl.expr) {
+                var_decl_res.expr = clone(*var_decl.expr);
+            }
+            part_res.var = std::move(var_decl_res);
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            const Assign& assign = std::get<Assign>(part.var);
+            part_res.var = Assign{ .assign_expr = clone(assign.assign_expr), .expr = clone(assign.expr) };
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            part_res.var = clone(std::get<Flow>(part.var));
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            part_res.var = clone(std::get<Expr>(part.var));
+        } else if (std::holds_alternative<Print>(part.var)) {
+            part_res.var = Print{ .expr = clone(std::get<Print>(part.var).expr) };
+        }
+        res.parts.push_back(part_res);
+    }
+    return res;
+}
+
+Expr make_id_expr(const ID& id, const std::shared_ptr<Type>& type) {
+    Expr res;
+    res.var = ID(id);
+    res.type = type;
+    return res;
+}
+
+std::string structural_key(const Expr& expr) {
+    // Unlike to_string, the key keeps the shape of the tree
+    std::string res = expr.minus ? "-(" : "(";
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        res += structural_key(*bin_op.left_expr) + " " + std::to_string(bin_op.op) + " " + structural_key(*bin_op.right_expr);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        res += structural_key(*deref_array.array_expr) + "[" + structural_key(*deref_array.deref_expr) + "]";
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        res += structural_key(*deref_tuple.tuple_expr) + "<" + structural_key(*deref_tuple.deref_expr) + ">";
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        const auto& fun_call = std::get<FunCall>(expr.var);
+        res += structural_key(*fun_call.fun) + "(";
+        if (fun_call.fun_args) {
+            for (const Expr& arg : *fun_call.fun_args) {
+                res += structural_key(arg) + ",";
+            }
+        }
+        res += ")";
+    } else if (std::holds_alternative<ID>(expr.var)) {
+        res += "$" + std::get<ID>(expr.var).name;
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+            const PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+            if (ptr_expr.ref_expr) {
+                res += "&" + structural_key(*ptr_expr.ref_expr);
+            } else {
+                res += "@" + structural_key(*ptr_expr.deref_expr);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+            res += "<";
+            for (const Expr& sub_expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+                res += structural_key(sub_expr) + ",";
+            }
+            res += ">";
+        } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+            res += "[";
+            for (const Expr& sub_expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+                res += structural_key(sub_expr) + ",";
+            }
+            res += "]";
+        } else {
+            res += std::to_string(type_expr.expr.index()) + ":" + type_expr.to_string();
+        }
+    }
+    return res + ")";
+}
+
+void walk(const Expr& expr, const std::function<void(const Expr&)>& fun) {
+    fun(expr);
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        walk(*bin_op.left_expr, fun);
+        walk(*bin_op.right_expr, fun);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        const auto& deref_array = std::get<DerefArray>(expr.var);
+        walk(*deref_array.array_expr, fun);
+        walk(*deref_array.deref_expr, fun);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        // The index is a compile-time constant, there is nothing to visit in it
+        walk(*std::get<DerefTuple>(expr.var).tuple_expr, fun);
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        const auto& fun_call = std::get<FunCall>(expr.var);
+        walk(*fun_call.fun, fun);
+        if (fun_call.fun_args) {
+            for (const Expr& arg : *fun_call.fun_args) {
+                walk(arg, fun);
+            }
+        }
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+            const PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+            if (ptr_expr.ref_expr) {
+                walk(*ptr_expr.ref_expr, fun);
+            }
+            if (ptr_expr.deref_expr) {
+                walk(*ptr_expr.deref_expr, fun);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+            for (const Expr& sub_expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+                walk(sub_expr, fun);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+            for (const Expr& sub_expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+                walk(sub_expr, fun);
+            }
+        }
+    }
+}
+
+void walk(const FunBody& fun_body, const std::function<void(const Expr&)>& fun) {
+    for (const FunBodyPart& part : fun_body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                walk(*var_decl.expr, fun);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            const Assign& assign = std::get<Assign>(part.var);
+            walk(assign.expr, fun);
+            walk(assign.assign_expr, fun);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            walk(std::get<Expr>(part.var), fun);
+        } else if (std::holds_alternative<Print>(part.var)) {
+            walk(std::get<Print>(part.var).expr, fun);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    walk(if_cond.expr, fun);
+                    walk(if_cond.body, fun);
+                }
+                if (cond.else_body) {
+                    walk(*cond.else_body, fun);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                const Loop& loop = std::get<Loop>(flow.var);
+                walk(loop.expr, fun);
+                walk(loop.body, fun);
+            } else {
+                const Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    walk(*control.second, fun);
+                }
+            }
+        }
+    }
+}
+
+std::vector<Expr*> collect_uses(FunBody& fun_body, const ID& id) {
+    std::vector<Expr*> uses;
+    walk(fun_body, [&](const Expr& expr) {
+        if (std::holds_alternative<ID>(expr.var) && std::get<ID>(expr.var) == id) {
+            // The walker only hands out const references, the tree itself is ours
+            uses.push_back(const_cast<Expr*>(&expr));
+        }
+    });
+    return uses;
+}
+
+bool is_pure(const Expr& expr) {
+    bool pure = true;
+    walk(expr, [&](const Expr& sub_expr) {
+        pure &= !std::holds_alternative<FunCall>(sub_expr.var);
+    });
+    return pure;
+}
+
+std::optional<ID> lvalue_root(const Expr& expr) {
+    if (std::holds_alternative<ID>(expr.var)) {
+        return std::get<ID>(expr.var);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        return lvalue_root(*std::get<DerefArray>(expr.var).array_expr);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        return lvalue_root(*std::get<DerefTuple>(expr.var).tuple_expr);
+    }
+    // Writes through pointers have no local root
+    return {};
+}
+
+void collect_address_taken(const FunBody& fun_body, std::unordered_set<ID>& ids) {
+    walk(fun_body, [&](const Expr& expr) {
+        if (!std::holds_alternative<TypeExpr>(expr.var)) {
+            return;
+        }
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr) && std::get<PtrExpr>(type_expr.expr).ref_expr) {
+            auto root = lvalue_root(*std::get<PtrExpr>(type_expr.expr).ref_expr);
+            if (root) {
+                ids.insert(*root);
+            }
+        }
+    });
+}
+
+void collect_assigned(const FunBody& fun_body, std::unordered_set<ID>& ids, bool& writes_memory) {
+    walk(fun_body, [&](const Expr& expr) {
+        writes_memory |= std::holds_alternative<FunCall>(expr.var);
+    });
+
+    for (const FunBodyPart& part : fun_body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.ids) {
+                ids.insert(var_decl.ids->begin(), var_decl.ids->end());
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            auto root = lvalue_root(std::get<Assign>(part.var).assign_expr);
+            if (root) {
+                ids.insert(*root);
+            } else {
+                writes_memory = true;
+            }
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    collect_assigned(if_cond.body, ids, writes_memory);
+                }
+                if (cond.else_body) {
+                    collect_assigned(*cond.else_body, ids, writes_memory);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                collect_assigned(std::get<Loop>(flow.var).body, ids, writes_memory);
+            }
+        }
+    }
+}
+
+void optimize(Program& program) {
+    std::unordered_set<ID> fun_ids;
+    for (const FunDecl& fun_decl : program.decls) {
+        fun_ids.insert(fun_decl.id);
+    }
+
+    devirtualization(program, fun_ids);
+    specialization(program, fun_ids);
+    for (FunDecl& fun_decl : program.decls) {
+        loop_unrolling(fun_decl);
+        scalar_replacement(fun_decl);
+        loop_invariant_code_motion(fun_decl);
+        common_subexpression_elimination(fun_decl, fun_ids);
+    }
+}
+
+}
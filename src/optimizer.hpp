@@ -0,0 +1,46 @@
+#pragma once
+
+#include <unordered_set>
+
+#include "syntax_tree.hpp"
+
+namespace foc {
+
+// Helpers shared by the optimization passes. All passes work on a type checked
+// program, so every expression has its `type` filled in by syntax_check.
+
+Expr clone(const Expr& expr);
+FunBody clone(const FunBody& fun_body);
+
+Expr make_id_expr(const ID& id, const std::shared_ptr<Type>& type);
+std::string structural_key(const Expr& expr);
+
+void walk(const Expr& expr, const std::function<void(const Expr&)>& fun);
+void walk(const FunBody& fun_body, const std::function<void(const Expr&)>& fun);
+
+std::vector<Expr*> collect_uses(FunBody& fun_body, const ID& id);
+
+bool is_pure(const Expr& expr);
+std::optional<ID> lvalue_root(const Expr& expr);
+
+Expr make_int_expr(int64_t value);
+// Number of statements in `body`, nested ones included
+int64_t body_size(const FunBody& body);
+
+// Step of `id = id + s` or `id = id - s` with a constant `s`
+std::optional<int64_t> constant_step(const FunBodyPart& part, const ID& id);
+
+void collect_address_taken(const FunBody& fun_body, std::unordered_set<ID>& ids);
+void collect_assigned(const FunBody& fun_body, std::unordered_set<ID>& ids, bool& writes_memory);
+
+// Passes
+void loop_unrolling(FunDecl& fun_decl);
+void scalar_replacement(FunDecl& fun_decl);
+void loop_invariant_code_motion(FunDecl& fun_decl);
+void common_subexpression_elimination(FunDecl& fun_decl, const std::unordered_set<ID>& fun_ids);
+void devirtualization(Program& program, const std::unordered_set<ID>& fun_ids);
+void specialization(Program& program, std::unordered_set<ID>& fun_ids);
+
+void optimize(Program& program);
+
+}
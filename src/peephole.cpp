@@ -0,0 +1,646 @@
+#include <cctype>
+#include <functional>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "peephole.hpp"
+
+namespace foc {
+
+//*********************************************
+// Peephole optimization:
+//     The code of a function is parsed into a list of instructions and a
+//     table of rules is applied until none of them matches anymore. Rules
+//     only look at neighbouring instructions, never across a label.
+//
+//     Macros are understood as far as the rules need it: push_ and pop_ by
+//     their expansion, the others by the registers they read and write (this
+//     has to follow asm_macros). A register is dead when it's written before
+//     being read. Labels, jumps and unknown macros end the search with the
+//     register being live.
+//
+//     Flags are only ever read by the jumps or cmov right after a comparison,
+//     so they are dead at any label or jump.
+//
+//     Memory below rsp is free, so a value pushed and popped right away
+//     doesn't have to be stored at all.
+//
+
+const std::string flags = "flags";
+
+const std::unordered_set<std::string> registers = {
+    "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rsp", "rbp",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// Low bytes of the registers, reading one reads the register and writing one
+// keeps the rest of it, so it's a read as well
+const std::unordered_map<std::string, std::string> byte_registers = {
+    { "al", "rax" }, { "bl", "rbx" }, { "cl", "rcx" }, { "dl", "rdx" }, { "sil", "rsi" }, { "dil", "rdi" },
+    { "r8b", "r8" }, { "r9b", "r9" }, { "r10b", "r10" }, { "r11b", "r11" },
+    { "r12b", "r12" }, { "r13b", "r13" }, { "r14b", "r14" }, { "r15b", "r15" },
+};
+
+// Registers read and written by the macros of asm_macros, a register both
+// read and written is only listed as read
+const std::unordered_map<std::string, std::pair<std::vector<std::string>, std::vector<std::string>>> macro_effects = {
+    { "add_op",      { { "rsp" },                      { "rax", "rbx", flags } } },
+    { "sub_op",      { { "rsp" },                      { "rax", "rbx", flags } } },
+    { "mul_op",      { { "rsp" },                      { "rax", flags } } },
+    { "div_op",      { { "rsp" },                      { "rax", "rbx", "rdx", flags } } },
+    { "equal",       { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "not_equal",   { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "less",        { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "greater",     { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "leq",         { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "geq",         { { "rsp" },                      { "rax", "rbx", "rcx", "rdx", flags } } },
+    { "and_op",      { { "rsp" },                      { "rbx", flags } } },
+    { "or_op",       { { "rsp" },                      { "rbx", flags } } },
+    { "print",       { { "rsp" },                      { "rax", "rcx", "rdx", "rsi", "rdi", "r11", flags } } },
+};
+
+std::string trim(const std::string& str) {
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
+std::string Instruction::to_string() const {
+    if (kind == LABEL) {
+        return (name[0] == '.' ? "  " : "") + name + ":";
+    }
+    std::string res = "    " + name;
+    for (size_t i = 0; i < operands.size(); ++i) {
+        res += (i == 0 ? " " : ", ") + operands[i];
+    }
+    if (!comment.empty()) {
+        res += " ; " + comment;
+    }
+    return res;
+}
+
+std::vector<Instruction> parse_asm(const std::string& text) {
+    std::vector<Instruction> res;
+    std::vector<std::string> notes;
+
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string code = line;
+        std::string comment;
+        size_t semicolon = line.find(';');
+        if (semicolon != std::string::npos) {
+            code = line.substr(0, semicolon);
+            comment = trim(line.substr(semicolon + 1));
+        }
+        code = trim(code);
+        if (code.empty()) {
+            notes.push_back(trim(line));
+            continue;
+        }
+
+        Instruction instruction;
+        if (code.back() == ':') {
+            instruction.kind = Instruction::LABEL;
+            instruction.name = code.substr(0, code.size() - 1);
+        } else {
+            size_t space = code.find_first_of(" \t");
+            instruction.name = code.substr(0, space);
+            if (space != std::string::npos) {
+                std::istringstream operands(code.substr(space));
+                std::string operand;
+                while (std::getline(operands, operand, ',')) {
+                    instruction.operands.push_back(trim(operand));
+                }
+            }
+        }
+        instruction.notes = std::move(notes);
+        instruction.comment = comment;
+        notes.clear();
+        res.push_back(instruction);
+    }
+    return res;
+}
+
+std::string to_string(const std::vector<Instruction>& code) {
+    std::string res;
+    for (const Instruction& instruction : code) {
+        for (const std::string& note : instruction.notes) {
+            res += note.empty() ? "\n" : "    " + note + "\n";
+        }
+        res += instruction.to_string() + "\n";
+    }
+    return res + "\n";
+}
+
+bool is_register(const std::string& operand) {
+    return registers.count(operand);
+}
+
+bool is_memory(const std::string& operand) {
+    return operand.find('[') != std::string::npos;
+}
+
+bool is_jump(const Instruction& instruction) {
+    return instruction.kind == Instruction::OP && instruction.name[0] == 'j' && instruction.operands.size() == 1;
+}
+
+// Address of a memory operand without the size, i.e. `[rsp + 8]`
+std::string address(const std::string& operand) {
+    return operand.substr(operand.find('['));
+}
+
+std::vector<std::string> registers_in(const std::string& operand) {
+    std::vector<std::string> res;
+    std::string token;
+    for (char c : operand + " ") {
+        if (std::isalnum(c)) {
+            token += c;
+            continue;
+        }
+        if (is_register(token)) {
+            res.push_back(token);
+        } else if (byte_registers.count(token)) {
+            res.push_back(byte_registers.at(token));
+        }
+        token.clear();
+    }
+    return res;
+}
+
+struct Effects {
+    bool barrier = false;
+    std::unordered_set<std::string> reads;
+    std::unordered_set<std::string> writes;
+};
+
+Effects effects(const Instruction& instruction) {
+    static const std::unordered_set<std::string> arithmetic = { "add", "sub", "and", "or", "xor", "shl", "shr", "sar" };
+
+    Effects res;
+    auto read = [&](const std::string& operand) {
+        for (const std::string& reg : registers_in(operand)) {
+            res.reads.insert(reg);
+        }
+    };
+    auto write = [&](const std::string& operand) {
+        if (is_register(operand)) {
+            res.writes.insert(operand);
+        } else {
+            read(operand);
+        }
+    };
+
+    const std::string& name = instruction.name;
+    const std::vector<std::string>& ops = instruction.operands;
+    if (instruction.kind == Instruction::LABEL) {
+        res.barrier = true;
+    } else if ((name == "mov" || name == "lea" || name == "movzx") && ops.size() == 2) {
+        read(ops[1]);
+        write(ops[0]);
+    } else if (name == "imul" && ops.size() == 3) {
+        read(ops[1]);
+        write(ops[0]);
+        res.writes.insert(flags);
+    } else if ((arithmetic.count(name) || name == "imul" || name == "cmp" || name == "test") && ops.size() == 2) {
+        read(ops[0]);
+        read(ops[1]);
+        res.writes.insert(flags);
+    } else if ((name == "imul" || name == "idiv") && ops.size() == 1) {
+        // rdx:rax = rax * op, rax, rdx = rdx:rax / op
+        read(ops[0]);
+        res.reads.insert("rax");
+        res.writes.insert(flags);
+        if (name == "idiv") {
+            res.reads.insert("rdx");
+        } else {
+            res.writes.insert("rdx");
+        }
+    } else if (name == "cqo") {
+        res.reads.insert("rax");
+        res.writes.insert("rdx");
+    } else if ((name == "neg" || name == "inc" || name == "dec") && ops.size() == 1) {
+        read(ops[0]);
+        res.writes.insert(flags);
+    } else if (name.rfind("cmov", 0) == 0 && ops.size() == 2) {
+        read(ops[0]);
+        read(ops[1]);
+        res.reads.insert(flags);
+    } else if (name == "push_" && ops.size() == 1) {
+        read(ops[0]);
+        res.reads.insert("rsp");
+        res.writes.insert(flags);
+    } else if (name == "pop_" && ops.size() == 1) {
+        res.reads.insert("rsp");
+        write(ops[0]);
+        res.writes.insert(flags);
+    } else if (name == "rep" && ops.size() == 1 && ops[0] == "movsq") {
+        res.reads.insert({ "rcx", "rsi", "rdi" });
+    } else if (name == "std" || name == "cld") {
+    } else if (macro_effects.count(name)) {
+        const auto& [reads, writes] = macro_effects.at(name);
+        res.reads.insert(reads.begin(), reads.end());
+        res.writes.insert(writes.begin(), writes.end());
+    } else {
+        if (is_jump(instruction) && name != "jmp") {
+            res.reads.insert(flags);
+        }
+        res.barrier = true;
+    }
+    return res;
+}
+
+bool is_dead(const std::vector<Instruction>& code, size_t from, const std::string& reg) {
+    for (size_t i = from; i < code.size(); ++i) {
+        Effects instruction_effects = effects(code[i]);
+        if (instruction_effects.reads.count(reg)) {
+            return false;
+        }
+        if (instruction_effects.writes.count(reg)) {
+            return true;
+        }
+        if (instruction_effects.barrier) {
+            return reg == flags;
+        }
+    }
+    return reg == flags;
+}
+
+bool is_op(const std::vector<Instruction>& code, size_t idx, const std::string& name, size_t operands) {
+    return idx < code.size() && code[idx].kind == Instruction::OP
+        && code[idx].name == name && code[idx].operands.size() == operands;
+}
+
+Instruction make_op(const std::string& name, const std::vector<std::string>& operands) {
+    return Instruction{ .kind = Instruction::OP, .name = name, .operands = operands };
+}
+
+// Replaces `count` instructions at `idx`, their notes stay in place
+void replace(std::vector<Instruction>& code, size_t idx, size_t count, std::vector<Instruction> replacement) {
+    std::vector<std::string> notes;
+    for (size_t i = idx; i < idx + count; ++i) {
+        notes.insert(notes.end(), code[i].notes.begin(), code[i].notes.end());
+    }
+    code.erase(code.begin() + idx, code.begin() + idx + count);
+    code.insert(code.begin() + idx, replacement.begin(), replacement.end());
+    if (idx < code.size()) {
+        code[idx].notes.insert(code[idx].notes.begin(), notes.begin(), notes.end());
+    }
+}
+
+std::optional<int64_t> immediate(const std::string& operand) {
+    if (operand.empty() || operand.find_first_not_of("-0123456789") != std::string::npos) {
+        return {};
+    }
+    return std::stoll(operand);
+}
+
+// push_ x; pop_ y  ->  mov y, x
+bool push_pop(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "push_", 1) || !is_op(code, idx + 1, "pop_", 1)) {
+        return false;
+    }
+    std::string src = code[idx].operands[0];
+    std::string dst = code[idx + 1].operands[0];
+    if (is_memory(src) || !is_register(dst) || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    if (src == dst) {
+        replace(code, idx, 2, {});
+    } else {
+        replace(code, idx, 2, { make_op("mov", { dst, src }) });
+    }
+    return true;
+}
+
+// pop_ x; push_ x  ->  mov x, [rsp + 8]
+bool pop_push(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "pop_", 1) || !is_op(code, idx + 1, "push_", 1)) {
+        return false;
+    }
+    std::string reg = code[idx].operands[0];
+    if (!is_register(reg) || reg != code[idx + 1].operands[0] || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    replace(code, idx, 2, { make_op("mov", { reg, "qword [rsp + 8]" }) });
+    return true;
+}
+
+// add rsp, 8; push_ x  ->  mov [rsp + 8], x
+bool release_push(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "add", 2) || code[idx].operands[0] != "rsp" || code[idx].operands[1] != "8"
+        || !is_op(code, idx + 1, "push_", 1)) {
+        return false;
+    }
+    std::string src = code[idx + 1].operands[0];
+    if (is_memory(src) || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    replace(code, idx, 2, { make_op("mov", { "qword [rsp + 8]", src }) });
+    return true;
+}
+
+// push_ x; add rsp, n  ->  add rsp, n - 8, the value is freed right away
+bool push_release(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "push_", 1) || !is_op(code, idx + 1, "add", 2) || code[idx + 1].operands[0] != "rsp") {
+        return false;
+    }
+    auto released = immediate(code[idx + 1].operands[1]);
+    if (!released || *released < 8 || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    if (*released == 8) {
+        replace(code, idx, 2, {});
+    } else {
+        replace(code, idx, 2, { make_op("add", { "rsp", std::to_string(*released - 8) }) });
+    }
+    return true;
+}
+
+// mov rsp, r; push_ x  ->  mov [r], x; lea rsp, [r - 8]
+bool set_rsp_push(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "mov", 2) || code[idx].operands[0] != "rsp" || !is_op(code, idx + 1, "push_", 1)) {
+        return false;
+    }
+    std::string base = code[idx].operands[1];
+    std::string src = code[idx + 1].operands[0];
+    if (!is_register(base) || is_memory(src) || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    replace(code, idx, 2, {
+        make_op("mov", { "qword [" + base + "]", src }),
+        make_op("lea", { "rsp", "[" + base + " - 8]" }),
+    });
+    return true;
+}
+
+// Store followed by a load of the same qword reads the stored value instead
+bool store_load(std::vector<Instruction>& code, size_t idx) {
+    if (idx + 1 >= code.size() || code[idx].kind != Instruction::OP || code[idx + 1].kind != Instruction::OP) {
+        return false;
+    }
+    std::string stored;
+    std::string value;
+    if (is_op(code, idx, "push_", 1)) {
+        stored = "[rsp + 8]";
+        value = code[idx].operands[0];
+    } else if (is_op(code, idx, "mov", 2) && is_memory(code[idx].operands[0])) {
+        const std::string& dst = code[idx].operands[0];
+        bool qword = is_register(code[idx].operands[1]) || dst.rfind("qword", 0) == 0;
+        if (!qword) {
+            return false;
+        }
+        stored = address(dst);
+        value = code[idx].operands[1];
+    } else {
+        return false;
+    }
+    if (is_memory(value) || (!is_register(value) && !immediate(value))) {
+        return false;
+    }
+
+    Instruction& load = code[idx + 1];
+    if (load.name == "mov" && load.operands.size() == 2 && is_register(load.operands[0])
+        && is_memory(load.operands[1]) && address(load.operands[1]) == stored) {
+        if (load.operands[0] == value) {
+            replace(code, idx + 1, 1, {});
+        } else {
+            load.operands[1] = value;
+            load.comment.clear();
+        }
+        return true;
+    }
+    if (load.name == "cmp" && load.operands.size() == 2 && is_register(value)
+        && is_memory(load.operands[0]) && address(load.operands[0]) == stored && immediate(load.operands[1])) {
+        load.operands[0] = value;
+        load.comment.clear();
+        return true;
+    }
+    return false;
+}
+
+// pop_ r; neg r; push_ r  ->  neg [rsp + 8]
+bool negate_in_place(std::vector<Instruction>& code, size_t idx) {
+    if (!is_op(code, idx, "pop_", 1) || !is_op(code, idx + 2, "push_", 1)) {
+        return false;
+    }
+    std::string reg = code[idx].operands[0];
+    if (!is_register(reg) || code[idx + 2].operands[0] != reg) {
+        return false;
+    }
+    Instruction operation = code[idx + 1];
+    bool negation = is_op(code, idx + 1, "neg", 1) && operation.operands[0] == reg;
+    bool flip = is_op(code, idx + 1, "xor", 2) && operation.operands[0] == reg && operation.operands[1] == "1";
+    if (!negation && !flip) {
+        return false;
+    }
+    operation.operands[0] = "qword [rsp + 8]";
+    std::vector<Instruction> replacement = { operation };
+    if (!is_dead(code, idx + 3, reg)) {
+        replacement.push_back(make_op("mov", { reg, "qword [rsp + 8]" }));
+    }
+    replace(code, idx, 3, replacement);
+    return true;
+}
+
+// Consecutive add / sub of rsp become one
+bool rsp_fold(std::vector<Instruction>& code, size_t idx) {
+    auto rsp_change = [&](size_t i) -> std::optional<int64_t> {
+        if (i >= code.size() || code[i].kind != Instruction::OP || code[i].operands.size() != 2
+            || code[i].operands[0] != "rsp" || (code[i].name != "add" && code[i].name != "sub")) {
+            return {};
+        }
+        auto value = immediate(code[i].operands[1]);
+        if (!value) {
+            return {};
+        }
+        return code[i].name == "add" ? *value : -*value;
+    };
+    auto first = rsp_change(idx);
+    auto second = rsp_change(idx + 1);
+    if (!first || !second || !is_dead(code, idx + 2, flags)) {
+        return false;
+    }
+    int64_t change = *first + *second;
+    if (change == 0) {
+        replace(code, idx, 2, {});
+    } else if (change > 0) {
+        replace(code, idx, 2, { make_op("add", { "rsp", std::to_string(change) }) });
+    } else {
+        replace(code, idx, 2, { make_op("sub", { "rsp", std::to_string(-change) }) });
+    }
+    return true;
+}
+
+// Writes of registers nobody reads afterwards
+bool dead_write(std::vector<Instruction>& code, size_t idx) {
+    static const std::unordered_set<std::string> removable = { "mov", "lea", "add", "sub", "imul", "and", "or", "xor" };
+
+    const Instruction& instruction = code[idx];
+    // The one operand imul writes rdx:rax, not its operand
+    if (instruction.kind != Instruction::OP || !removable.count(instruction.name) || instruction.operands.size() < 2) {
+        return false;
+    }
+    const std::string& dst = instruction.operands[0];
+    if (!is_register(dst) || dst == "rsp" || dst == "rbp") {
+        return false;
+    }
+    bool sets_flags = instruction.name != "mov" && instruction.name != "lea";
+    if (!is_dead(code, idx + 1, dst) || (sets_flags && !is_dead(code, idx + 1, flags))) {
+        return false;
+    }
+    replace(code, idx, 1, {});
+    return true;
+}
+
+std::optional<size_t> find_label(const std::vector<Instruction>& code, const std::string& label) {
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].kind == Instruction::LABEL && code[i].name == label) {
+            return i;
+        }
+    }
+    return {};
+}
+
+// A jump to a label followed by `jmp l` goes to l directly
+bool jump_thread(std::vector<Instruction>& code, size_t idx) {
+    if (!is_jump(code[idx])) {
+        return false;
+    }
+    std::string target = code[idx].operands[0];
+    std::unordered_set<std::string> visited = { target };
+    while (true) {
+        auto label = find_label(code, target);
+        if (!label) {
+            break;
+        }
+        size_t next = *label;
+        while (next < code.size() && code[next].kind == Instruction::LABEL) {
+            ++next;
+        }
+        // Indirect jumps, e.g. through a jump table, have no single target
+        if (!is_op(code, next, "jmp", 1) || is_memory(code[next].operands[0])) {
+            break;
+        }
+        if (visited.count(code[next].operands[0])) {
+            // Endless loop, leave it be
+            return false;
+        }
+        target = code[next].operands[0];
+        visited.insert(target);
+    }
+    if (target == code[idx].operands[0]) {
+        return false;
+    }
+    code[idx].operands[0] = target;
+    return true;
+}
+
+// Jump to the label right behind it
+bool jump_next(std::vector<Instruction>& code, size_t idx) {
+    if (!is_jump(code[idx])) {
+        return false;
+    }
+    for (size_t i = idx + 1; i < code.size() && code[i].kind == Instruction::LABEL; ++i) {
+        if (code[i].name == code[idx].operands[0]) {
+            replace(code, idx, 1, {});
+            return true;
+        }
+    }
+    return false;
+}
+
+// A conditional jump over a jump, `jcc l; jmp m; l:`, becomes `jncc m`
+bool invert_branch(std::vector<Instruction>& code, size_t idx) {
+    static const std::unordered_map<std::string, std::string> negated = {
+        { "je", "jne" }, { "jne", "je" }, { "jl", "jge" }, { "jge", "jl" }, { "jg", "jle" }, { "jle", "jg" },
+        { "jb", "jae" }, { "jae", "jb" }, { "ja", "jbe" }, { "jbe", "ja" },
+    };
+    auto negated_it = negated.find(code[idx].name);
+    if (!is_jump(code[idx]) || negated_it == negated.end() || !is_op(code, idx + 1, "jmp", 1)
+        || is_memory(code[idx + 1].operands[0])) {
+        return false;
+    }
+    for (size_t i = idx + 2; i < code.size() && code[i].kind == Instruction::LABEL; ++i) {
+        if (code[i].name == code[idx].operands[0]) {
+            replace(code, idx, 2, { make_op(negated_it->second, code[idx + 1].operands) });
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether `operand` is `label` or an address using it, e.g. of a jump table
+bool refers_to(const std::string& operand, const std::string& label) {
+    for (size_t pos = operand.find(label); pos != std::string::npos; pos = operand.find(label, pos + 1)) {
+        size_t end = pos + label.size();
+        if (end == operand.size() || (!std::isalnum(operand[end]) && operand[end] != '_')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Local labels nothing jumps to
+bool unused_label(std::vector<Instruction>& code, size_t idx) {
+    if (code[idx].kind != Instruction::LABEL || code[idx].name[0] != '.') {
+        return false;
+    }
+    for (const Instruction& instruction : code) {
+        for (const std::string& operand : instruction.operands) {
+            if (refers_to(operand, code[idx].name)) {
+                return false;
+            }
+        }
+    }
+    replace(code, idx, 1, {});
+    return true;
+}
+
+struct PeepholeRule {
+    std::string name;
+    std::function<bool(std::vector<Instruction>&, size_t)> apply;
+};
+
+const std::vector<PeepholeRule> peephole_rules = {
+    { "push-pop",        push_pop },
+    { "pop-push",        pop_push },
+    { "release-push",    release_push },
+    { "push-release",    push_release },
+    { "set-rsp-push",    set_rsp_push },
+    { "store-load",      store_load },
+    { "negate-in-place", negate_in_place },
+    { "rsp-fold",        rsp_fold },
+    { "dead-write",      dead_write },
+    { "jump-thread",     jump_thread },
+    { "jump-next",       jump_next },
+    { "invert-branch",   invert_branch },
+    { "unused-label",    unused_label },
+};
+
+void peephole(std::vector<Instruction>& code, PeepholeStats& stats) {
+    size_t idx = 0;
+    while (idx < code.size()) {
+        bool applied = false;
+        for (const PeepholeRule& rule : peephole_rules) {
+            if (rule.apply(code, idx)) {
+                ++stats[rule.name];
+                applied = true;
+                break;
+            }
+        }
+        // A rewrite may complete a pattern starting a bit earlier
+        if (applied) {
+            idx = idx > 2 ? idx - 2 : 0;
+        } else {
+            ++idx;
+        }
+    }
+}
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace foc {
+
+// One line of generated assembly, either a label or an instruction / macro call
+struct Instruction {
+    enum Kind {
+        LABEL,
+        OP,
+    };
+
+    Kind kind = OP;
+    std::string name = {};
+    std::vector<std::string> operands = {};
+
+    // Comment and empty lines in front of the line, kept for readability
+    std::vector<std::string> notes = {};
+    std::string comment = {};
+
+    std::string to_string() const;
+};
+
+using PeepholeStats = std::map<std::string, int64_t>;
+
+std::vector<Instruction> parse_asm(const std::string& text);
+std::string to_string(const std::vector<Instruction>& code);
+
+void peephole(std::vector<Instruction>& code, PeepholeStats& stats);
+
+}
@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <deque>
+
+#include "code_generator.hpp"
+#include "optimizer.hpp"
+
+namespace foc {
+
+//*********************************************
+// Linear scan register allocation:
+//     Statements are numbered in the order the code generator emits them.
+//     Every candidate gets a live interval from its declaration to its last
+//     use. A value that is live when a loop starts and used inside it has to
+//     survive the back edge, so its interval is extended to the end of the
+//     loop.
+//
+//     Candidates are scalar (8 byte) arguments and single-id declarations
+//     whose address is never taken, and the hidden induction pointers.
+//
+//     Intervals are scanned by their start. A free register is taken when
+//     there is one, otherwise the interval ending last is spilled, i.e. stays
+//     in its frame slot for its whole lifetime.
+//
+//     Only r12 - r15 are handed out. No macro touches them, so they survive
+//     every expression, and they are callee saved, so they survive calls.
+//     rax - rdx, rsi, rdi and r8 - r10 belong to the macros and r11 to
+//     syscall.
+//
+//     Scopes are followed exactly as the code generator does, i.e. every
+//     body opens a scope.
+//
+//*********************************************
+// Frame slots:
+//     Declarations that stay in memory get a fixed slot in the frame. The
+//     same live intervals decide which of them can share one, a slot is
+//     reused by the next declaration that starts after its owner ended and
+//     fits in it. Intervals of declarations whose address is taken last until
+//     the end of their scope, as the pointer may be used anywhere in it.
+//     Without optimizations every interval lasts until the end of its scope,
+//     so only declarations of sibling scopes share.
+//
+//     An initializer is used at the position of its declaration, so a value
+//     dying in it never shares its slot with the declared one. The value may
+//     still be read while it's being stored, e.g. by a call returning into
+//     the slot.
+//
+
+struct Candidate {
+    int64_t start = 0;
+    int64_t end = 0;
+    std::optional<std::string> reg = std::nullopt;
+
+    const VarDecl* decl = nullptr;
+    std::optional<ID> arg = std::nullopt;
+    Symbol* induction = nullptr;
+
+    // Declarations that can only live in the frame
+    bool memory = false;
+    int64_t size = 8;
+};
+
+struct LivenessScope {
+    std::unordered_map<ID, Candidate*> ids;
+    // Candidates living until the end of the scope
+    std::vector<Candidate*> pinned;
+};
+
+class LivenessContext {
+public:
+    LivenessContext(const FunDecl& fun_decl, std::unordered_map<const Loop*, InductionLoop>& induction_loops,
+                    const std::unordered_set<ID>& address_taken, bool lexical = false, bool packed = false)
+        : fun_decl(fun_decl), induction_loops(induction_loops), address_taken(address_taken), lexical(lexical),
+          packed(packed) {}
+
+    RegisterAllocation run();
+    FrameLayout run_frame(const RegisterAllocation& allocation);
+
+private:
+    bool is_scalar(const Type& type) const;
+    void declare(const ID& id, Candidate* candidate);
+    void visit_scope(const FunBody& body);
+    void close_scope();
+    void collect();
+    void use(const Expr& expr);
+    void visit(const FunBody& body);
+    void linear_scan();
+
+    const FunDecl& fun_decl;
+    std::unordered_map<const Loop*, InductionLoop>& induction_loops;
+    const std::unordered_set<ID>& address_taken;
+    bool lexical;
+    bool packed;
+
+    int64_t position = 0;
+    std::deque<Candidate> candidates;
+    std::vector<LivenessScope> scopes;
+    std::vector<std::pair<int64_t, std::vector<Candidate*>>> loop_uses;
+};
+
+bool LivenessContext::is_scalar(const Type& type) const {
+    return !std::holds_alternative<Type::Tuple>(type.var)
+        && !std::holds_alternative<Type::Array>(type.var)
+        && type.byte_size() == 8;
+}
+
+void LivenessContext::declare(const ID& id, Candidate* candidate) {
+    scopes.back().ids[id] = candidate;
+}
+
+void LivenessContext::visit_scope(const FunBody& body) {
+    scopes.emplace_back();
+    visit(body);
+    close_scope();
+}
+
+void LivenessContext::close_scope() {
+    for (Candidate* candidate : scopes.back().pinned) {
+        candidate->end = std::max(candidate->end, position);
+    }
+    scopes.pop_back();
+}
+
+void LivenessContext::use(const Expr& expr) {
+    walk(expr, [&](const Expr& sub_expr) {
+        if (!std::holds_alternative<ID>(sub_expr.var)) {
+            return;
+        }
+        const ID& id = std::get<ID>(sub_expr.var);
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->ids.find(id);
+            if (found == it->ids.end()) {
+                continue;
+            }
+            if (found->second) {
+                found->second->end = std::max(found->second->end, position);
+                for (auto& [loop_start, used] : loop_uses) {
+                    used.push_back(found->second);
+                }
+            }
+            break;
+        }
+    });
+}
+
+void LivenessContext::visit(const FunBody& body) {
+    for (const FunBodyPart& part : body.parts) {
+        ++position;
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                use(*var_decl.expr);
+            }
+            if (!var_decl.ids) {
+                continue;
+            }
+            const std::vector<ID>& ids = *var_decl.ids;
+            bool pointed_to = std::any_of(ids.begin(), ids.end(), [&](const ID& id) {
+                return address_taken.count(id) > 0;
+            });
+            candidates.push_back(Candidate{
+                .start  = position,
+                .end    = position,
+                .decl   = &var_decl,
+                .memory = pointed_to || ids.size() != 1 || !is_scalar(*var_decl.type),
+                .size   = stored_type(var_decl, packed).byte_size(packed),
+            });
+            if (pointed_to || lexical) {
+                scopes.back().pinned.push_back(&candidates.back());
+            }
+            for (const ID& id : ids) {
+                declare(id, &candidates.back());
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            const Assign& assign = std::get<Assign>(part.var);
+            use(assign.expr);
+            use(assign.assign_expr);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            use(std::get<Expr>(part.var));
+        } else if (std::holds_alternative<Print>(part.var)) {
+            use(std::get<Print>(part.var).expr);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    ++position;
+                    use(if_cond.expr);
+                    visit_scope(if_cond.body);
+                }
+                if (cond.else_body) {
+                    visit_scope(*cond.else_body);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                const Loop& loop = std::get<Loop>(flow.var);
+                int64_t loop_start = position;
+                loop_uses.emplace_back(loop_start, std::vector<Candidate*>{});
+                use(loop.expr);
+
+                auto induction_it = induction_loops.find(&loop);
+                size_t first_induction = candidates.size();
+                size_t induction_count = 0;
+                if (induction_it != induction_loops.end()) {
+                    InductionLoop& induction = induction_it->second;
+                    for (InductionPointer& pointer : induction.pointers) {
+                        candidates.push_back(Candidate{ .start = position, .end = position, .induction = &pointer.location });
+                        ++induction_count;
+                    }
+                    if (induction.exit_op) {
+                        use(*induction.bound);
+                        candidates.push_back(Candidate{ .start = position, .end = position, .induction = &induction.end });
+                        ++induction_count;
+                    }
+                }
+
+                visit_scope(loop.body);
+                for (size_t i = first_induction; i < first_induction + induction_count; ++i) {
+                    candidates[i].end = position;
+                }
+
+                // Whatever is used in the loop and lives before it has to survive the back edge
+                for (Candidate* candidate : loop_uses.back().second) {
+                    if (candidate->start < loop_start) {
+                        candidate->end = std::max(candidate->end, position);
+                    }
+                }
+                loop_uses.pop_back();
+            } else {
+                const Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    use(*control.second);
+                }
+            }
+        }
+    }
+}
+
+void LivenessContext::linear_scan() {
+    std::vector<Candidate*> intervals;
+    for (Candidate& candidate : candidates) {
+        if (!candidate.memory) {
+            intervals.push_back(&candidate);
+        }
+    }
+    std::stable_sort(intervals.begin(), intervals.end(), [](const Candidate* a, const Candidate* b) {
+        return a->start < b->start;
+    });
+
+    std::vector<std::string> free_registers(allocatable_registers.rbegin(), allocatable_registers.rend());
+    std::vector<Candidate*> active;
+    for (Candidate* current : intervals) {
+        // Expire intervals that ended before this one starts
+        for (auto it = active.begin(); it != active.end();) {
+            if ((*it)->end < current->start) {
+                free_registers.push_back(*(*it)->reg);
+                it = active.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (!free_registers.empty()) {
+            current->reg = free_registers.back();
+            free_registers.pop_back();
+            active.push_back(current);
+            continue;
+        }
+
+        auto furthest = std::max_element(active.begin(), active.end(), [](const Candidate* a, const Candidate* b) {
+            return a->end < b->end;
+        });
+        if ((*furthest)->end > current->end) {
+            current->reg = (*furthest)->reg;
+            (*furthest)->reg.reset();
+            *furthest = current;
+        }
+    }
+}
+
+void LivenessContext::collect() {
+    scopes.emplace_back();
+    for (const FunArg& arg : fun_decl.args) {
+        if (is_scalar(arg.type) && !address_taken.count(arg.id)) {
+            candidates.push_back(Candidate{ .start = 0, .end = 0, .arg = arg.id });
+            declare(arg.id, &candidates.back());
+        } else {
+            declare(arg.id, nullptr);
+        }
+    }
+    visit(fun_decl.body);
+    close_scope();
+}
+
+RegisterAllocation LivenessContext::run() {
+    collect();
+    linear_scan();
+
+    RegisterAllocation res;
+    for (const Candidate& candidate : candidates) {
+        if (!candidate.reg) {
+            continue;
+        }
+        if (candidate.decl) {
+            res.decls[candidate.decl] = *candidate.reg;
+        } else if (candidate.arg) {
+            res.args.emplace_back(*candidate.arg, *candidate.reg);
+        } else {
+            candidate.induction->reg = candidate.reg;
+        }
+        if (std::find(res.used.begin(), res.used.end(), *candidate.reg) == res.used.end()) {
+            res.used.push_back(*candidate.reg);
+        }
+    }
+    std::sort(res.used.begin(), res.used.end());
+    return res;
+}
+
+FrameLayout LivenessContext::run_frame(const RegisterAllocation& allocation) {
+    collect();
+
+    std::vector<Candidate*> intervals;
+    for (Candidate& candidate : candidates) {
+        if (candidate.decl && !allocation.decls.count(candidate.decl)) {
+            intervals.push_back(&candidate);
+        }
+    }
+    std::stable_sort(intervals.begin(), intervals.end(), [](const Candidate* a, const Candidate* b) {
+        return a->start < b->start;
+    });
+
+    struct Slot {
+        int64_t offset = 0;
+        int64_t size = 0;
+        const Candidate* owner = nullptr;
+    };
+    std::vector<Slot> slots;
+    FrameLayout res;
+    for (Candidate* current : intervals) {
+        res.unshared_size += current->size;
+
+        // The smallest free slot the declaration fits in
+        Slot* best = nullptr;
+        for (Slot& slot : slots) {
+            if (slot.owner->end < current->start && slot.size >= current->size && (!best || slot.size < best->size)) {
+                best = &slot;
+            }
+        }
+        if (!best) {
+            slots.push_back(Slot{ .offset = res.size, .size = current->size });
+            res.size += current->size;
+            best = &slots.back();
+        }
+        best->owner = current;
+        res.slots[current->decl] = best->offset;
+    }
+    return res;
+}
+
+RegisterAllocation allocate_registers(const FunDecl& fun_decl,
+                                      std::unordered_map<const Loop*, InductionLoop>& induction_loops,
+                                      const std::unordered_set<ID>& address_taken) {
+    return LivenessContext(fun_decl, induction_loops, address_taken).run();
+}
+
+FrameLayout allocate_frame(const FunDecl& fun_decl, const RegisterAllocation& allocation,
+                           const std::unordered_set<ID>& address_taken, const CodeGenOptions& options) {
+    std::unordered_map<const Loop*, InductionLoop> no_induction_loops;
+    return LivenessContext(fun_decl, no_induction_loops, address_taken, !options.optimize, options.packed)
+        .run_frame(allocation);
+}
+
+}
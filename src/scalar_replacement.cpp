@@ -0,0 +1,435 @@
+#include "optimizer.hpp"
+#include "syntax_check.hpp"
+
+namespace foc {
+
+//*********************************************
+// Scalar replacement of aggregates:
+//     A local tuple or array `x` is split into independent locals `x$0`,
+//     `x$1`, ... when every use of it can be resolved at compile time:
+//         x<k>, x[c]          -> x$k, x$c
+//         x = <e0, e1>        -> x$0 = e0; x$1 = e1;
+//         reading whole x     -> <x$0, x$1>
+//     Taking the address of `x` or indexing it with a runtime value keeps
+//     it in one block. Fields that are aggregates themselves are split by
+//     the next round, until nothing changes.
+//
+//     Tie declarations initialized by a literal are split into plain
+//     declarations as well, so `[#, 2] [a, b] = x[1]` ends with two scalars.
+//
+
+const int64_t max_replaced_fields = 16;
+
+struct AggregateLocal {
+    ID id;
+    Type type;
+    bool ok = true;
+    std::vector<std::pair<Expr*, int>> projections;
+    std::vector<Expr*> whole_reads;
+};
+
+class ScalarReplacementContext {
+public:
+    ScalarReplacementContext(FunDecl& fun_decl) : fun_decl(fun_decl) {}
+
+    bool run();
+
+private:
+    std::shared_ptr<AggregateLocal> resolve(const ID& id) const;
+    void declare(const ID& id, std::shared_ptr<AggregateLocal> local);
+
+    void visit(Expr& expr);
+    void visit_lvalue(Expr& expr);
+    void visit_assign_target(Expr& expr);
+    void visit(FunBody& body);
+
+    void rewrite(FunBody& body);
+
+    FunDecl& fun_decl;
+    std::vector<std::unordered_map<ID, std::shared_ptr<AggregateLocal>>> scopes;
+    std::unordered_map<const VarDecl*, std::shared_ptr<AggregateLocal>> decls;
+    std::unordered_map<const Assign*, std::shared_ptr<AggregateLocal>> whole_writes;
+    std::unordered_set<const VarDecl*> tie_decls;
+};
+
+int64_t field_count(const Type& type) {
+    if (std::holds_alternative<Type::Tuple>(type.var)) {
+        return std::get<Type::Tuple>(type.var).size();
+    } else if (std::holds_alternative<Type::Array>(type.var)) {
+        return std::get<Type::Array>(type.var).second;
+    }
+    return 0;
+}
+
+Type field_type(const Type& type, int idx) {
+    if (std::holds_alternative<Type::Tuple>(type.var)) {
+        return std::get<Type::Tuple>(type.var)[idx];
+    }
+    return std::get<Type::Array>(type.var).first;
+}
+
+ID field_id(const ID& id, int idx) {
+    return ID{ .name = id.name + "$" + std::to_string(idx) };
+}
+
+// Elements of a tuple, array or string literal, empty if `expr` isn't one
+std::optional<std::vector<Expr>> literal_fields(const Expr& expr) {
+    if (!std::holds_alternative<TypeExpr>(expr.var)) {
+        return {};
+    }
+    const auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+    if (std::holds_alternative<TupleExpr>(type_expr)) {
+        return std::get<TupleExpr>(type_expr).exprs;
+    } else if (std::holds_alternative<ArrayExpr>(type_expr)) {
+        return std::get<ArrayExpr>(type_expr).exprs;
+    } else if (std::holds_alternative<std::string>(type_expr)) {
+        Type char_type;
+        char_type.var = Type::Primitive::CHAR;
+        std::vector<Expr> fields;
+        for (char c : std::get<std::string>(type_expr)) {
+            Expr field;
+            field.var = TypeExpr{ .expr = c };
+            field.type = std::make_shared<Type>(char_type);
+            fields.push_back(field);
+        }
+        return fields;
+    }
+    return {};
+}
+
+bool mentions(const Expr& expr, const std::vector<ID>& ids) {
+    bool res = false;
+    walk(expr, [&](const Expr& sub_expr) {
+        if (std::holds_alternative<ID>(sub_expr.var)) {
+            const ID& id = std::get<ID>(sub_expr.var);
+            res |= std::find(ids.begin(), ids.end(), id) != ids.end();
+        }
+    });
+    return res;
+}
+
+bool splittable_init(const Expr& expr, int64_t count, const std::vector<ID>& ids) {
+    auto fields = literal_fields(expr);
+    return fields && int64_t(fields->size()) == count && !mentions(expr, ids);
+}
+
+std::shared_ptr<AggregateLocal> ScalarReplacementContext::resolve(const ID& id) const {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+        auto found = it->find(id);
+        if (found != it->end()) {
+            return found->second;
+        }
+    }
+    return nullptr;
+}
+
+void ScalarReplacementContext::declare(const ID& id, std::shared_ptr<AggregateLocal> local) {
+    scopes.back()[id] = local;
+}
+
+void ScalarReplacementContext::visit(Expr& expr) {
+    if (std::holds_alternative<ID>(expr.var)) {
+        auto local = resolve(std::get<ID>(expr.var));
+        if (local) {
+            local->whole_reads.push_back(&expr);
+        }
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        std::shared_ptr<AggregateLocal> local;
+        if (std::holds_alternative<ID>(deref_tuple.tuple_expr->var)) {
+            local = resolve(std::get<ID>(deref_tuple.tuple_expr->var));
+        }
+        if (local) {
+            local->projections.emplace_back(&expr, *get_valid_index(*deref_tuple.deref_expr));
+        } else {
+            visit(*deref_tuple.tuple_expr);
+        }
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        std::shared_ptr<AggregateLocal> local;
+        if (std::holds_alternative<ID>(deref_array.array_expr->var)) {
+            local = resolve(std::get<ID>(deref_array.array_expr->var));
+        }
+        if (local) {
+            auto idx = get_valid_index(*deref_array.deref_expr);
+            if (idx && *idx >= 0 && *idx < field_count(local->type)) {
+                local->projections.emplace_back(&expr, *idx);
+            } else {
+                local->ok = false;
+            }
+        } else {
+            visit(*deref_array.array_expr);
+        }
+        visit(*deref_array.deref_expr);
+    } else if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        visit(*bin_op.left_expr);
+        visit(*bin_op.right_expr);
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        auto& fun_call = std::get<FunCall>(expr.var);
+        visit(*fun_call.fun);
+        if (fun_call.fun_args) {
+            for (Expr& arg : *fun_call.fun_args) {
+                visit(arg);
+            }
+        }
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        if (std::holds_alternative<PtrExpr>(type_expr)) {
+            PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr);
+            if (ptr_expr.ref_expr) {
+                visit_lvalue(*ptr_expr.ref_expr);
+            } else if (ptr_expr.deref_expr) {
+                visit(*ptr_expr.deref_expr);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr)) {
+            for (Expr& sub_expr : std::get<TupleExpr>(type_expr).exprs) {
+                visit(sub_expr);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr)) {
+            for (Expr& sub_expr : std::get<ArrayExpr>(type_expr).exprs) {
+                visit(sub_expr);
+            }
+        }
+    }
+}
+
+void ScalarReplacementContext::visit_lvalue(Expr& expr) {
+    // Anything whose address escapes has to stay in memory
+    if (std::holds_alternative<ID>(expr.var)) {
+        auto local = resolve(std::get<ID>(expr.var));
+        if (local) {
+            local->ok = false;
+        }
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        visit_lvalue(*std::get<DerefTuple>(expr.var).tuple_expr);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        visit_lvalue(*std::get<DerefArray>(expr.var).array_expr);
+        visit(*std::get<DerefArray>(expr.var).deref_expr);
+    } else {
+        visit(expr);
+    }
+}
+
+void ScalarReplacementContext::visit_assign_target(Expr& expr) {
+    if (std::holds_alternative<DerefTuple>(expr.var)) {
+        auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        std::shared_ptr<AggregateLocal> local;
+        if (std::holds_alternative<ID>(deref_tuple.tuple_expr->var)) {
+            local = resolve(std::get<ID>(deref_tuple.tuple_expr->var));
+        }
+        if (local) {
+            local->projections.emplace_back(&expr, *get_valid_index(*deref_tuple.deref_expr));
+        } else {
+            visit_assign_target(*deref_tuple.tuple_expr);
+        }
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        std::shared_ptr<AggregateLocal> local;
+        if (std::holds_alternative<ID>(deref_array.array_expr->var)) {
+            local = resolve(std::get<ID>(deref_array.array_expr->var));
+        }
+        if (local) {
+            auto idx = get_valid_index(*deref_array.deref_expr);
+            if (idx && *idx >= 0 && *idx < field_count(local->type)) {
+                local->projections.emplace_back(&expr, *idx);
+            } else {
+                local->ok = false;
+            }
+        } else {
+            visit_assign_target(*deref_array.array_expr);
+        }
+        visit(*deref_array.deref_expr);
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var).expr;
+        if (std::holds_alternative<PtrExpr>(type_expr) && std::get<PtrExpr>(type_expr).deref_expr) {
+            visit(*std::get<PtrExpr>(type_expr).deref_expr);
+        }
+    }
+}
+
+void ScalarReplacementContext::visit(FunBody& body) {
+    scopes.emplace_back();
+    for (FunBodyPart& part : body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                visit(*var_decl.expr);
+            }
+            if (!var_decl.ids) {
+                continue;
+            }
+
+            const std::vector<ID>& ids = *var_decl.ids;
+            Type type = var_decl.type ? *var_decl.type : *var_decl.expr->type;
+            int64_t count = field_count(type);
+            bool splittable = count > 0 && count <= max_replaced_fields
+                && (!var_decl.expr || splittable_init(*var_decl.expr, count, ids));
+
+            if (ids.size() == 1 && splittable) {
+                auto local = std::make_shared<AggregateLocal>();
+                local->id = ids[0];
+                local->type = type;
+                decls[&var_decl] = local;
+                declare(ids[0], local);
+                continue;
+            }
+            if (ids.size() > 1 && var_decl.expr && splittable) {
+                tie_decls.insert(&var_decl);
+            }
+            for (const ID& id : ids) {
+                declare(id, nullptr);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            visit(assign.expr);
+
+            if (std::holds_alternative<ID>(assign.assign_expr.var)) {
+                const ID& id = std::get<ID>(assign.assign_expr.var);
+                auto local = resolve(id);
+                if (local) {
+                    if (splittable_init(assign.expr, field_count(local->type), { id })) {
+                        whole_writes[&assign] = local;
+                    } else {
+                        local->ok = false;
+                    }
+                }
+            } else {
+                visit_assign_target(assign.assign_expr);
+            }
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            visit(std::get<Expr>(part.var));
+        } else if (std::holds_alternative<Print>(part.var)) {
+            visit(std::get<Print>(part.var).expr);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                for (IfCond& if_cond : cond.if_conds) {
+                    visit(if_cond.expr);
+                    visit(if_cond.body);
+                }
+                if (cond.else_body) {
+                    visit(*cond.else_body);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                Loop& loop = std::get<Loop>(flow.var);
+                visit(loop.expr);
+                visit(loop.body);
+            } else {
+                auto& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    visit(*control.second);
+                }
+            }
+        }
+    }
+    scopes.pop_back();
+}
+
+void ScalarReplacementContext::rewrite(FunBody& body) {
+    std::vector<FunBodyPart> parts;
+    for (FunBodyPart& part : body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            auto decl = decls.find(&var_decl);
+            bool split_aggregate = decl != decls.end() && decl->second->ok;
+            if (split_aggregate || tie_decls.count(&var_decl)) {
+                Type type = var_decl.type ? *var_decl.type : *var_decl.expr->type;
+                auto fields = var_decl.expr ? literal_fields(*var_decl.expr) : std::nullopt;
+                for (int64_t i = 0; i < field_count(type); ++i) {
+                    VarDecl field_decl;
+                    field_decl.type = field_type(type, i);
+                    if (split_aggregate) {
+                        field_decl.ids = { field_id(decl->second->id, i) };
+                    } else {
+                        field_decl.ids = { (*var_decl.ids)[i] };
+                    }
+                    if (fields) {
+                        field_decl.expr = (*fields)[i];
+                    }
+                    FunBodyPart field_part;
+                    field_part.var = std::move(field_decl);
+                    parts.push_back(field_part);
+                }
+                continue;
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            auto write = whole_writes.find(&assign);
+            if (write != whole_writes.end() && write->second->ok) {
+                const AggregateLocal& local = *write->second;
+                auto fields = literal_fields(assign.expr);
+                for (int64_t i = 0; i < field_count(local.type); ++i) {
+                    auto type = std::make_shared<Type>(field_type(local.type, i));
+                    FunBodyPart field_part;
+                    field_part.var = Assign{
+                        .assign_expr = make_id_expr(field_id(local.id, i), type),
+                        .expr        = (*fields)[i],
+                    };
+                    parts.push_back(field_part);
+                }
+                continue;
+            }
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                for (IfCond& if_cond : cond.if_conds) {
+                    rewrite(if_cond.body);
+                }
+                if (cond.else_body) {
+                    rewrite(*cond.else_body);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                rewrite(std::get<Loop>(flow.var).body);
+            }
+        }
+        parts.push_back(std::move(part));
+    }
+    body.parts = std::move(parts);
+}
+
+bool ScalarReplacementContext::run() {
+    scopes.emplace_back();
+    for (const FunArg& arg : fun_decl.args) {
+        declare(arg.id, nullptr);
+    }
+    visit(fun_decl.body);
+    scopes.pop_back();
+
+    bool changed = !tie_decls.empty();
+    for (const auto& [var_decl, local] : decls) {
+        if (!local->ok) {
+            continue;
+        }
+        changed = true;
+
+        for (const auto& [expr, idx] : local->projections) {
+            expr->var = field_id(local->id, idx);
+            expr->type = std::make_shared<Type>(field_type(local->type, idx));
+        }
+        for (Expr* expr : local->whole_reads) {
+            std::vector<Expr> fields;
+            for (int64_t i = 0; i < field_count(local->type); ++i) {
+                auto type = std::make_shared<Type>(field_type(local->type, i));
+                fields.push_back(make_id_expr(field_id(local->id, i), type));
+            }
+            if (std::holds_alternative<Type::Tuple>(local->type.var)) {
+                expr->var = TypeExpr{ .expr = TupleExpr{ .exprs = std::move(fields) } };
+            } else {
+                expr->var = TypeExpr{ .expr = ArrayExpr{ .exprs = std::move(fields) } };
+            }
+        }
+    }
+
+    rewrite(fun_decl.body);
+    return changed;
+}
+
+void scalar_replacement(FunDecl& fun_decl) {
+    // Each round splits one level of nesting
+    while (ScalarReplacementContext(fun_decl).run()) {}
+}
+
+}
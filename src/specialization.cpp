@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <climits>
+
+#include "optimizer.hpp"
+
+namespace foc {
+
+//*********************************************
+// Function specialization:
+//     A direct call passing constants, i.e. int, char and bool literals and
+//     tuples of them, to arguments its function never assigns, redeclares or
+//     takes the address of, calls a copy of the function specialized for
+//     these values instead. The copy takes only the other arguments, reads of
+//     the specialized ones are replaced by the constants and then folded:
+//       - operations on constants and elements of tuple literals are computed
+//       - `if` / `elif` branches on a constant false condition are dropped,
+//         a constant true one becomes the `else` of the ones before it
+//       - loops on a constant false condition are dropped
+//     A copy nothing could be folded in isn't worth its code and is dropped.
+//
+//     Copies are named after their function and the constants they were made
+//     for, e.g. `scale.3._` for `scale(3, x)`, so the same call gets the same
+//     label no matter what else is in the program, and calls passing the same
+//     constants share a copy. Copies are specialized further when they pass
+//     constants themselves, recursive calls passing their own constants on
+//     call the copy itself.
+//
+//     Only functions of at most max_specialized_size statements are copied,
+//     at most max_specializations times each, and all copies together may
+//     have at most specialization_budget statements. The limit per function
+//     also stops recursion with changing constants, e.g. `fib(n - 1)`, from
+//     eating the whole budget. A function that isn't used anymore afterwards
+//     is removed.
+//
+
+const int64_t max_specialized_size = 64;
+const int64_t max_specializations = 8;
+const int64_t specialization_budget = 256;
+
+bool is_primitive(const Type& type, Type::Primitive primitive) {
+    return std::holds_alternative<Type::Primitive>(type.var) && std::get<Type::Primitive>(type.var) == primitive;
+}
+
+bool is_specializable_type(const Type& type) {
+    if (std::holds_alternative<Type::Tuple>(type.var)) {
+        const Type::Tuple& tuple_type = std::get<Type::Tuple>(type.var);
+        return std::all_of(tuple_type.begin(), tuple_type.end(), is_specializable_type);
+    }
+    return is_primitive(type, Type::Primitive::INT) || is_primitive(type, Type::Primitive::CHAR)
+        || is_primitive(type, Type::Primitive::BOOL);
+}
+
+Expr make_bool_expr(bool value) {
+    Type bool_type;
+    bool_type.var = Type::Primitive::BOOL;
+    Expr res;
+    res.var = TypeExpr{ .expr = value };
+    res.type = std::make_shared<Type>(bool_type);
+    return res;
+}
+
+// Value of a constant int or bool expression, chars are their code
+std::optional<int64_t> constant_value(const Expr& expr) {
+    std::optional<int64_t> res;
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        const auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<int>(type_expr.expr)) {
+            res = std::get<int>(type_expr.expr);
+        } else if (std::holds_alternative<bool>(type_expr.expr)) {
+            res = std::get<bool>(type_expr.expr);
+        } else if (std::holds_alternative<char>(type_expr.expr) && !expr.minus) {
+            res = std::get<char>(type_expr.expr);
+        }
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        const Expr& tuple_expr = *deref_tuple.tuple_expr;
+        if (!std::holds_alternative<TypeExpr>(tuple_expr.var)
+            || !std::holds_alternative<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr) || !is_pure(tuple_expr)) {
+            return {};
+        }
+        int idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+        res = constant_value(std::get<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr).exprs[idx]);
+    } else if (std::holds_alternative<BinOperation>(expr.var)) {
+        const auto& bin_op = std::get<BinOperation>(expr.var);
+        auto left = constant_value(*bin_op.left_expr);
+        auto right = constant_value(*bin_op.right_expr);
+        if (!left || !right) {
+            return {};
+        }
+        switch (bin_op.op) {
+            // Wrapping around like the 64 bit registers do
+            case BinOperation::PLUS:      res = int64_t(uint64_t(*left) + uint64_t(*right)); break;
+            case BinOperation::MINUS:     res = int64_t(uint64_t(*left) - uint64_t(*right)); break;
+            case BinOperation::STAR:      res = int64_t(uint64_t(*left) * uint64_t(*right)); break;
+            case BinOperation::SLASH:
+                if (*right == 0 || (*left == INT64_MIN && *right == -1)) {
+                    return {};
+                }
+                res = *left / *right;
+                break;
+            case BinOperation::IS_EQUAL:  res = *left == *right; break;
+            case BinOperation::NOT_EQUAL: res = *left != *right; break;
+            // Bitwise in values, but short circuiting in conditions, which only agree on bools
+            case BinOperation::AND:
+            case BinOperation::OR:
+                if ((*left != 0 && *left != 1) || (*right != 0 && *right != 1)) {
+                    return {};
+                }
+                res = bin_op.op == BinOperation::AND ? *left & *right : *left | *right;
+                break;
+            case BinOperation::LESS:      res = *left < *right; break;
+            case BinOperation::GREATER:   res = *left > *right; break;
+            case BinOperation::LEQ:       res = *left <= *right; break;
+            case BinOperation::GEQ:       res = *left >= *right; break;
+        }
+    }
+    if (!res || !expr.minus) {
+        return res;
+    }
+    // `-` of a bool negates it
+    if (is_primitive(*expr.type, Type::Primitive::BOOL)) {
+        return *res ^ 1;
+    }
+    if (is_primitive(*expr.type, Type::Primitive::INT)) {
+        return int64_t(0 - uint64_t(*res));
+    }
+    return {};
+}
+
+// Whether `expr` is 0 or 1, as compared to an int used as a bool
+bool is_bool_valued(const Expr& expr) {
+    if (std::holds_alternative<TypeExpr>(expr.var)) {
+        return std::holds_alternative<bool>(std::get<TypeExpr>(expr.var).expr);
+    }
+    if (!std::holds_alternative<BinOperation>(expr.var)) {
+        return false;
+    }
+    const auto& bin_op = std::get<BinOperation>(expr.var);
+    switch (bin_op.op) {
+        case BinOperation::PLUS:
+        case BinOperation::MINUS:
+        case BinOperation::STAR:
+        case BinOperation::SLASH:
+            return false;
+        case BinOperation::AND:
+        case BinOperation::OR:
+            return is_bool_valued(*bin_op.left_expr) && is_bool_valued(*bin_op.right_expr);
+        default:
+            return true;
+    }
+}
+
+// The literal `expr` evaluates to, if it's constant
+std::optional<Expr> constant_literal(const Expr& expr) {
+    if (std::holds_alternative<TypeExpr>(expr.var)
+        && std::holds_alternative<TupleExpr>(std::get<TypeExpr>(expr.var).expr)) {
+        Expr res = clone(expr);
+        for (Expr& element : std::get<TupleExpr>(std::get<TypeExpr>(res.var).expr).exprs) {
+            auto element_literal = constant_literal(element);
+            if (!element_literal) {
+                return {};
+            }
+            element = *element_literal;
+        }
+        return res;
+    }
+    auto value = constant_value(expr);
+    if (!value) {
+        return {};
+    }
+    if (is_primitive(*expr.type, Type::Primitive::BOOL)) {
+        return make_bool_expr(*value);
+    }
+    if (is_primitive(*expr.type, Type::Primitive::INT) && *value >= INT_MIN && *value <= INT_MAX) {
+        return make_int_expr(*value);
+    }
+    if (is_primitive(*expr.type, Type::Primitive::CHAR) && !expr.minus
+        && std::holds_alternative<TypeExpr>(expr.var)) {
+        return clone(expr);
+    }
+    return {};
+}
+
+// Part of a copy's label naming the literal it was made for
+std::string literal_key(const Expr& literal) {
+    const TypeExpr& type_expr = std::get<TypeExpr>(literal.var);
+    if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+        std::string res = "t";
+        for (const Expr& element : std::get<TupleExpr>(type_expr.expr).exprs) {
+            res += (res.size() > 1 ? "_" : "") + literal_key(element);
+        }
+        return res + "e";
+    }
+    if (std::holds_alternative<bool>(type_expr.expr)) {
+        return std::get<bool>(type_expr.expr) ? "T" : "F";
+    }
+    if (std::holds_alternative<char>(type_expr.expr)) {
+        return "c" + std::to_string(int(std::get<char>(type_expr.expr)));
+    }
+    int64_t value = std::get<int>(type_expr.expr);
+    value = literal.minus ? -value : value;
+    return value < 0 ? "m" + std::to_string(-value) : std::to_string(value);
+}
+
+void collect_declared(const FunBody& fun_body, std::unordered_set<std::string>& names) {
+    for (const FunBodyPart& part : fun_body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            const VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.ids) {
+                for (const ID& id : *var_decl.ids) {
+                    names.insert(id.name);
+                }
+            }
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            const Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                const Cond& cond = std::get<Cond>(flow.var);
+                for (const IfCond& if_cond : cond.if_conds) {
+                    collect_declared(if_cond.body, names);
+                }
+                if (cond.else_body) {
+                    collect_declared(*cond.else_body, names);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                collect_declared(std::get<Loop>(flow.var).body, names);
+            }
+        }
+    }
+}
+
+class SpecializationContext {
+public:
+    SpecializationContext(Program& program, std::unordered_set<ID>& fun_ids) : program(program), fun_ids(fun_ids) {}
+
+    void run();
+
+private:
+    std::vector<bool> specializable_args(const FunDecl& fun_decl) const;
+    std::optional<FunDecl> specialize(const FunDecl& fun_decl, const std::string& name,
+                                      const std::vector<std::optional<Expr>>& literals);
+    void visit(Expr& expr, const std::unordered_set<std::string>& declared);
+    void visit(FunBody& body, const std::unordered_set<std::string>& declared);
+    void fold(Expr& expr);
+    void fold(FunBody& body);
+    void remove_unused();
+
+    Program& program;
+    std::unordered_set<ID>& fun_ids;
+
+    int64_t budget = specialization_budget;
+    int64_t folds = 0;
+    // Copies made (or found not worth it, empty) for a label
+    std::unordered_map<std::string, std::optional<std::string>> copies;
+    std::unordered_map<std::string, int64_t> copy_counts;
+    std::unordered_set<std::string> specialized;
+    std::vector<FunDecl> pending;
+};
+
+// Arguments of `fun_decl` it could be specialized for
+std::vector<bool> SpecializationContext::specializable_args(const FunDecl& fun_decl) const {
+    std::unordered_set<ID> assigned;
+    bool writes_memory = false;
+    collect_assigned(fun_decl.body, assigned, writes_memory);
+    collect_address_taken(fun_decl.body, assigned);
+    std::unordered_set<std::string> declared;
+    collect_declared(fun_decl.body, declared);
+
+    std::vector<bool> res;
+    for (const FunArg& arg : fun_decl.args) {
+        res.push_back(is_specializable_type(arg.type) && !assigned.count(arg.id) && !declared.count(arg.id.name));
+    }
+    return res;
+}
+
+// Copy of `fun_decl` with the arguments with a literal replaced by it, if anything could be folded
+std::optional<FunDecl> SpecializationContext::specialize(const FunDecl& fun_decl, const std::string& name,
+                                                         const std::vector<std::optional<Expr>>& literals) {
+    FunDecl res{ .ret_type = fun_decl.ret_type, .id = ID{ name }, .args = {}, .body = clone(fun_decl.body) };
+    for (size_t i = 0; i < fun_decl.args.size(); ++i) {
+        if (!literals[i]) {
+            res.args.push_back(fun_decl.args[i]);
+            continue;
+        }
+        for (Expr* use : collect_uses(res.body, fun_decl.args[i].id)) {
+            bool minus = use->minus;
+            *use = clone(*literals[i]);
+            use->minus ^= minus;
+        }
+    }
+
+    folds = 0;
+    fold(res.body);
+    if (folds == 0) {
+        return {};
+    }
+    return res;
+}
+
+void SpecializationContext::fold(Expr& expr) {
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        fold(*bin_op.left_expr);
+        fold(*bin_op.right_expr);
+    } else if (std::holds_alternative<DerefArray>(expr.var)) {
+        auto& deref_array = std::get<DerefArray>(expr.var);
+        fold(*deref_array.array_expr);
+        fold(*deref_array.deref_expr);
+    } else if (std::holds_alternative<DerefTuple>(expr.var)) {
+        fold(*std::get<DerefTuple>(expr.var).tuple_expr);
+    } else if (std::holds_alternative<FunCall>(expr.var)) {
+        auto& fun_call = std::get<FunCall>(expr.var);
+        fold(*fun_call.fun);
+        if (fun_call.fun_args) {
+            for (Expr& arg : *fun_call.fun_args) {
+                fold(arg);
+            }
+        }
+    } else if (std::holds_alternative<TypeExpr>(expr.var)) {
+        auto& type_expr = std::get<TypeExpr>(expr.var);
+        if (std::holds_alternative<PtrExpr>(type_expr.expr)) {
+            PtrExpr& ptr_expr = std::get<PtrExpr>(type_expr.expr);
+            if (ptr_expr.ref_expr) {
+                fold(*ptr_expr.ref_expr);
+            }
+            if (ptr_expr.deref_expr) {
+                fold(*ptr_expr.deref_expr);
+            }
+        } else if (std::holds_alternative<TupleExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<TupleExpr>(type_expr.expr).exprs) {
+                fold(sub_expr);
+            }
+        } else if (std::holds_alternative<ArrayExpr>(type_expr.expr)) {
+            for (Expr& sub_expr : std::get<ArrayExpr>(type_expr.expr).exprs) {
+                fold(sub_expr);
+            }
+        }
+        return;
+    }
+
+    if (!std::holds_alternative<BinOperation>(expr.var) && !std::holds_alternative<DerefTuple>(expr.var)) {
+        return;
+    }
+    if (auto literal = constant_literal(expr)) {
+        expr = *literal;
+        ++folds;
+        return;
+    }
+    // `T && x`, `F || x` are `x`, and `F && x`, `T || x` don't depend on a side effect free `x`
+    if (std::holds_alternative<BinOperation>(expr.var)) {
+        auto& bin_op = std::get<BinOperation>(expr.var);
+        if (bin_op.op != BinOperation::AND && bin_op.op != BinOperation::OR) {
+            return;
+        }
+        auto left = constant_value(*bin_op.left_expr);
+        auto right = constant_value(*bin_op.right_expr);
+        if (!left && !right) {
+            return;
+        }
+        std::shared_ptr<Expr> other = left ? bin_op.right_expr : bin_op.left_expr;
+        int64_t value = left ? *left : *right;
+        if (!is_pure(*other) || !is_bool_valued(*other) || (value != 0 && value != 1)) {
+            return;
+        }
+        bool minus = expr.minus;
+        if (value == (bin_op.op == BinOperation::AND)) {
+            expr = *other;
+        } else {
+            expr = make_bool_expr(value);
+        }
+        expr.minus ^= minus;
+        ++folds;
+        return;
+    }
+    // Non-scalar elements of tuple literals
+    if (std::holds_alternative<DerefTuple>(expr.var) && !expr.minus) {
+        const auto& deref_tuple = std::get<DerefTuple>(expr.var);
+        const Expr& tuple_expr = *deref_tuple.tuple_expr;
+        if (!tuple_expr.minus && std::holds_alternative<TypeExpr>(tuple_expr.var)
+            && std::holds_alternative<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr) && is_pure(tuple_expr)) {
+            int idx = std::get<int>(std::get<TypeExpr>(deref_tuple.deref_expr->var).expr);
+            Expr element = std::get<TupleExpr>(std::get<TypeExpr>(tuple_expr.var).expr).exprs[idx];
+            expr = element;
+            ++folds;
+        }
+    }
+}
+
+void SpecializationContext::fold(FunBody& body) {
+    std::vector<FunBodyPart> parts;
+    for (FunBodyPart& part : body.parts) {
+        // Nothing after a return, break or continue is reached, e.g. after a branch that is always taken
+        if (!parts.empty() && std::holds_alternative<Flow>(parts.back().var)
+            && std::holds_alternative<Flow::Control>(std::get<Flow>(parts.back().var).var)) {
+            break;
+        }
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                fold(*var_decl.expr);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            fold(assign.expr);
+            fold(assign.assign_expr);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            fold(std::get<Expr>(part.var));
+        } else if (std::holds_alternative<Print>(part.var)) {
+            fold(std::get<Print>(part.var).expr);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                std::vector<IfCond> if_conds;
+                for (IfCond& if_cond : cond.if_conds) {
+                    fold(if_cond.expr);
+                    auto value = constant_value(if_cond.expr);
+                    if (!value) {
+                        fold(if_cond.body);
+                        if_conds.push_back(std::move(if_cond));
+                        continue;
+                    }
+                    ++folds;
+                    if (*value) {
+                        cond.else_body = std::move(if_cond.body);
+                        break;
+                    }
+                }
+                if (cond.else_body) {
+                    fold(*cond.else_body);
+                }
+                cond.if_conds = std::move(if_conds);
+                if (!cond.if_conds.empty()) {
+                    parts.push_back(std::move(part));
+                    continue;
+                }
+                if (!cond.else_body) {
+                    continue;
+                }
+                // Only the else is left, its statements can join the enclosing body unless it declares something
+                bool declares = std::any_of(cond.else_body->parts.begin(), cond.else_body->parts.end(),
+                                            [](const FunBodyPart& else_part) {
+                                                return std::holds_alternative<VarDecl>(else_part.var);
+                                            });
+                if (!declares) {
+                    for (FunBodyPart& else_part : cond.else_body->parts) {
+                        parts.push_back(std::move(else_part));
+                    }
+                } else {
+                    cond.if_conds.push_back(IfCond{ .expr = make_bool_expr(true), .body = std::move(*cond.else_body) });
+                    cond.else_body.reset();
+                    parts.push_back(std::move(part));
+                }
+                continue;
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                Loop& loop = std::get<Loop>(flow.var);
+                fold(loop.expr);
+                auto value = constant_value(loop.expr);
+                if (value && !*value) {
+                    ++folds;
+                    continue;
+                }
+                fold(loop.body);
+            } else {
+                Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    fold(*control.second);
+                }
+            }
+        }
+        parts.push_back(std::move(part));
+    }
+    body.parts = std::move(parts);
+}
+
+void SpecializationContext::visit(Expr& expr, const std::unordered_set<std::string>& declared) {
+    std::vector<Expr*> calls;
+    walk(expr, [&](const Expr& sub_expr) {
+        if (std::holds_alternative<FunCall>(sub_expr.var)) {
+            // The walker only hands out const references, the tree itself is ours
+            calls.push_back(const_cast<Expr*>(&sub_expr));
+        }
+    });
+
+    // Inner calls first, rewriting an outer one moves its arguments
+    for (auto it = calls.rbegin(); it != calls.rend(); ++it) {
+        Expr* call = *it;
+        auto& fun_call = std::get<FunCall>(call->var);
+        const Expr& fun = *fun_call.fun;
+        if (fun.minus || !std::holds_alternative<ID>(fun.var) || !fun_call.fun_args) {
+            continue;
+        }
+        const ID& callee_id = std::get<ID>(fun.var);
+        if (!fun_ids.count(callee_id) || declared.count(callee_id.name) || callee_id.name == "main") {
+            continue;
+        }
+        auto callee = std::find_if(program.decls.begin(), program.decls.end(), [&](const FunDecl& fun_decl) {
+            return fun_decl.id == callee_id;
+        });
+        if (callee == program.decls.end()) {
+            continue;
+        }
+
+        std::vector<bool> specializable = specializable_args(*callee);
+        std::vector<std::optional<Expr>> literals;
+        std::string name = callee_id.name;
+        bool any = false;
+        for (size_t i = 0; i < fun_call.fun_args->size(); ++i) {
+            literals.push_back(specializable[i] ? constant_literal((*fun_call.fun_args)[i]) : std::nullopt);
+            name += "." + (literals.back() ? literal_key(*literals.back()) : "_");
+            any |= literals.back().has_value();
+        }
+        if (!any) {
+            continue;
+        }
+
+        auto copy = copies.find(name);
+        if (copy == copies.end()) {
+            std::optional<FunDecl> res;
+            int64_t size = body_size(callee->body);
+            if (size <= max_specialized_size && size <= budget && copy_counts[callee_id.name] < max_specializations) {
+                res = specialize(*callee, name, literals);
+            }
+            if (res) {
+                budget -= body_size(res->body);
+                ++copy_counts[callee_id.name];
+                specialized.insert(callee_id.name);
+                pending.push_back(std::move(*res));
+            }
+            copy = copies.emplace(name, res ? std::optional<std::string>(name) : std::nullopt).first;
+        }
+        if (!copy->second) {
+            continue;
+        }
+
+        // Call the copy with the remaining arguments
+        Type::Fun fun_type = std::get<Type::Fun>(fun.type->var);
+        auto args = std::make_shared<std::vector<Expr>>();
+        Type::Tuple arg_types;
+        for (size_t i = 0; i < literals.size(); ++i) {
+            if (!literals[i]) {
+                args->push_back(std::move((*fun_call.fun_args)[i]));
+                arg_types.push_back(fun_type.first[i]);
+            }
+        }
+        Type copy_type;
+        copy_type.var = Type::Fun{ arg_types, fun_type.second };
+        fun_call.fun = std::make_shared<Expr>(make_id_expr(ID{ *copy->second }, std::make_shared<Type>(copy_type)));
+        fun_call.fun_args = args;
+    }
+}
+
+void SpecializationContext::visit(FunBody& body, const std::unordered_set<std::string>& declared) {
+    for (FunBodyPart& part : body.parts) {
+        if (std::holds_alternative<VarDecl>(part.var)) {
+            VarDecl& var_decl = std::get<VarDecl>(part.var);
+            if (var_decl.expr) {
+                visit(*var_decl.expr, declared);
+            }
+        } else if (std::holds_alternative<Assign>(part.var)) {
+            Assign& assign = std::get<Assign>(part.var);
+            visit(assign.expr, declared);
+            visit(assign.assign_expr, declared);
+        } else if (std::holds_alternative<Expr>(part.var)) {
+            visit(std::get<Expr>(part.var), declared);
+        } else if (std::holds_alternative<Print>(part.var)) {
+            visit(std::get<Print>(part.var).expr, declared);
+        } else if (std::holds_alternative<Flow>(part.var)) {
+            Flow& flow = std::get<Flow>(part.var);
+            if (std::holds_alternative<Cond>(flow.var)) {
+                Cond& cond = std::get<Cond>(flow.var);
+                for (IfCond& if_cond : cond.if_conds) {
+                    visit(if_cond.expr, declared);
+                    visit(if_cond.body, declared);
+                }
+                if (cond.else_body) {
+                    visit(*cond.else_body, declared);
+                }
+            } else if (std::holds_alternative<Loop>(flow.var)) {
+                Loop& loop = std::get<Loop>(flow.var);
+                visit(loop.expr, declared);
+                visit(loop.body, declared);
+            } else {
+                Flow::Control& control = std::get<Flow::Control>(flow.var);
+                if (control.second) {
+                    visit(*control.second, declared);
+                }
+            }
+        }
+    }
+}
+
+// Drops specialized functions nothing refers to anymore
+void SpecializationContext::remove_unused() {
+    std::unordered_set<std::string> used;
+    for (const FunDecl& fun_decl : program.decls) {
+        // Recursive calls don't keep a function alive
+        walk(fun_decl.body, [&](const Expr& expr) {
+            if (std::holds_alternative<ID>(expr.var) && std::get<ID>(expr.var) != fun_decl.id) {
+                used.insert(std::get<ID>(expr.var).name);
+            } else if (std::holds_alternative<FunCall>(expr.var)) {
+                for (const ID& target : std::get<FunCall>(expr.var).targets) {
+                    used.insert(target.name);
+                }
+            }
+        });
+    }
+
+    std::vector<FunDecl> decls;
+    for (FunDecl& fun_decl : program.decls) {
+        if (specialized.count(fun_decl.id.name) && !used.count(fun_decl.id.name) && fun_decl.id.name != "main") {
+            fun_ids.erase(fun_decl.id);
+            continue;
+        }
+        decls.push_back(std::move(fun_decl));
+    }
+    program.decls = std::move(decls);
+}
+
+void SpecializationContext::run() {
+    // Copies are visited as well once they are added
+    for (size_t i = 0; i < program.decls.size(); ++i) {
+        std::unordered_set<std::string> declared;
+        for (const FunArg& arg : program.decls[i].args) {
+            declared.insert(arg.id.name);
+        }
+        collect_declared(program.decls[i].body, declared);
+        visit(program.decls[i].body, declared);
+
+        for (FunDecl& copy : pending) {
+            fun_ids.insert(copy.id);
+            program.decls.push_back(std::move(copy));
+        }
+        pending.clear();
+    }
+    remove_unused();
+}
+
+void specialization(Program& program, std::unordered_set<ID>& fun_ids) {
+    SpecializationContext(program, fun_ids).run();
+}
+
+}
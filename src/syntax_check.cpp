@@ -630,7 +630,7 @@ unsigned syntax_check(const Flow::Control& ctrl, std::shared_ptr<IDContext> cont
 }
 
 unsigned syntax_check(const Flow& flow, std::shared_ptr<IDContext> context, bool in_cycle, const Type& ret_type, unsigned limit) {
-    auto visit_cb = [&](auto arg){
+    auto visit_cb = [&](const auto& arg){
         return syntax_check(arg, context, in_cycle, ret_type, limit);
     };
     return std::visit(visit_cb, flow.var);
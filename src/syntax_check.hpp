@@ -20,6 +20,8 @@ std::optional<Type> get_expr_type(const TypeExpr& expr, std::shared_ptr<IDContex
 std::optional<Type> get_expr_type(const ID& expr, std::shared_ptr<IDContext> context);
 std::optional<Type> get_expr_type(const Expr& expr, std::shared_ptr<IDContext> context);
 
+std::optional<int> get_valid_index(const Expr& expr);
+
 bool is_lvalue(const Expr& expr);
 
 }
@@ -502,16 +502,16 @@ std::string Program::to_string() const {
     return res;
 }
 
-int64_t Type::byte_size() const {
+int64_t Type::byte_size(bool packed) const {
     if (std::holds_alternative<Type::Array>(var)) {
         const Type::Array& array = std::get<Type::Array>(var);
-        return array.first.byte_size() * array.second;
+        return (element_size(packed) * array.second + 7) / 8 * 8;
     } else if (std::holds_alternative<Type::Tuple>(var)) {
         const Type::Tuple& tuple = std::get<Type::Tuple>(var);
 
         size_t tuple_size = 0;
         for (int i = 0; i < tuple.size(); ++i) {
-            tuple_size += tuple[i].byte_size();
+            tuple_size += tuple[i].byte_size(packed);
         }
         return tuple_size;
     } else {
@@ -519,4 +519,15 @@ int64_t Type::byte_size() const {
     }
 }
 
+int64_t Type::element_size(bool packed) const {
+    const Type& el_type = std::get<Type::Array>(var).first;
+    if (packed && std::holds_alternative<Type::Primitive>(el_type.var)) {
+        Type::Primitive primitive = std::get<Type::Primitive>(el_type.var);
+        if (primitive == Type::Primitive::CHAR || primitive == Type::Primitive::BOOL) {
+            return 1;
+        }
+    }
+    return el_type.byte_size(packed);
+}
+
 }
@@ -64,6 +64,8 @@ struct DerefTuple {
 struct FunCall {
     std::shared_ptr<Expr> fun;
     std::shared_ptr<std::vector<Expr>> fun_args;
+    // All functions `fun` may evaluate to, if devirtualization found a few
+    std::vector<ID> targets;
 
     std::string to_string() const;
 };
@@ -152,7 +154,10 @@ struct Type {
 
     std::string to_string() const;
 
-    int64_t byte_size() const;
+    // Packed arrays of chars and bools take a byte per element, padded to 8 bytes
+    int64_t byte_size(bool packed = false) const;
+    // Size of an element of an array type
+    int64_t element_size(bool packed = false) const;
 
     bool is_equivalent(const Type& other) const;
 };